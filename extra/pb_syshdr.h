@@ -98,6 +98,29 @@ static void * memcpy( void *s1, const void *s2, size_t n )
     return s1;
 }
 
+static void * memmove( void * s1, const void * s2, size_t n )
+{
+    char * dest = (char *) s1;
+    const char * src = (const char *) s2;
+    if ( dest <= src )
+    {
+        while ( n-- )
+        {
+            *dest++ = *src++;
+        }
+    }
+    else
+    {
+        src += n;
+        dest += n;
+        while ( n-- )
+        {
+            *--dest = *--src;
+        }
+    }
+    return s1;
+}
+
 static void * memset( void * s, int c, size_t n )
 {
     unsigned char * p = (unsigned char *) s;
@@ -66,6 +66,16 @@ datatypes = {
     FieldD.TYPE_UINT64:     ('uint64_t', 'UINT64',     10,  True)
 }
 
+# Wire types used by generated encode/decode functions
+codegen_wiretypes = {
+    'BOOL': 'PB_WT_VARINT', 'INT32': 'PB_WT_VARINT', 'INT64': 'PB_WT_VARINT',
+    'UINT32': 'PB_WT_VARINT', 'UINT64': 'PB_WT_VARINT', 'SINT32': 'PB_WT_VARINT',
+    'SINT64': 'PB_WT_VARINT', 'ENUM': 'PB_WT_VARINT', 'UENUM': 'PB_WT_VARINT',
+    'FIXED32': 'PB_WT_32BIT', 'SFIXED32': 'PB_WT_32BIT', 'FLOAT': 'PB_WT_32BIT',
+    'FIXED64': 'PB_WT_64BIT', 'SFIXED64': 'PB_WT_64BIT', 'DOUBLE': 'PB_WT_64BIT',
+    'STRING': 'PB_WT_STRING', 'BYTES': 'PB_WT_STRING', 'MESSAGE': 'PB_WT_STRING'
+}
+
 # Integer size overrides (from .proto settings)
 intsizes = {
     nanopb_pb2.IS_8:     'int8_t',
@@ -74,6 +84,24 @@ intsizes = {
     nanopb_pb2.IS_64:    'int64_t',
 }
 
+# Size and alignment of the C types in bytes, used for ordering the struct
+# members with the minimize_padding option.
+ctype_alignments = {
+    'bool': 1, 'char': 1, 'pb_byte_t': 1, 'int8_t': 1, 'uint8_t': 1,
+    'int16_t': 2, 'uint16_t': 2, 'int32_t': 4, 'uint32_t': 4, 'float': 4,
+    'int64_t': 8, 'uint64_t': 8, 'double': 8
+}
+
+# The members are sorted by (alignment, exact). Pointers are 4 or 8 bytes,
+# and pb_size_t is 1, 2 or 4 bytes depending on PB_FIELD_16BIT/32BIT. They
+# go after the other members of 8 and 2 byte alignment, so that there is no
+# padding around them with 32 or 64 bit pointers and 8 or 16 bit pb_size_t.
+POINTER_ALIGNMENT = (8, False)
+PB_SIZE_T_ALIGNMENT = (2, False)
+
+def ctype_alignment(ctype):
+    return (ctype_alignments[ctype], True)
+
 # String types (for python 2 / python 3 compatibility)
 try:
     strtypes = (unicode, str)
@@ -240,6 +268,9 @@ class Field:
         self.array_decl = ""
         self.enc_size = None
         self.ctype = None
+        self.has_bit = None
+        self.hot = field_options.hot
+        self.sized_string = False
 
         self.inline = None
         if field_options.type == nanopb_pb2.FT_INLINE:
@@ -292,8 +323,19 @@ class Field:
             raise Exception("Field %s is defined as static, but max_size or "
                             "max_count is not given." % self.name)
 
+        if field_options.type == nanopb_pb2.FT_HYBRID:
+            if not can_be_static:
+                raise Exception("Field %s is defined as hybrid, but max_size or "
+                                "max_count is not given." % self.name)
+            if (self.rules != 'REPEATED' and
+                    desc.type not in (FieldD.TYPE_STRING, FieldD.TYPE_BYTES)):
+                raise Exception("Field %s: hybrid type is only supported for "
+                                "strings, bytes and repeated fields." % self.name)
+
         if field_options.type == nanopb_pb2.FT_STATIC:
             self.allocation = 'STATIC'
+        elif field_options.type == nanopb_pb2.FT_HYBRID:
+            self.allocation = 'HYBRID'
         elif field_options.type == nanopb_pb2.FT_POINTER:
             self.allocation = 'POINTER'
         elif field_options.type == nanopb_pb2.FT_CALLBACK:
@@ -301,6 +343,11 @@ class Field:
         else:
             raise NotImplementedError(field_options.type)
 
+        # Entries of hybrid arrays are stored like in static arrays.
+        hybrid_array = (self.allocation == 'HYBRID' and self.rules == 'REPEATED')
+        static_data = (self.allocation == 'STATIC' or hybrid_array)
+        typename = self.struct_name + self.name + ('item_t' if hybrid_array else 't')
+
         # Decide the C data type to use in the struct.
         if desc.type in datatypes:
             self.ctype, self.pbtype, self.enc_size, isa = datatypes[desc.type]
@@ -316,22 +363,41 @@ class Field:
             if self.default is not None:
                 self.default = self.ctype + self.default
             self.enc_size = None # Needs to be filled in when enum values are known
+        elif self.allocation == 'HYBRID' and not hybrid_array:
+            # Hybrid strings have an explicit size, like sized strings.
+            self.pbtype = 'BYTES'
+            self.sized_string = (desc.type == FieldD.TYPE_STRING)
+            if self.sized_string and self.default is not None:
+                self.default = self.default.encode('utf-8').decode('latin-1')
+            self.ctype = typename
+        elif desc.type == FieldD.TYPE_STRING and field_options.sized_string and self.allocation != 'CALLBACK':
+            # Sized strings are encoded and decoded like bytes fields, but
+            # the data member has type char.
+            self.pbtype = 'BYTES'
+            self.sized_string = True
+            if self.default is not None:
+                self.default = self.default.encode('utf-8').decode('latin-1')
+            if static_data:
+                self.ctype = typename
+                self.enc_size = varint_max_size(self.max_size) + self.max_size
+            elif self.allocation == 'POINTER':
+                self.ctype = 'pb_bytes_array_t'
         elif desc.type == FieldD.TYPE_STRING:
             self.pbtype = 'STRING'
             self.ctype = 'char'
-            if self.allocation == 'STATIC':
+            if static_data:
                 self.ctype = 'char'
                 self.array_decl += '[%d]' % self.max_size
                 self.enc_size = varint_max_size(self.max_size) + self.max_size
         elif desc.type == FieldD.TYPE_BYTES:
             self.pbtype = 'BYTES'
-            if self.allocation == 'STATIC':
+            if static_data:
                 # Inline STATIC for BYTES is like STATIC for STRING.
                 if self.inline:
                     self.ctype = 'pb_byte_t'
                     self.array_decl += '[%d]' % self.max_size
                 else:
-                    self.ctype = self.struct_name + self.name + 't'
+                    self.ctype = typename
                 self.enc_size = varint_max_size(self.max_size) + self.max_size
             elif self.allocation == 'POINTER':
                 self.ctype = 'pb_bytes_array_t'
@@ -342,36 +408,108 @@ class Field:
         else:
             raise NotImplementedError(desc.type)
 
+        if hybrid_array:
+            # The inline entries are wrapped in a structure together with
+            # the spill pointer. String entries need a typedef for the
+            # char array.
+            self.item_ctype = typename if self.pbtype == 'STRING' else self.ctype
+            self.ctype = self.struct_name + self.name + 't'
+            self.array_decl = ''
+
     def __lt__(self, other):
         return self.tag < other.tag
 
     def __str__(self):
-        result = ''
-        if self.allocation == 'POINTER':
-            if self.rules == 'REPEATED':
-                result += '    pb_size_t ' + self.name + '_count;\n'
+        size = self.size_member()
+        if size is None:
+            return self.data_member()
+        else:
+            return size + '\n' + self.data_member()
+
+    def size_member(self):
+        '''Return the declaration of the has_ or _count member, or None.'''
+        if self.rules == 'REPEATED' and self.allocation in ('STATIC', 'POINTER', 'HYBRID'):
+            return '    pb_size_t ' + self.name + '_count;'
+        elif (self.rules == 'OPTIONAL' and self.allocation in ('STATIC', 'HYBRID') and
+                self.has_bit is None):
+            return '    bool has_' + self.name + ';'
+        else:
+            return None
 
+    def data_member(self):
+        '''Return the declaration of the member holding the field data.'''
+        if self.allocation == 'POINTER':
             if self.pbtype == 'MESSAGE':
                 # Use struct definition, so recursive submessages are possible
-                result += '    struct _%s *%s;' % (self.ctype, self.name)
+                return '    struct _%s *%s;' % (self.ctype, self.name)
             elif self.rules == 'REPEATED' and self.pbtype in ['STRING', 'BYTES']:
                 # String/bytes arrays need to be defined as pointers to pointers
-                result += '    %s **%s;' % (self.ctype, self.name)
+                return '    %s **%s;' % (self.ctype, self.name)
             else:
-                result += '    %s *%s;' % (self.ctype, self.name)
+                return '    %s *%s;' % (self.ctype, self.name)
         elif self.allocation == 'CALLBACK':
-            result += '    pb_callback_t %s;' % self.name
+            return '    pb_callback_t %s;' % self.name
         else:
-            if self.rules == 'OPTIONAL' and self.allocation == 'STATIC':
-                result += '    bool has_' + self.name + ';\n'
-            elif self.rules == 'REPEATED' and self.allocation == 'STATIC':
-                result += '    pb_size_t ' + self.name + '_count;\n'
-            result += '    %s %s%s;' % (self.ctype, self.name, self.array_decl)
-        return result
+            return '    %s %s%s;' % (self.ctype, self.name, self.array_decl)
+
+    def size_alignment(self):
+        if self.rules == 'REPEATED':
+            return PB_SIZE_T_ALIGNMENT
+        else:
+            return ctype_alignment('bool')
+
+    def size_member_size(self):
+        '''Return the size of the has_ or _count member, if it is known.'''
+        if self.rules == 'REPEATED':
+            return None
+        else:
+            return ctype_alignments['bool']
+
+    def data_alignment(self, dependencies):
+        if self.allocation in ('POINTER', 'CALLBACK', 'HYBRID'):
+            return POINTER_ALIGNMENT
+        elif self.pbtype == 'MESSAGE':
+            if str(self.submsgname) in dependencies:
+                return dependencies[str(self.submsgname)].alignment(dependencies)
+            return ctype_alignment('uint64_t') # Largest, for unknown types
+        elif self.pbtype in ('ENUM', 'UENUM'):
+            # C enums are int sized, unless packed with the packed_enum option
+            enum = dependencies.get(str(self.ctype))
+            if enum is not None and enum.packed:
+                return ctype_alignment('uint8_t')
+            return ctype_alignment('uint32_t')
+        elif self.pbtype == 'BYTES' and not self.inline:
+            return PB_SIZE_T_ALIGNMENT
+        else:
+            return ctype_alignment(str(self.ctype))
+
+    def data_member_size(self):
+        '''Return the size of the data member, if it is known.'''
+        if self.allocation != 'STATIC' or str(self.ctype) not in ctype_alignments:
+            return None
+        size = ctype_alignments[str(self.ctype)]
+        for dimension in re.findall(r'\[(\d+)\]', self.array_decl):
+            size *= int(dimension)
+        return size
 
     def types(self):
         '''Return definitions for any special types this field might need.'''
-        if self.pbtype == 'BYTES' and self.allocation == 'STATIC' and not self.inline:
+        if self.allocation == 'HYBRID' and self.rules == 'REPEATED':
+            if self.pbtype == 'STRING':
+                result = 'typedef char %s[%d];\n' % (self.item_ctype, self.max_size)
+            elif self.sized_string:
+                result = 'typedef PB_STRING_ARRAY_T(%d) %s;\n' % (self.max_size, self.item_ctype)
+            elif self.pbtype == 'BYTES':
+                result = 'typedef PB_BYTES_ARRAY_T(%d) %s;\n' % (self.max_size, self.item_ctype)
+            else:
+                result = ''
+            result += 'typedef PB_HYBRID_ARRAY_T(%s, %d) %s;\n' % (self.item_ctype, self.max_count, self.ctype)
+        elif self.allocation == 'HYBRID':
+            kind = 'STRING' if self.sized_string else 'BYTES'
+            result = 'typedef PB_HYBRID_%s_T(%d) %s;\n' % (kind, self.max_size, self.ctype)
+        elif self.sized_string and self.allocation == 'STATIC':
+            result = 'typedef PB_STRING_ARRAY_T(%d) %s;\n' % (self.max_size, self.ctype)
+        elif self.pbtype == 'BYTES' and self.allocation == 'STATIC' and not self.inline:
             result = 'typedef PB_BYTES_ARRAY_T(%d) %s;\n' % (self.max_size, self.ctype)
         else:
             result = ''
@@ -381,21 +519,24 @@ class Field:
         '''Get list of type names used by this field.'''
         if self.allocation == 'STATIC':
             return [str(self.ctype)]
+        elif self.allocation == 'HYBRID' and self.rules == 'REPEATED':
+            return [str(self.item_ctype)]
         else:
             return []
 
-    def get_initializer(self, null_init, inner_init_only = False):
+    def get_initializer(self, null_init, inner_init_only = False, data_only = False):
         '''Return literal expression for this field's default value.
         null_init: If True, initialize to a 0 value instead of default from .proto
         inner_init_only: If True, exclude initialization for any count/has fields
+        data_only: If True, return the initializer of the data member only
         '''
 
         inner_init = None
         if self.pbtype == 'MESSAGE':
             if null_init:
-                inner_init = '%s_init_zero' % self.ctype
+                inner_init = '%s_init_zero' % self.submsgname
             else:
-                inner_init = '%s_init_default' % self.ctype
+                inner_init = '%s_init_default' % self.submsgname
         elif self.default is None or null_init:
             if self.pbtype == 'STRING':
                 inner_init = '""'
@@ -414,6 +555,9 @@ class Field:
                 inner_init = '"' + inner_init + '"'
             elif self.pbtype == 'BYTES':
                 data = ['0x%02x' % ord(c) for c in self.default]
+                if self.sized_string:
+                    # Values above 0x7f do not fit in a signed char
+                    data = ['(char)' + d if int(d, 16) > 0x7f else d for d in data]
                 if len(data) == 0:
                     if self.inline:
                         inner_init = '{0}'
@@ -433,32 +577,51 @@ class Field:
             else:
                 inner_init = str(self.default)
 
+        if self.allocation == 'HYBRID' and self.rules != 'REPEATED':
+            # Add the spill pointer after the inline bytes
+            inner_init = inner_init[:-1] + ', NULL}'
+
         if inner_init_only:
             return inner_init
 
         outer_init = None
         if self.allocation == 'STATIC':
             if self.rules == 'REPEATED':
-                outer_init = '0, {'
+                outer_init = '{'
                 outer_init += ', '.join([inner_init] * self.max_count)
                 outer_init += '}'
-            elif self.rules == 'OPTIONAL':
-                outer_init = 'false, ' + inner_init
             else:
                 outer_init = inner_init
-        elif self.allocation == 'POINTER':
+        elif self.allocation == 'HYBRID':
             if self.rules == 'REPEATED':
-                outer_init = '0, NULL'
+                outer_init = '{{'
+                outer_init += ', '.join([inner_init] * self.max_count)
+                outer_init += '}, NULL}'
             else:
-                outer_init = 'NULL'
+                outer_init = inner_init
+        elif self.allocation == 'POINTER':
+            outer_init = 'NULL'
         elif self.allocation == 'CALLBACK':
             if self.pbtype == 'EXTENSION':
                 outer_init = 'NULL'
             else:
                 outer_init = '{{NULL}, NULL}'
 
+        size_init = self.size_initializer()
+        if size_init is not None and not data_only:
+            outer_init = size_init + ', ' + outer_init
+
         return outer_init
 
+    def size_initializer(self):
+        '''Return the initializer of the has_ or _count member, or None.'''
+        if self.size_member() is None:
+            return None
+        elif self.rules == 'REPEATED':
+            return '0'
+        else:
+            return 'false'
+
     def default_decl(self, declaration_only = False):
         '''Return definition for this field's default value.'''
         if self.default is None:
@@ -473,7 +636,7 @@ class Field:
                 return None # Not implemented
             array_decl = '[%d]' % self.max_size
         elif self.pbtype == 'BYTES':
-            if self.allocation != 'STATIC':
+            if self.allocation not in ('STATIC', 'HYBRID'):
                 return None # Not implemented
             if self.inline:
                 array_decl = '[%d]' % self.max_size
@@ -488,9 +651,16 @@ class Field:
         identifier = '%s_%s_tag' % (self.struct_name, self.name)
         return '#define %-40s %d\n' % (identifier, self.tag)
 
-    def pb_field_t(self, prev_field_name):
+    def hasbit(self):
+        '''Return the #define for the has_bits bit number of this field.'''
+        identifier = '%s_%s_hasbit' % (self.struct_name, self.name)
+        return '#define %-40s %d\n' % (identifier, self.has_bit)
+
+    def pb_field_t(self, prev_field_name, placement = 'OTHER'):
         '''Return the pb_field_t initializer to use in the constant array.
-        prev_field_name is the name of the previous field or None.
+        prev_field_name is the name of the previous field or None. The
+        placement is BACK if the field data is located before the previous
+        field in the struct.
         '''
 
         if self.rules == 'ONEOF':
@@ -503,9 +673,9 @@ class Field:
 
         result += '%3d, ' % self.tag
         result += '%-8s, ' % self.pbtype
-        result += '%s, ' % self.rules
+        result += '%s, ' % (self.rules if self.has_bit is None else 'OPTBIT')
         result += '%-8s, ' % (self.allocation if not self.inline else "INLINE")
-        result += '%s, ' % ("FIRST" if not prev_field_name else "OTHER")
+        result += '%s, ' % ("FIRST" if not prev_field_name else placement)
         result += '%s, ' % self.struct_name
         result += '%s, ' % self.name
         result += '%s, ' % (prev_field_name or self.name)
@@ -514,7 +684,7 @@ class Field:
             result += '&%s_fields)' % self.submsgname
         elif self.default is None:
             result += '0)'
-        elif self.pbtype in ['BYTES', 'STRING'] and self.allocation != 'STATIC':
+        elif self.pbtype in ['BYTES', 'STRING'] and self.allocation not in ('STATIC', 'HYBRID'):
             result += '0)' # Arbitrary size default values not implemented
         elif self.rules == 'OPTEXT':
             result += '0)' # Default value for extensions is not implemented
@@ -524,6 +694,9 @@ class Field:
         return result
 
     def get_last_field_name(self):
+        if self.allocation == 'HYBRID' and self.rules == 'REPEATED':
+            # The data_offset of the next field skips the spill pointer
+            return self.name + '.items'
         return self.name
 
     def largest_field_value(self):
@@ -533,6 +706,8 @@ class Field:
         if self.pbtype == 'MESSAGE':
             if self.rules == 'REPEATED' and self.allocation == 'STATIC':
                 check.append('pb_membersize(%s, %s[0])' % (self.struct_name, self.name))
+            elif self.rules == 'REPEATED' and self.allocation == 'HYBRID':
+                check.append('pb_membersize(%s, %s.items[0])' % (self.struct_name, self.name))
             elif self.rules == 'ONEOF':
                 if self.anonymous:
                     check.append('pb_membersize(%s, %s)' % (self.struct_name, self.name))
@@ -540,8 +715,16 @@ class Field:
                     check.append('pb_membersize(%s, %s.%s)' % (self.struct_name, self.union_name, self.name))
             else:
                 check.append('pb_membersize(%s, %s)' % (self.struct_name, self.name))
+        elif self.allocation == 'HYBRID' and self.rules != 'REPEATED':
+            # The data_size is the size of the whole structure
+            check.append('pb_membersize(%s, %s)' % (self.struct_name, self.name))
+
+        numbers = [self.tag, self.max_size, self.max_count]
+        if self.has_bit is not None:
+            # Bit number is stored in array_size
+            numbers.append(self.has_bit + 1)
 
-        return FieldMaxSize([self.tag, self.max_size, self.max_count],
+        return FieldMaxSize(numbers,
                             check,
                             ('%s.%s' % (self.struct_name, self.name)))
 
@@ -598,6 +781,435 @@ class Field:
 
         return encsize
 
+    # Generation of specialized encode/decode functions. The code uses the
+    # same helper functions from pb_encode.h/pb_decode.h as callbacks do,
+    # and produces the same output as the field descriptor based encoder.
+
+    def codegen_supported(self):
+        '''Check if this field can be handled by the generated functions.'''
+        if self.allocation != 'STATIC':
+            return False
+        if self.rules not in ('REQUIRED', 'OPTIONAL', 'REPEATED', 'SINGULAR'):
+            return False
+        if self.rules == 'SINGULAR':
+            # Default value check for floats and submessages would need
+            # a bytewise comparison, let pb_encode() handle them.
+            if self.pbtype in ('FLOAT', 'DOUBLE', 'MESSAGE') or self.inline:
+                return False
+        return self.pbtype in codegen_wiretypes
+
+    def codegen_tag(self, wiretype):
+        return '((uint32_t)%d << 3) | %s' % (self.tag, wiretype)
+
+    def codegen_submsg(self, dependencies):
+        '''Return the submessage type if it has generated functions.'''
+        submsg = dependencies.get(str(self.submsgname))
+        if isinstance(submsg, Message) and submsg.generate_functions:
+            return submsg
+        return None
+
+    def codegen_encode_value(self, v, dependencies, needs):
+        '''Lines for encoding a single value v, without the tag.'''
+        t = self.pbtype
+        if t in ('INT32', 'INT64', 'ENUM'):
+            call = 'pb_encode_varint(stream, (uint64_t)(int64_t)%s)' % v
+        elif t in ('UINT32', 'UINT64', 'BOOL', 'UENUM'):
+            call = 'pb_encode_varint(stream, (uint64_t)%s)' % v
+        elif t in ('SINT32', 'SINT64'):
+            call = 'pb_encode_svarint(stream, (int64_t)%s)' % v
+        elif t in ('FIXED32', 'SFIXED32', 'FLOAT'):
+            call = 'pb_encode_fixed32(stream, &%s)' % v
+        elif t in ('FIXED64', 'SFIXED64', 'DOUBLE'):
+            call = 'pb_encode_fixed64(stream, &%s)' % v
+        elif t == 'STRING':
+            needs.add('size')
+            return ['size = 0;',
+                    'while (size < %d && %s[size] != \'\\0\')' % (self.max_size, v),
+                    '    size++;',
+                    'if (!pb_encode_string(stream, (const pb_byte_t*)%s, size))' % v,
+                    '    return false;']
+        elif t == 'BYTES' and self.inline:
+            call = 'pb_encode_string(stream, %s, %d)' % (v, self.max_size)
+        elif t == 'BYTES':
+            return ['if (%s.size > %d)' % (v, self.max_size),
+                    '    PB_RETURN_ERROR(stream, "bytes size exceeded");',
+                    'if (!pb_encode_string(stream, %s%s.bytes, %s.size))' % (
+                        '(const pb_byte_t*)' if self.sized_string else '', v, v),
+                    '    return false;']
+        elif self.codegen_submsg(dependencies):
+            needs.add('size')
+            return ['if (!%s_get_encoded_size(&size, &%s))' % (self.submsgname, v),
+                    '    PB_RETURN_ERROR(stream, "invalid submessage");',
+                    'if (!pb_encode_varint(stream, (uint64_t)size))',
+                    '    return false;',
+                    'if (!%s_encode(stream, &%s))' % (self.submsgname, v),
+                    '    return false;']
+        else:
+            call = 'pb_encode_submessage(stream, %s_fields, &%s)' % (self.submsgname, v)
+
+        return ['if (!%s)' % call, '    return false;']
+
+    def codegen_encode(self, dependencies, needs):
+        '''Lines for encoding this field in MsgName_encode().'''
+        wiretype = codegen_wiretypes[self.pbtype]
+        v = 'msg->' + self.name
+        tag = ['if (!pb_encode_varint(stream, %s))' % self.codegen_tag(wiretype),
+               '    return false;']
+
+        if self.rules == 'REPEATED':
+            count = 'msg->%s_count' % self.name
+            v += '[i]'
+            needs.add('i')
+            lines = ['if (%s > %d)' % (count, self.max_count),
+                     '    PB_RETURN_ERROR(stream, "array max size exceeded");']
+
+            if wiretype == 'PB_WT_STRING':
+                # Not packable, tag for each entry.
+                lines += ['for (i = 0; i < %s; i++)' % count, '{']
+                lines += ['    ' + l for l in tag + self.codegen_encode_value(v, dependencies, needs)]
+                lines += ['}']
+                return ['if (%s > 0)' % count, '{'] + ['    ' + l for l in lines] + ['}']
+
+            needs.add('size')
+            lines += ['if (!pb_encode_varint(stream, %s))' % self.codegen_tag('PB_WT_STRING'),
+                      '    return false;']
+            if wiretype == 'PB_WT_32BIT':
+                lines += ['size = 4 * (size_t)%s;' % count]
+            elif wiretype == 'PB_WT_64BIT':
+                lines += ['size = 8 * (size_t)%s;' % count]
+            else:
+                lines += ['size = 0;',
+                          'for (i = 0; i < %s; i++)' % count,
+                          '    size += pb_varint_size(%s);' % self.codegen_varint(v)]
+            lines += ['if (!pb_encode_varint(stream, (uint64_t)size))',
+                      '    return false;',
+                      'for (i = 0; i < %s; i++)' % count,
+                      '{']
+            lines += ['    ' + l for l in self.codegen_encode_value(v, dependencies, needs)]
+            lines += ['}']
+            return ['if (%s > 0)' % count, '{'] + ['    ' + l for l in lines] + ['}']
+
+        lines = tag + self.codegen_encode_value(v, dependencies, needs)
+        if self.rules == 'REQUIRED':
+            return lines
+
+        return ['if (%s)' % self.codegen_present(v), '{'] + ['    ' + l for l in lines] + ['}']
+
+    def codegen_present(self, v):
+        '''Condition for encoding a non-repeated, non-required field.'''
+        if self.has_bit is not None:
+            return 'PB_HAS_BIT(msg->has_bits, %s_%s_hasbit)' % (self.struct_name, self.name)
+        elif self.rules == 'OPTIONAL':
+            return 'msg->has_' + self.name
+        elif self.pbtype == 'STRING':
+            return "%s[0] != '\\0'" % v
+        elif self.pbtype == 'BYTES':
+            return '%s.size != 0' % v
+        else:
+            return '%s != 0' % v
+
+    def codegen_varint(self, v):
+        '''Value of a varint type field as it is written on the wire.'''
+        if self.pbtype in ('SINT32', 'SINT64'):
+            return '(%s < 0 ? ~((uint64_t)(int64_t)%s << 1) : (uint64_t)(int64_t)%s << 1)' % (v, v, v)
+        elif self.pbtype in ('INT32', 'INT64', 'ENUM'):
+            return '(uint64_t)(int64_t)%s' % v
+        else:
+            return '(uint64_t)%s' % v
+
+    def codegen_size_value(self, v, dependencies, needs):
+        '''Lines for adding the encoded size of a single value v, without
+        the tag, to total.'''
+        t = self.pbtype
+        if t in ('FIXED32', 'SFIXED32', 'FLOAT'):
+            return ['total += 4;']
+        elif t in ('FIXED64', 'SFIXED64', 'DOUBLE'):
+            return ['total += 8;']
+        elif t == 'STRING':
+            needs.add('len')
+            return ['len = 0;',
+                    'while (len < %d && %s[len] != \'\\0\')' % (self.max_size, v),
+                    '    len++;',
+                    'total += pb_varint_size((uint64_t)len) + len;']
+        elif t == 'BYTES' and self.inline:
+            return ['total += %d;' % (varint_max_size(self.max_size) + self.max_size)]
+        elif t == 'BYTES':
+            return ['if (%s.size > %d)' % (v, self.max_size),
+                    '    return false;',
+                    'total += pb_varint_size((uint64_t)%s.size) + %s.size;' % (v, v)]
+        elif t == 'MESSAGE':
+            needs.add('len')
+            if self.codegen_submsg(dependencies):
+                call = '%s_get_encoded_size(&len, &%s)' % (self.submsgname, v)
+            else:
+                call = 'pb_get_encoded_size(&len, %s_fields, &%s)' % (self.submsgname, v)
+            return ['if (!%s)' % call,
+                    '    return false;',
+                    'total += pb_varint_size((uint64_t)len) + len;']
+        else:
+            return ['total += pb_varint_size(%s);' % self.codegen_varint(v)]
+
+    def codegen_size(self, dependencies, needs):
+        '''Lines for adding the encoded size of this field in
+        MsgName_get_encoded_size().'''
+        wiretype = codegen_wiretypes[self.pbtype]
+        v = 'msg->' + self.name
+        tagsize = varint_max_size(self.tag << 3)
+
+        if self.rules == 'REPEATED':
+            count = 'msg->%s_count' % self.name
+            v += '[i]'
+            lines = ['if (%s > %d)' % (count, self.max_count),
+                     '    return false;']
+
+            if wiretype == 'PB_WT_STRING':
+                # Not packable, tag for each entry.
+                needs.add('i')
+                lines += ['total += %d * (size_t)%s;' % (tagsize, count),
+                          'for (i = 0; i < %s; i++)' % count, '{']
+                lines += ['    ' + l for l in self.codegen_size_value(v, dependencies, needs)]
+                lines += ['}']
+                return lines
+
+            needs.add('len')
+            if wiretype == 'PB_WT_32BIT':
+                lines += ['len = 4 * (size_t)%s;' % count]
+            elif wiretype == 'PB_WT_64BIT':
+                lines += ['len = 8 * (size_t)%s;' % count]
+            else:
+                needs.add('i')
+                lines += ['len = 0;',
+                          'for (i = 0; i < %s; i++)' % count,
+                          '    len += pb_varint_size(%s);' % self.codegen_varint(v)]
+            lines += ['if (len > 0)',
+                      '    total += %d + pb_varint_size((uint64_t)len) + len;' % tagsize]
+            return lines
+
+        lines = ['total += %d;' % tagsize] + self.codegen_size_value(v, dependencies, needs)
+        if self.rules == 'REQUIRED':
+            return lines
+
+        return ['if (%s)' % self.codegen_present(v), '{'] + ['    ' + l for l in lines] + ['}']
+
+    def codegen_decode_value(self, v, src, cleanup, dependencies, needs):
+        '''Lines for decoding a single value from src into v. Errors
+        are reported on 'stream' after running the cleanup statement.'''
+        def check(expr):
+            if cleanup:
+                return ['if (!%s)' % expr, '{', '    ' + cleanup, '    return false;', '}']
+            return ['if (!%s)' % expr, '    return false;']
+
+        def error(cond, msg):
+            lines = ['if (%s)' % cond]
+            if cleanup:
+                lines += ['{', '    ' + cleanup, '    PB_RETURN_ERROR(stream, "%s");' % msg, '}']
+            else:
+                lines += ['    PB_RETURN_ERROR(stream, "%s");' % msg]
+            return lines
+
+        t = self.pbtype
+        if t in ('INT32', 'INT64', 'ENUM'):
+            needs.add('value')
+            lines = check('pb_decode_varint(%s, &value)' % src)
+            if self.ctype == 'int64_t':
+                return lines + ['%s = (int64_t)value;' % v]
+            # Values of 32-bit and smaller fields are sign extended from 32 bits.
+            if self.ctype == 'int32_t':
+                lines += ['%s = (int32_t)value;' % v]
+            else:
+                lines += ['%s = (%s)(int32_t)value;' % (v, self.ctype)]
+            return lines + error('(int64_t)%s != (int64_t)(int32_t)value' % v, 'integer too large')
+        elif t == 'BOOL':
+            needs.add('value')
+            return check('pb_decode_varint(%s, &value)' % src) + ['%s = (value != 0);' % v]
+        elif t in ('UINT32', 'UINT64', 'UENUM'):
+            needs.add('value')
+            lines = check('pb_decode_varint(%s, &value)' % src)
+            lines += ['%s = (%s)value;' % (v, self.ctype)]
+            if self.ctype == 'uint64_t':
+                return lines
+            return lines + error('(uint64_t)%s != value' % v, 'integer too large')
+        elif t in ('SINT32', 'SINT64'):
+            needs.add('svalue')
+            lines = check('pb_decode_svarint(%s, &svalue)' % src)
+            lines += ['%s = (%s)svalue;' % (v, self.ctype)]
+            if self.ctype == 'int64_t':
+                return lines
+            return lines + error('(int64_t)%s != svalue' % v, 'integer too large')
+        elif t in ('FIXED32', 'SFIXED32', 'FLOAT'):
+            return check('pb_decode_fixed32(%s, &%s)' % (src, v))
+        elif t in ('FIXED64', 'SFIXED64', 'DOUBLE'):
+            return check('pb_decode_fixed64(%s, &%s)' % (src, v))
+        elif t == 'STRING':
+            needs.add('value')
+            return (check('pb_decode_varint(stream, &value)') +
+                    error('value > %d' % (self.max_size - 1), 'string overflow') +
+                    check('pb_read(stream, (pb_byte_t*)%s, (size_t)value)' % v) +
+                    ["%s[value] = '\\0';" % v])
+        elif t == 'BYTES' and self.inline:
+            needs.add('value')
+            return (check('pb_decode_varint(stream, &value)') +
+                    error('value != %d' % self.max_size, 'incorrect inline bytes size') +
+                    check('pb_read(stream, %s, %d)' % (v, self.max_size)))
+        elif t == 'BYTES':
+            needs.add('value')
+            return (check('pb_decode_varint(stream, &value)') +
+                    error('value > %d' % self.max_size, 'bytes overflow') +
+                    ['%s.size = (pb_size_t)value;' % v] +
+                    check('pb_read(stream, %s%s.bytes, (size_t)value)' % (
+                        '(pb_byte_t*)' if self.sized_string else '', v)))
+        else:
+            needs.add('substream')
+            needs.add('status')
+            # New array entries need to be initialized, like in pb_decode().
+            init = '' if self.rules == 'REPEATED' else '_noinit'
+            if self.codegen_submsg(dependencies):
+                call = '%s_decode%s(&substream, &%s)' % (self.submsgname, init, v)
+            else:
+                call = 'pb_decode%s(&substream, %s_fields, &%s)' % (init, self.submsgname, v)
+            return (check('pb_make_string_substream(stream, &substream)') +
+                    ['status = %s;' % call,
+                     'pb_close_string_substream(stream, &substream);',
+                     'if (!status)',
+                     '    return false;'])
+
+    def codegen_decode(self, dependencies, needs, required_bit):
+        '''Lines for the switch case of this field in MsgName_decode_noinit().'''
+        wiretype = codegen_wiretypes[self.pbtype]
+        v = 'msg->' + self.name
+        lines = []
+
+        def wiretype_check(expected):
+            return ['if (wire_type != %s)' % expected,
+                    '    PB_RETURN_ERROR(stream, "wrong wire type");']
+
+        if self.rules == 'REPEATED':
+            count = 'msg->%s_count' % self.name
+            elem = '%s[%s]' % (v, count)
+            single = wiretype_check(wiretype)
+            single += ['if (%s >= %d)' % (count, self.max_count),
+                       '    PB_RETURN_ERROR(stream, "array overflow");']
+            single += self.codegen_decode_value(elem, 'stream', None, dependencies, needs)
+            single += ['%s++;' % count]
+
+            if wiretype == 'PB_WT_STRING':
+                lines += single
+            else:
+                # Packable type, may be received packed or unpacked.
+                needs.add('substream')
+                cleanup = 'pb_close_string_substream(stream, &substream);'
+                lines += ['if (wire_type == PB_WT_STRING)', '{']
+                packed = ['if (!pb_make_string_substream(stream, &substream))',
+                          '    return false;',
+                          'while (substream.bytes_left > 0 && %s < %d)' % (count, self.max_count),
+                          '{']
+                packed += ['    ' + l for l in self.codegen_decode_value(elem, '&substream', cleanup, dependencies, needs)]
+                packed += ['    %s++;' % count,
+                           '}',
+                           cleanup,
+                           'if (substream.bytes_left != 0)',
+                           '    PB_RETURN_ERROR(stream, "array overflow");']
+                lines += ['    ' + l for l in packed]
+                lines += ['}', 'else', '{']
+                lines += ['    ' + l for l in single]
+                lines += ['}']
+        else:
+            lines += wiretype_check(wiretype)
+            lines += self.codegen_decode_value(v, 'stream', None, dependencies, needs)
+            if self.has_bit is not None:
+                lines += ['PB_SET_BIT(msg->has_bits, %s_%s_hasbit);' % (self.struct_name, self.name)]
+            elif self.rules == 'OPTIONAL':
+                lines += ['msg->has_%s = true;' % self.name]
+            elif self.rules == 'REQUIRED':
+                lines += ['missing &= ~(uint32_t)0x%x;' % (1 << required_bit)]
+
+        return ['case %d:' % self.tag] + ['    ' + l for l in lines + ['break;']]
+
+    def parse_entry(self, index, required_index):
+        '''Return the pb_parse_entry_t initializer for the parse table.
+        index is the position of the field in the pb_field_t array.
+        '''
+        wiretype = codegen_wiretypes[self.pbtype]
+        if self.rules == 'REPEATED' and wiretype != 'PB_WT_STRING':
+            wiretype = 'PB_WT_STRING' # Packed arrays
+        wt = {'PB_WT_VARINT': 0, 'PB_WT_64BIT': 1, 'PB_WT_STRING': 2, 'PB_WT_32BIT': 5}[wiretype]
+
+        # Tag as encoded on the wire, first byte in the lowest bits
+        key = (self.tag << 3) | wt
+        tag_bytes = 0
+        tag_size = 0
+        while True:
+            byte = key & 0x7F
+            key >>= 7
+            if key:
+                byte |= 0x80
+            tag_bytes |= byte << (8 * tag_size)
+            tag_size += 1
+            if not key:
+                break
+
+        if tag_size > 4:
+            tag_bytes, tag_size = 0, 0
+        tag = '0x%0*x, %d' % (max(2, 2 * tag_size), tag_bytes, tag_size)
+        field = '&%s_fields[%d]' % (self.struct_name, index)
+
+        if (self.allocation != 'STATIC' or self.has_bit is not None or
+                self.rules not in ('REQUIRED', 'OPTIONAL', 'SINGULAR')):
+            return '    PB_PARSE_ENTRY_FALLBACK(%s, %d, %s)' % (tag, required_index, field)
+
+        handlers = {
+            ('INT32', 'int32_t'): 'VARINT32', ('INT64', 'int64_t'): 'VARINT64',
+            ('UINT32', 'uint32_t'): 'UVARINT32', ('UINT64', 'uint64_t'): 'UVARINT64',
+            ('FIXED32', 'uint32_t'): 'FIXED32', ('SFIXED32', 'int32_t'): 'FIXED32',
+            ('FLOAT', 'float'): 'FIXED32', ('FIXED64', 'uint64_t'): 'FIXED64',
+            ('SFIXED64', 'int64_t'): 'FIXED64', ('DOUBLE', 'double'): 'FIXED64'
+        }
+        handler = handlers.get((self.pbtype, str(self.ctype)), 'FIELD')
+        sizetype = 'HAS' if self.rules == 'OPTIONAL' else 'NONE'
+        return '    PB_PARSE_ENTRY(%s, %-10s %s, %s, %-5s %d, %s)' % (
+            tag, handler + ',', self.struct_name, self.name, sizetype + ',', required_index, field)
+
+    # Field descriptions for the C++ templates in pb.hpp.
+
+    def cpp_supported(self, dependencies):
+        '''Check if this field can be handled by the C++ templates.'''
+        if self.allocation != 'STATIC' or self.has_bit is not None:
+            return False
+        if self.rules not in ('REQUIRED', 'OPTIONAL', 'REPEATED', 'SINGULAR'):
+            return False
+        if self.pbtype == 'MESSAGE':
+            submsg = dependencies.get(str(self.submsgname))
+            return isinstance(submsg, Message) and submsg.cpp_descriptor
+        return True
+
+    def cpp_field(self):
+        '''Return the nanopb::Field<> type describing this field.'''
+        htype = {'REQUIRED': 'PB_HTYPE_REQUIRED', 'OPTIONAL': 'PB_HTYPE_OPTIONAL',
+                 'SINGULAR': 'PB_HTYPE_OPTIONAL', 'REPEATED': 'PB_HTYPE_REPEATED'}[self.rules]
+        if self.inline:
+            ltype = 'PB_LTYPE_FIXED_LENGTH_BYTES'
+        else:
+            ltype = 'PB_LTYPE_MAP_%s' % self.pbtype
+
+        st = self.struct_name
+        if self.rules == 'OPTIONAL':
+            size_offset = 'offsetof(%s, has_%s)' % (st, self.name)
+        elif self.rules == 'REPEATED':
+            size_offset = 'offsetof(%s, %s_count)' % (st, self.name)
+        else:
+            size_offset = 'no_size'
+
+        if self.rules == 'REPEATED':
+            data_size = 'sizeof(%s::%s[0]), %d' % (st, self.name, self.max_count)
+        else:
+            data_size = 'sizeof(%s::%s), 0' % (st, self.name)
+
+        if self.pbtype == 'MESSAGE':
+            data_size += ', %s' % self.submsgname
+
+        return 'Field<%d, %s | %s, offsetof(%s, %s), %s, %s>' % (
+            self.tag, htype, ltype, st, self.name, size_offset, data_size)
+
 
 class ExtensionRange(Field):
     def __init__(self, struct_name, range_start, field_options):
@@ -618,10 +1230,18 @@ class ExtensionRange(Field):
         self.max_size = 0
         self.max_count = 0
         self.inline = None
+        self.has_bit = None
+        self.hot = False
 
     def __str__(self):
         return '    pb_extension_t *extensions;'
 
+    def size_member(self):
+        return None
+
+    def data_member(self):
+        return str(self)
+
     def types(self):
         return ''
 
@@ -640,6 +1260,10 @@ class ExtensionField(Field):
         self.extendee_name = names_from_type_name(desc.extendee)
         Field.__init__(self, self.fullname + 'struct', desc, field_options)
 
+        if self.allocation == 'HYBRID':
+            raise Exception("Hybrid extension fields are not supported"
+                            + " (field %s)" % self.fullname)
+
         if self.rules != 'OPTIONAL':
             self.skip = True
         else:
@@ -696,17 +1320,24 @@ class OneOf(Field):
         self.rules = 'ONEOF'
         self.anonymous = False
         self.inline = None
+        self.has_bit = None
+        self.hot = False
 
     def add_field(self, field):
         if field.allocation == 'CALLBACK':
             raise Exception("Callback fields inside of oneof are not supported"
                             + " (field %s)" % field.name)
 
+        if field.allocation == 'HYBRID':
+            raise Exception("Hybrid fields inside of oneof are not supported"
+                            + " (field %s)" % field.name)
+
         field.union_name = self.name
         field.rules = 'ONEOF'
         field.anonymous = self.anonymous
         self.fields.append(field)
         self.fields.sort(key = lambda f: f.tag)
+        self.hot = self.hot or field.hot
 
         # Sort by the lowest tag number inside union
         self.tag = min([f.tag for f in self.fields])
@@ -714,16 +1345,35 @@ class OneOf(Field):
     def __str__(self):
         result = ''
         if self.fields:
-            result += '    pb_size_t which_' + self.name + ";\n"
-            result += '    union {\n'
-            for f in self.fields:
-                result += '    ' + str(f).replace('\n', '\n    ') + '\n'
-            if self.anonymous:
-                result += '    };'
-            else:
-                result += '    } ' + self.name + ';'
+            result += self.size_member() + '\n'
+            result += self.data_member()
         return result
 
+    def size_member(self):
+        return '    pb_size_t which_' + self.name + ';'
+
+    def data_member(self):
+        result = '    union {\n'
+        for f in self.fields:
+            result += '    ' + str(f).replace('\n', '\n    ') + '\n'
+        if self.anonymous:
+            result += '    };'
+        else:
+            result += '    } ' + self.name + ';'
+        return result
+
+    def size_alignment(self):
+        return PB_SIZE_T_ALIGNMENT
+
+    def size_member_size(self):
+        return None
+
+    def data_alignment(self, dependencies):
+        return max(f.data_alignment(dependencies) for f in self.fields)
+
+    def data_member_size(self):
+        return None
+
     def types(self):
         return ''.join([f.types() for f in self.fields])
 
@@ -733,17 +1383,22 @@ class OneOf(Field):
             deps += f.get_dependencies()
         return deps
 
-    def get_initializer(self, null_init):
+    def get_initializer(self, null_init, data_only = False):
+        if data_only:
+            return '{' + self.fields[0].get_initializer(null_init) + '}'
         return '0, {' + self.fields[0].get_initializer(null_init) + '}'
 
+    def size_initializer(self):
+        return '0'
+
     def default_decl(self, declaration_only = False):
         return None
 
     def tags(self):
         return ''.join([f.tags() for f in self.fields])
 
-    def pb_field_t(self, prev_field_name):
-        result = ',\n'.join([f.pb_field_t(prev_field_name) for f in self.fields])
+    def pb_field_t(self, prev_field_name, placement = 'OTHER'):
+        result = ',\n'.join([f.pb_field_t(prev_field_name, placement) for f in self.fields])
         return result
 
     def get_last_field_name(self):
@@ -822,9 +1477,133 @@ class Message:
                 self.fields.append(ExtensionRange(self.name, range_start, field_options))
 
         self.packed = message_options.packed_struct
+        self.generate_functions = message_options.generate_functions
+        self.parse_table = message_options.parse_table
+        self.cpp_descriptor = message_options.cpp_descriptor
         self.ordered_fields = self.fields[:]
         self.ordered_fields.sort()
 
+        self.has_bits = 0
+        if message_options.has_bitmap:
+            for field in self.ordered_fields:
+                if (not isinstance(field, (OneOf, ExtensionRange)) and
+                        field.rules == 'OPTIONAL' and field.allocation == 'STATIC'):
+                    field.has_bit = 0 # Numbered below
+                    self.has_bits += 1
+
+        # Struct members as (field, 'size' or 'data') pairs, field is None
+        # for the has_bits array and the encode_cache. With minimize_padding
+        # they are reordered once the submessage types are known.
+        self.minimize_padding = message_options.minimize_padding
+        self.members = []
+        if self.has_bits:
+            self.members.append((None, 'has_bits'))
+        for field in self.ordered_fields:
+            if field.size_member() is not None:
+                self.members.append((field, 'size'))
+            self.members.append((field, 'data'))
+
+        self.encode_cache = message_options.encode_cache
+        if self.encode_cache:
+            self.members.append((None, 'encode_cache'))
+
+        # Bits are numbered in field order, so that the encoder can skip
+        # runs of unset fields.
+        bit = 0
+        for field in self.ordered_fields:
+            if field.has_bit is not None:
+                field.has_bit = bit
+                bit += 1
+
+    def member_alignment(self, member, dependencies):
+        field, part = member
+        if part == 'has_bits':
+            return ctype_alignment('uint32_t')
+        elif part == 'encode_cache':
+            return POINTER_ALIGNMENT
+        elif part == 'size':
+            return field.size_alignment()
+        else:
+            return field.data_alignment(dependencies)
+
+    def member_size(self, member):
+        '''Return the size of a struct member, if it is known.'''
+        field, part = member
+        if part == 'has_bits':
+            return 4 * ((self.has_bits + 31) // 32)
+        elif part == 'encode_cache':
+            return None
+        elif part == 'size':
+            return field.size_member_size()
+        else:
+            return field.data_member_size()
+
+    def alignment(self, dependencies):
+        '''Return the alignment of the struct as a member of other structs.'''
+        if not self.members:
+            return ctype_alignment('char')
+        return max(self.member_alignment(m, dependencies) for m in self.members)
+
+    def arrange_members(self, dependencies):
+        '''Order the struct members by decreasing alignment to minimize
+        padding, with the members of hot fields first. The has_, _count and
+        which_ members are placed separately from the field data. The field
+        descriptors remain in tag order.
+        '''
+        alignment = lambda m: self.member_alignment(m, dependencies)
+        any_hot = any(field.hot for field in self.ordered_fields)
+        hot = []
+        cold = []
+        for member in self.members:
+            field, part = member
+            if part == 'encode_cache':
+                continue
+            elif field is None:
+                # The has_bits array holds the flags of the hot fields also
+                group = hot if any_hot else cold
+            else:
+                group = hot if field.hot else cold
+            group.append(member)
+
+        hot.sort(key = alignment, reverse = True)
+        cold.sort(key = alignment, reverse = True)
+
+        # The cold members start at their largest alignment. Fill the gap
+        # after the hot members with cold members of a known size.
+        offset = 0
+        for member in hot:
+            size = self.member_size(member)
+            if size is None:
+                offset = None
+                break
+            align = alignment(member)[0]
+            offset = (offset + align - 1) // align * align + size
+
+        while hot and cold and offset is not None:
+            end = -(-offset // alignment(cold[0])[0]) * alignment(cold[0])[0]
+            fits = [m for m in cold if self.member_size(m) is not None and
+                    offset % alignment(m)[0] == 0 and
+                    offset + self.member_size(m) <= end]
+            if not fits:
+                break
+            hot.append(fits[0])
+            cold.remove(fits[0])
+            offset += self.member_size(fits[0])
+
+        self.members = hot + cold
+
+        # The data_offset after a union is unsigned, so the next field is
+        # moved after the union if needed.
+        for union, field in zip(self.ordered_fields, self.ordered_fields[1:]):
+            if isinstance(union, OneOf) and not isinstance(field, OneOf):
+                data = (field, 'data')
+                if self.members.index(data) < self.members.index((union, 'data')):
+                    self.members.remove(data)
+                    self.members.insert(self.members.index((union, 'data')) + 1, data)
+
+        if self.encode_cache:
+            self.members.append((None, 'encode_cache'))
+
     def get_dependencies(self):
         '''Get list of type names that this structure refers to.'''
         deps = []
@@ -840,7 +1619,17 @@ class Message:
             # Therefore add a dummy field if an empty message occurs.
             result += '    char dummy_field;'
 
-        result += '\n'.join([str(f) for f in self.ordered_fields])
+        lines = []
+        for field, part in self.members:
+            if part == 'has_bits':
+                lines.append('    uint32_t has_bits[%d];' % ((self.has_bits + 31) // 32))
+            elif part == 'encode_cache':
+                lines.append('    pb_encode_cache_t *encode_cache;')
+            elif part == 'size':
+                lines.append(field.size_member())
+            else:
+                lines.append(field.data_member())
+        result += '\n'.join(lines)
         result += '\n/* @@protoc_insertion_point(struct:%s) */' % self.name
         result += '\n}'
 
@@ -863,8 +1652,15 @@ class Message:
             return '{0}'
 
         parts = []
-        for field in self.ordered_fields:
-            parts.append(field.get_initializer(null_init))
+        for field, part in self.members:
+            if part == 'encode_cache':
+                parts.append('NULL')
+            elif field is None:
+                parts.append('{0}')
+            elif part == 'size':
+                parts.append(field.size_initializer())
+            else:
+                parts.append(field.get_initializer(null_init, data_only = True))
         return '{' + ', '.join(parts) + '}'
 
     def default_decl(self, declaration_only = False):
@@ -893,18 +1689,37 @@ class Message:
                 count += 1
         return count
 
+    def count_descriptors(self):
+        '''Number of entries in the field list, including the terminator
+        and the encode_cache pseudo-field.'''
+        count = self.count_all_fields() + 1
+        if self.encode_cache:
+            count += 1
+        return count
+
     def fields_declaration(self):
-        result = 'extern const pb_field_t %s_fields[%d];' % (self.name, self.count_all_fields() + 1)
+        result = 'extern const pb_field_t %s_fields[%d];' % (self.name, self.count_descriptors())
         return result
 
     def fields_definition(self):
-        result = 'const pb_field_t %s_fields[%d] = {\n' % (self.name, self.count_all_fields() + 1)
-
+        result = 'const pb_field_t %s_fields[%d] = {\n' % (self.name, self.count_descriptors())
+        if self.encode_cache:
+            result += '    PB_FIRST_FIELD_CACHED(%s, encode_cache),\n' % self.name
+
+        # The descriptors are in tag order. Fields located before the
+        # previous one in the struct have a negative data_offset.
+        position = dict((field, i) for i, (field, part) in enumerate(self.members)
+                        if part == 'data')
         prev = None
+        prev_field = None
         for field in self.ordered_fields:
-            result += field.pb_field_t(prev)
+            if prev_field is not None and position[field] < position[prev_field]:
+                result += field.pb_field_t(prev, 'BACK')
+            else:
+                result += field.pb_field_t(prev)
             result += ',\n'
             prev = field.get_last_field_name()
+            prev_field = field
 
         result += '    PB_LAST_FIELD\n};'
         return result
@@ -922,6 +1737,194 @@ class Message:
 
         return size
 
+    def parse_table_declaration(self):
+        return 'extern const pb_parse_table_t %s_parse_table;' % self.name
+
+    def parse_table_definition(self):
+        '''Return the entries for pb_decode_table(), in the same order as
+        the pb_field_t array.'''
+        fields = []
+        for field in self.ordered_fields:
+            if isinstance(field, ExtensionRange):
+                fields = None
+                break
+            elif isinstance(field, OneOf):
+                fields += field.fields
+            else:
+                fields.append(field)
+
+        if not fields:
+            # Extensions are only handled by pb_decode_noinit()
+            return 'const pb_parse_table_t %s_parse_table = {%s_fields, NULL, 0, 0};\n\n' % (self.name, self.name)
+
+        result = 'static const pb_parse_entry_t %s_parse_entries[%d] = {\n' % (self.name, len(fields))
+        required_index = 0
+        entries = []
+        first = 1 if self.encode_cache else 0
+        for index, field in enumerate(fields):
+            entries.append(field.parse_entry(first + index, required_index))
+            if field.rules == 'REQUIRED':
+                required_index += 1
+        result += ',\n'.join(entries) + '\n};\n'
+        result += 'const pb_parse_table_t %s_parse_table = {%s_fields, %s_parse_entries, %d, %d};\n\n' % (
+            self.name, self.name, self.name, len(fields), required_index)
+        return result
+
+    def codegen_supported(self):
+        '''Check if straight-line encode/decode functions can be generated.'''
+        if self.encode_cache:
+            return False # pb_encode() handles the cache
+        for field in self.fields:
+            if isinstance(field, (OneOf, ExtensionRange)):
+                return False
+            if not field.codegen_supported():
+                return False
+        return self.count_required_fields() <= 32
+
+    def cpp_descriptor_definition(self, dependencies):
+        '''Generate the nanopb::MessageDescriptor<> specialization.'''
+        inline_codec = self.count_required_fields() <= 64 and not self.encode_cache
+        for field in self.fields:
+            if isinstance(field, (OneOf, ExtensionRange)) or not field.cpp_supported(dependencies):
+                inline_codec = False
+
+        result  = 'template <> struct MessageDescriptor<%s>\n{\n' % self.name
+        result += '    static constexpr bool inline_codec = %s;\n' % ('true' if inline_codec else 'false')
+        result += '    static constexpr const pb_field_t *fields = %s_fields;\n' % self.name
+        result += '    static %s init_default() { return %s_init_default; }\n' % (self.name, self.name)
+        result += '    static %s init_zero() { return %s_init_zero; }\n' % (self.name, self.name)
+        if inline_codec:
+            result += '    using field_list = FieldList<'
+            result += ','.join('\n        ' + field.cpp_field() for field in self.ordered_fields)
+            result += '>;\n'
+        result += '};\n\n'
+        return result
+
+    def functions_declaration(self):
+        result  = 'bool %s_encode(pb_ostream_t *stream, const %s *msg);\n' % (self.name, self.name)
+        result += 'bool %s_decode(pb_istream_t *stream, %s *msg);\n' % (self.name, self.name)
+        result += 'bool %s_decode_noinit(pb_istream_t *stream, %s *msg);\n' % (self.name, self.name)
+        result += 'bool %s_get_encoded_size(size_t *size, const %s *msg);\n' % (self.name, self.name)
+        return result
+
+    def functions_definition(self, dependencies):
+        '''Generate MsgName_encode(), MsgName_decode(), MsgName_decode_noinit()
+        and MsgName_get_encoded_size().'''
+        name = self.name
+        result = ''
+
+        if not self.codegen_supported():
+            # Message contains fields that only the descriptor based
+            # functions can handle, so just wrap them.
+            result += 'bool %s_encode(pb_ostream_t *stream, const %s *msg)\n{\n' % (name, name)
+            result += '    return pb_encode(stream, %s_fields, msg);\n}\n\n' % name
+            result += 'bool %s_decode(pb_istream_t *stream, %s *msg)\n{\n' % (name, name)
+            result += '    return pb_decode(stream, %s_fields, msg);\n}\n\n' % name
+            result += 'bool %s_decode_noinit(pb_istream_t *stream, %s *msg)\n{\n' % (name, name)
+            result += '    return pb_decode_noinit(stream, %s_fields, msg);\n}\n\n' % name
+            result += 'bool %s_get_encoded_size(size_t *size, const %s *msg)\n{\n' % (name, name)
+            result += '    return pb_get_encoded_size(size, %s_fields, msg);\n}\n\n' % name
+            return result
+
+        # Encoding function, fields are written in the same order as pb_encode() does.
+        needs = set()
+        body = []
+        for field in self.ordered_fields:
+            body += field.codegen_encode(dependencies, needs) + ['']
+
+        decls = []
+        if 'size' in needs:
+            decls.append('size_t size;')
+        if 'i' in needs:
+            decls.append('pb_size_t i;')
+        if not self.ordered_fields:
+            body = ['PB_UNUSED(msg);', '']
+        if decls:
+            decls.append('')
+
+        result += 'bool %s_encode(pb_ostream_t *stream, const %s *msg)\n{\n' % (name, name)
+        for line in decls + body + ['return true;']:
+            result += ('    ' + line).rstrip() + '\n'
+        result += '}\n\n'
+
+        # Size calculation, same result as pb_get_encoded_size() but
+        # computed directly from the field values.
+        needs = set()
+        body = []
+        for field in self.ordered_fields:
+            body += field.codegen_size(dependencies, needs) + ['']
+
+        decls = ['size_t total = 0;']
+        if 'len' in needs:
+            decls.append('size_t len;')
+        if 'i' in needs:
+            decls.append('pb_size_t i;')
+        if not self.ordered_fields:
+            body = ['PB_UNUSED(msg);', '']
+
+        result += 'bool %s_get_encoded_size(size_t *size, const %s *msg)\n{\n' % (name, name)
+        for line in decls + [''] + body + ['*size = total;', 'return true;']:
+            result += ('    ' + line).rstrip() + '\n'
+        result += '}\n\n'
+
+        # Decoding functions
+        needs = set()
+        cases = []
+        required_bit = 0
+        for field in self.ordered_fields:
+            cases += field.codegen_decode(dependencies, needs, required_bit)
+            if field.rules == 'REQUIRED':
+                required_bit += 1
+
+        decls = ['uint32_t tag;', 'pb_wire_type_t wire_type;', 'bool eof;']
+        if required_bit > 0:
+            decls.append('uint32_t missing = 0x%xu;' % ((1 << required_bit) - 1))
+        if 'value' in needs:
+            decls.append('uint64_t value;')
+        if 'svalue' in needs:
+            decls.append('int64_t svalue;')
+        if 'substream' in needs:
+            decls.append('pb_istream_t substream;')
+        if 'status' in needs:
+            decls.append('bool status;')
+
+        body = ['while (stream->bytes_left)',
+                '{',
+                '    if (!pb_decode_tag(stream, &wire_type, &tag, &eof))',
+                '    {',
+                '        if (eof)',
+                '            break;',
+                '        return false;',
+                '    }',
+                '',
+                '    switch (tag)',
+                '    {']
+        body += ['        ' + l for l in cases]
+        body += ['        default:',
+                 '            if (!pb_skip_field(stream, wire_type))',
+                 '                return false;',
+                 '            break;',
+                 '    }',
+                 '}',
+                 '']
+        if required_bit > 0:
+            body += ['if (missing != 0)',
+                     '    PB_RETURN_ERROR(stream, "missing required field");',
+                     '']
+        if not self.ordered_fields:
+            body = ['PB_UNUSED(msg);'] + body
+
+        result += 'bool %s_decode_noinit(pb_istream_t *stream, %s *msg)\n{\n' % (name, name)
+        for line in decls + [''] + body + ['return true;']:
+            result += ('    ' + line).rstrip() + '\n'
+        result += '}\n\n'
+
+        result += 'bool %s_decode(pb_istream_t *stream, %s *msg)\n{\n' % (name, name)
+        result += '    static const %s defaults = %s_init_default;\n' % (name, name)
+        result += '    *msg = defaults;\n'
+        result += '    return %s_decode_noinit(stream, msg);\n}\n\n' % name
+        return result
+
 
 # ---------------------------------------------------------------------------
 #                    Processing of entire .proto files
@@ -1106,6 +2109,13 @@ class ProtoFile:
 
         if self.messages:
             yield '/* Struct definitions */\n'
+            for msg in self.messages:
+                if msg.minimize_padding:
+                    msg.arrange_members(self.dependencies)
+                if msg.encode_cache:
+                    if msg.encoded_size(self.dependencies) is None:
+                        raise Exception("Message %s has the encode_cache option, but its "
+                                        "maximum encoded size is not known" % msg.name)
             for msg in sort_dependencies(self.messages):
                 yield msg.types()
                 yield str(msg) + '\n\n'
@@ -1139,11 +2149,33 @@ class ProtoFile:
                 yield extension.tags()
             yield '\n'
 
+            if any(msg.has_bits for msg in self.messages):
+                yield '/* Bit numbers in has_bits (for use with PB_HAS_BIT() etc.) */\n'
+                for msg in sort_dependencies(self.messages):
+                    for field in msg.ordered_fields:
+                        if field.has_bit is not None:
+                            yield field.hasbit()
+                yield '\n'
+
             yield '/* Struct field encoding specification for nanopb */\n'
             for msg in self.messages:
                 yield msg.fields_declaration() + '\n'
             yield '\n'
 
+            if any(msg.parse_table for msg in self.messages):
+                yield '/* Parse tables for pb_decode_table() */\n'
+                for msg in self.messages:
+                    if msg.parse_table:
+                        yield msg.parse_table_declaration() + '\n'
+                yield '\n'
+
+            if any(msg.generate_functions for msg in self.messages):
+                yield '/* Specialized encoding and decoding functions */\n'
+                for msg in self.messages:
+                    if msg.generate_functions:
+                        yield msg.functions_declaration()
+                yield '\n'
+
             yield '/* Maximum encoded size of messages (where known) */\n'
             for msg in self.messages:
                 msize = msg.encoded_size(self.dependencies)
@@ -1185,6 +2217,21 @@ class ProtoFile:
         yield '} /* extern "C" */\n'
         yield '#endif\n'
 
+        if any(msg.cpp_descriptor for msg in self.messages):
+            yield '\n#if defined(__cplusplus) && __cplusplus >= 201703L\n'
+            try:
+                yield options.libformat % ('pb.hpp')
+            except TypeError:
+                yield options.libformat
+            yield '\n\n'
+            yield '/* Message descriptors for the C++ interface in pb.hpp */\n'
+            yield 'namespace nanopb {\n\n'
+            for msg in sort_dependencies(self.messages):
+                if msg.cpp_descriptor:
+                    yield msg.cpp_descriptor_definition(self.dependencies)
+            yield '} /* namespace nanopb */\n'
+            yield '#endif\n'
+
         # End of header
         yield '/* @@protoc_insertion_point(eof) */\n'
         yield '\n#endif\n'
@@ -1199,6 +2246,17 @@ class ProtoFile:
             yield '/* Generated by %s at %s. */\n\n' % (nanopb_version, time.asctime())
         yield options.genformat % (headername)
         yield '\n'
+
+        if any(msg.generate_functions for msg in self.messages):
+            for header in ('pb_encode.h', 'pb_decode.h'):
+                try:
+                    yield options.libformat % (header)
+                except TypeError:
+                    # no %s specified - the library header given in
+                    # options.libformat has to declare these functions too
+                    pass
+            yield '\n'
+
         yield '/* @@protoc_insertion_point(includes) */\n'
 
         yield '#if PB_PROTO_HEADER_VERSION != 30\n'
@@ -1206,6 +2264,18 @@ class ProtoFile:
         yield '#endif\n'
         yield '\n'
 
+        if any(msg.has_bits for msg in self.messages):
+            yield '#ifndef PB_ENABLE_HAS_BITMAP\n'
+            yield '#error Messages with the has_bitmap option require PB_ENABLE_HAS_BITMAP.\n'
+            yield '#endif\n'
+            yield '\n'
+
+        if any(msg.encode_cache for msg in self.messages):
+            yield '#ifndef PB_ENCODE_CACHE\n'
+            yield '#error Messages with the encode_cache option require PB_ENCODE_CACHE.\n'
+            yield '#endif\n'
+            yield '\n'
+
         for msg in self.messages:
             yield msg.default_decl(False)
 
@@ -1214,6 +2284,14 @@ class ProtoFile:
         for msg in self.messages:
             yield msg.fields_definition() + '\n\n'
 
+        for msg in self.messages:
+            if msg.parse_table:
+                yield msg.parse_table_definition()
+
+        for msg in self.messages:
+            if msg.generate_functions:
+                yield msg.functions_definition(self.dependencies)
+
         for ext in self.extensions:
             yield ext.extension_def() + '\n'
 
@@ -1234,6 +2312,13 @@ class ProtoFile:
             checks_msgnames.append(msg.name)
             for field in msg.fields:
                 max_field.extend(field.largest_field_value())
+            if msg.has_bits or msg.minimize_padding:
+                # The size_offset deltas to has_bits and to the separately
+                # placed has_ and _count members span the whole struct.
+                max_field.extend(FieldMaxSize(0, ['2 * sizeof(%s)' % msg.name], str(msg.name)))
+            elif msg.encode_cache:
+                # The offset of the cache pointer is stored in the first entry.
+                max_field.extend(FieldMaxSize(0, ['sizeof(%s)' % msg.name], str(msg.name)))
 
         worst = max_field.worst
         worst_field = max_field.worst_field
@@ -33,6 +33,51 @@
 /* Disable support for custom streams (support only memory buffers). */
 /* #define PB_BUFFER_ONLY 1 */
 
+/* Record error code, byte offset and field path of decoding errors
+ * in a pb_errctx_t attached to the input stream. */
+/* #define PB_ERROR_CONTEXT 1 */
+
+/* Enable pb_encode_cached(), which stores submessage sizes in a
+ * caller-provided array instead of encoding submessages twice. */
+/* #define PB_ENCODE_SIZE_CACHE 1 */
+
+/* Enable pb_decode_table(), which decodes messages using the parse
+ * tables generated with the parse_table option. */
+/* #define PB_DECODE_TABLE 1 */
+
+/* Enable pb_encode_table(), which writes the field tags from the
+ * pre-encoded bytes in the parse tables. */
+/* #define PB_ENCODE_TABLE 1 */
+
+/* Enable support for messages generated with the has_bitmap option,
+ * which store the has_ flags of optional fields as bits in a bitmap. */
+/* #define PB_ENABLE_HAS_BITMAP 1 */
+
+/* Enable pb_encode_parallel(), which encodes large arrays of submessages
+ * in chunks using worker threads provided by the application. */
+/* #define PB_ENCODE_PARALLEL 1 */
+
+/* Enable support for the encode_cache option, which stores the encoded
+ * bytes of a message in application-provided storage and copies them
+ * while the message is unchanged. */
+/* #define PB_ENCODE_CACHE 1 */
+
+/* Enable pb_encode_delta() and pb_decode_delta(), which send only the
+ * fields that changed since the previous version of a message. */
+/* #define PB_ENABLE_DELTA 1 */
+
+/* Enable pb_encoder_pump(), which produces the encoded message in pieces
+ * for non-blocking output. Not available with PB_BUFFER_ONLY. */
+/* #define PB_ENCODE_PUMP 1 */
+
+/* Enable pb_ostream_from_chain(), which writes into a chain of fixed-size
+ * chunks taken from a pool. Not available with PB_BUFFER_ONLY. */
+/* #define PB_CHAIN_STREAM 1 */
+
+/* Enable pb_istream_from_iovec(), which reads a message that is split in
+ * several memory segments. Not available with PB_BUFFER_ONLY. */
+/* #define PB_IOVEC_STREAM 1 */
+
 /* Switch back to the old-style callback function signature.
  * This was the default until nanopb-0.2.1. */
 /* #define PB_OLD_CALLBACK_STYLE */
@@ -180,6 +225,12 @@ typedef uint_least8_t pb_type_t;
 #define PB_LTYPES_COUNT 0x0A
 #define PB_LTYPE_MASK 0x0F
 
+/* Encode cache pseudo-field
+ * Only used as the first entry of the field list, with tag 0, for messages
+ * with the encode_cache option. data_offset is the offset of the
+ * pb_encode_cache_t pointer. The field iterator skips this entry. */
+#define PB_LTYPE_ENCODE_CACHE 0x0F
+
 /**** Field repetition rules ****/
 
 #define PB_HTYPE_REQUIRED 0x00
@@ -193,6 +244,7 @@ typedef uint_least8_t pb_type_t;
 #define PB_ATYPE_STATIC   0x00
 #define PB_ATYPE_POINTER  0x80
 #define PB_ATYPE_CALLBACK 0x40
+#define PB_ATYPE_HYBRID   0xC0
 #define PB_ATYPE_MASK     0xC0
 
 #define PB_ATYPE(x) ((x) & PB_ATYPE_MASK)
@@ -254,6 +306,50 @@ PB_PACKED_STRUCT_END
 PB_STATIC_ASSERT(sizeof(int64_t) == 2 * sizeof(int32_t), INT64_T_WRONG_SIZE)
 PB_STATIC_ASSERT(sizeof(uint64_t) == 2 * sizeof(uint32_t), UINT64_T_WRONG_SIZE)
 
+/* Data type used for absolute struct member offsets in parse tables. */
+#if defined(PB_FIELD_32BIT)
+    typedef uint32_t pb_parse_offset_t;
+#else
+    typedef uint16_t pb_parse_offset_t;
+#endif
+#define PB_PARSE_NO_SIZE ((pb_parse_offset_t)-1)
+
+/* Handlers for parse table entries. FALLBACK decodes the field through
+ * the pb_field_t iterator, FIELD calls the decoder for the field LTYPE
+ * and the rest are specialized for the most common field types. */
+#define PB_PARSE_FALLBACK  0
+#define PB_PARSE_FIELD     1
+#define PB_PARSE_VARINT32  2
+#define PB_PARSE_VARINT64  3
+#define PB_PARSE_UVARINT32 4
+#define PB_PARSE_UVARINT64 5
+#define PB_PARSE_FIXED32   6
+#define PB_PARSE_FIXED64   7
+
+/* Parse table entry, one for each entry in the pb_field_t array.
+ * These are generated with the parse_table option and used by
+ * pb_decode_table(). The expected tag is stored as it appears on the
+ * wire, so that it can be compared directly against the input data.
+ */
+typedef struct pb_parse_entry_s pb_parse_entry_t;
+struct pb_parse_entry_s {
+    const pb_field_t *field;
+    uint32_t tag_bytes; /* Encoded tag and wire type, first byte in the lowest bits */
+    pb_parse_offset_t data_offset; /* Offset of field data from start of struct */
+    pb_parse_offset_t size_offset; /* Offset of has-boolean or PB_PARSE_NO_SIZE */
+    pb_size_t required_index; /* Index among required fields */
+    uint8_t tag_size; /* Length of tag_bytes, or 0 if tag does not fit */
+    uint8_t handler; /* One of PB_PARSE_* */
+};
+
+typedef struct pb_parse_table_s pb_parse_table_t;
+struct pb_parse_table_s {
+    const pb_field_t *fields;
+    const pb_parse_entry_t *entries; /* NULL if not supported for this message */
+    pb_size_t entry_count;
+    pb_size_t required_count;
+};
+
 /* This structure is used for 'bytes' arrays.
  * It has the number of bytes in the beginning, and after that an array.
  * Note that actual structs used will have a different length of bytes array.
@@ -261,12 +357,55 @@ PB_STATIC_ASSERT(sizeof(uint64_t) == 2 * sizeof(uint32_t), UINT64_T_WRONG_SIZE)
 #define PB_BYTES_ARRAY_T(n) struct { pb_size_t size; pb_byte_t bytes[n]; }
 #define PB_BYTES_ARRAY_T_ALLOCSIZE(n) ((size_t)n + offsetof(pb_bytes_array_t, bytes))
 
+/* String with an explicit length, used for string fields with the
+ * sized_string option. The characters are not null-terminated. The layout
+ * is the same as PB_BYTES_ARRAY_T(n), so these are encoded as bytes. */
+#define PB_STRING_ARRAY_T(n) struct { pb_size_t size; char bytes[n]; }
+
+/* Storage of hybrid fields. Up to n entries or bytes are stored inline,
+ * larger values are moved as a whole to a heap allocation pointed to by
+ * spill. Use PB_HYBRID_ITEMS() and PB_HYBRID_BYTES() to get a pointer to
+ * the current data. The spill allocation is freed by pb_release().
+ */
+#define PB_HYBRID_ARRAY_T(type, n) struct { type items[n]; type *spill; }
+#define PB_HYBRID_BYTES_T(n) struct { pb_size_t size; pb_byte_t bytes[n]; pb_byte_t *spill; }
+#define PB_HYBRID_STRING_T(n) struct { pb_size_t size; char bytes[n]; char *spill; }
+#define PB_HYBRID_ITEMS(m, count) \
+    ((size_t)(count) > sizeof((m).items) / sizeof((m).items[0]) ? (m).spill : (m).items)
+#define PB_HYBRID_BYTES(m) ((size_t)(m).size > sizeof((m).bytes) ? (m).spill : (m).bytes)
+
 struct pb_bytes_array_s {
     pb_size_t size;
     pb_byte_t bytes[1];
 };
 typedef struct pb_bytes_array_s pb_bytes_array_t;
 
+/* Encoded bytes of a message with the encode_cache option. The storage is
+ * provided by the application and the encode_cache member of the message
+ * points to it, so the message itself can be const. The encoder fills in
+ * the bytes and sets valid. Clear valid whenever the message or any of its
+ * submessages are modified, for example with PB_INVALIDATE_CACHE(&msg).
+ */
+struct pb_encode_cache_s {
+    pb_byte_t *bytes;   /* Buffer of at least MessageName_size bytes */
+    size_t max_size;    /* Size of the buffer */
+    size_t size;        /* Number of valid bytes */
+    bool valid;
+};
+typedef struct pb_encode_cache_s pb_encode_cache_t;
+
+#define PB_ENCODE_CACHE_INIT(buffer) {(buffer), sizeof(buffer), 0, false}
+#define PB_INVALIDATE_CACHE(msg) \
+    ((msg)->encode_cache != NULL ? (void)((msg)->encode_cache->valid = false) : (void)0)
+
+/* One segment of data for scatter/gather I/O. The fields correspond to
+ * iov_base and iov_len of the POSIX struct iovec. */
+typedef struct pb_iovec_s pb_iovec_t;
+struct pb_iovec_s {
+    const pb_byte_t *base;
+    size_t size;
+};
+
 /* This structure is used for giving the callback function.
  * It is stored in the message structure and filled in by the method that
  * calls pb_decode.
@@ -387,12 +526,25 @@ struct pb_extension_s {
 #define pb_delta(st, m1, m2) ((int)offsetof(st, m1) - (int)offsetof(st, m2))
 /* Marks the end of the field list */
 #define PB_LAST_FIELD {0,(pb_type_t) 0,0,0,0,0,0}
+/* Start of the field list for messages with the encode_cache option. Stores
+ * the absolute offset of the encode_cache member. */
+#define PB_FIRST_FIELD_CACHED(st, m) {0,(pb_type_t) PB_LTYPE_ENCODE_CACHE,offsetof(st, m),0,0,0,0}
+/* Check for the encode_cache pseudo-field at the start of the field list. */
+#define PB_IS_CACHED(fields) ((fields)->tag == 0 && (fields)->type == PB_LTYPE_ENCODE_CACHE)
 
 /* Macros for filling in the data_offset field */
 /* data_offset for first field in a message */
 #define PB_DATAOFFSET_FIRST(st, m1, m2) (offsetof(st, m1))
 /* data_offset for subsequent fields */
 #define PB_DATAOFFSET_OTHER(st, m1, m2) (offsetof(st, m1) - offsetof(st, m2) - pb_membersize(st, m2))
+/* data_offset for fields located before the previous field in the struct,
+ * which happens with the minimize_padding option. The negative value wraps
+ * around, and PB_DATA_DELTA() gives it back. The field after a oneof is
+ * never located before it, because the offset after a union is unsigned. */
+#define PB_DATAOFFSET_BACK(st, m1, m2) ((pb_size_t)((size_t)0 - \
+                                  (offsetof(st, m2) + pb_membersize(st, m2) - offsetof(st, m1))))
+/* Signed value of the data_offset of a field */
+#define PB_DATA_DELTA(field) ((pb_ssize_t)(field)->data_offset)
 /* Choose first/other based on m1 == m2 (deprecated, remains for backwards compatibility) */
 #define PB_DATAOFFSET_CHOOSE(st, m1, m2) (int)(offsetof(st, m1) == offsetof(st, m2) \
                                   ? PB_DATAOFFSET_FIRST(st, m1, m2) \
@@ -438,6 +590,32 @@ struct pb_extension_s {
 
 /* INLINE does not support REPEATED fields. */
 
+/* With the has_bitmap option, the has_ flags are bits in the has_bits array
+ * at the start of the structure. The size_offset points to the array, and
+ * array_size is the number of the bit plus one. */
+#define PB_OPTBIT_STATIC(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_STATIC | PB_HTYPE_OPTIONAL | ltype, \
+    fd, \
+    pb_delta(st, has_bits, m), \
+    pb_membersize(st, m), st ## _ ## m ## _hasbit + 1, ptr}
+
+#define PB_OPTBIT_INLINE(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_STATIC | PB_HTYPE_OPTIONAL | PB_LTYPE_FIXED_LENGTH_BYTES, \
+    fd, \
+    pb_delta(st, has_bits, m), \
+    pb_membersize(st, m), st ## _ ## m ## _hasbit + 1, ptr}
+
+/* Accessors for the has_bits array. The bit number n is given by the
+ * generated MessageName_fieldname_hasbit define. */
+#define PB_HAS_BIT(bits, n) (((bits)[(n) >> 5] >> ((n) & 31)) & 1)
+#define PB_SET_BIT(bits, n) ((bits)[(n) >> 5] |= (uint32_t)1 << ((n) & 31))
+#define PB_CLEAR_BIT(bits, n) ((bits)[(n) >> 5] &= ~((uint32_t)1 << ((n) & 31)))
+
+/* Check if a field descriptor uses the has_bits array. */
+#define PB_HAS_BITMAP(field) (PB_ATYPE((field)->type) == PB_ATYPE_STATIC && \
+                              PB_HTYPE((field)->type) == PB_HTYPE_OPTIONAL && \
+                              (field)->array_size != 0)
+
 /* Allocated fields carry the size of the actual data, not the pointer */
 #define PB_REQUIRED_POINTER(tag, st, m, fd, ltype, ptr) \
     {tag, PB_ATYPE_POINTER | PB_HTYPE_REQUIRED | ltype, \
@@ -459,6 +637,30 @@ struct pb_extension_s {
     fd, pb_delta(st, m ## _count, m), \
     pb_membersize(st, m[0]), 0, ptr}
 
+/* Hybrid bytes and strings carry the size of the whole structure and the
+ * number of bytes stored inline. Hybrid arrays are like static arrays, the
+ * spill pointer follows the entries. */
+#define PB_REQUIRED_HYBRID(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_HYBRID | PB_HTYPE_REQUIRED | ltype, \
+    fd, 0, pb_membersize(st, m), pb_arraysize(st, m.bytes), ptr}
+
+#define PB_OPTIONAL_HYBRID(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_HYBRID | PB_HTYPE_OPTIONAL | ltype, \
+    fd, \
+    pb_delta(st, has_ ## m, m), \
+    pb_membersize(st, m), pb_arraysize(st, m.bytes), ptr}
+
+#define PB_SINGULAR_HYBRID(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_HYBRID | PB_HTYPE_OPTIONAL | ltype, \
+    fd, 0, pb_membersize(st, m), pb_arraysize(st, m.bytes), ptr}
+
+#define PB_REPEATED_HYBRID(tag, st, m, fd, ltype, ptr) \
+    {tag, PB_ATYPE_HYBRID | PB_HTYPE_REPEATED | ltype, \
+    fd, \
+    pb_delta(st, m ## _count, m), \
+    pb_membersize(st, m.items[0]), \
+    pb_arraysize(st, m.items), ptr}
+
 /* Callbacks are much like required fields except with special datatype. */
 #define PB_REQUIRED_CALLBACK(tag, st, m, fd, ltype, ptr) \
     {tag, PB_ATYPE_CALLBACK | PB_HTYPE_REQUIRED | ltype, \
@@ -518,8 +720,8 @@ struct pb_extension_s {
  * - Field type:   BOOL, BYTES, DOUBLE, ENUM, UENUM, FIXED32, FIXED64,
  *                 FLOAT, INT32, INT64, MESSAGE, SFIXED32, SFIXED64
  *                 SINT32, SINT64, STRING, UINT32, UINT64 or EXTENSION
- * - Field rules:  REQUIRED, OPTIONAL or REPEATED
- * - Allocation:   STATIC, INLINE, or CALLBACK
+ * - Field rules:  REQUIRED, OPTIONAL, OPTBIT or REPEATED
+ * - Allocation:   STATIC, INLINE, POINTER, HYBRID or CALLBACK
  * - Placement: FIRST or OTHER, depending on if this is the first field in structure.
  * - Message name
  * - Field name
@@ -567,6 +769,20 @@ struct pb_extension_s {
         PB_DATAOFFSET_ ## placement(message, field, prevfield), \
         PB_LTYPE_MAP_ ## type, ptr)
 
+/* Parse table entries generated with the parse_table option.
+ * Fields decoded directly by a handler have their data and has_
+ * offsets in the entry, other fields only carry the tag.
+ */
+#define PB_PARSE_SIZE_HAS(st, m) offsetof(st, has_ ## m)
+#define PB_PARSE_SIZE_NONE(st, m) PB_PARSE_NO_SIZE
+
+#define PB_PARSE_ENTRY(tag_bytes, tag_size, handler, st, m, sizetype, reqidx, field) \
+    {field, tag_bytes, offsetof(st, m), PB_PARSE_SIZE_ ## sizetype(st, m), \
+    reqidx, tag_size, PB_PARSE_ ## handler}
+
+#define PB_PARSE_ENTRY_FALLBACK(tag_bytes, tag_size, reqidx, field) \
+    {field, tag_bytes, 0, PB_PARSE_NO_SIZE, reqidx, tag_size, PB_PARSE_FALLBACK}
+
 /* These macros are used for giving out error messages.
  * They are mostly a debugging aid; the main error information
  * is the true/false return value from functions.
@@ -0,0 +1,835 @@
+/* pb.hpp: Header-only C++17 interface to nanopb.
+ *
+ * Messages generated with the cpp_descriptor option get a specialization
+ * of nanopb::MessageDescriptor<T> in their .pb.h file. It describes the
+ * fields as compile time constants, so that nanopb::encode<T>() and
+ * nanopb::decode<T>() are instantiated separately for each message type
+ * and the compiler can inline the whole codec. Messages that the templates
+ * cannot handle (callbacks, pointers, oneofs, extensions) are passed on to
+ * pb_encode() and pb_decode() instead. Submessages are always encoded with
+ * pb_encode_submessage(). The output is identical in both cases.
+ *
+ * The message structs are the normal ones from the .pb.h file, so C and C++
+ * code can share them. With PB_ENABLE_MALLOC, nanopb::Message<T> owns a
+ * struct with pointer fields and releases it automatically.
+ */
+
+#ifndef PB_HPP_INCLUDED
+#define PB_HPP_INCLUDED
+
+#include "pb.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+
+#if !defined(__cplusplus) || __cplusplus < 201703L
+#error "pb.hpp requires C++17"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+namespace nanopb {
+
+/* Description of a message type. The generator provides the specializations:
+ *
+ *   inline_codec   true if the field_list can be used for encoding/decoding
+ *   fields         the pb_field_t array for the C library functions
+ *   init_default() returns the struct initialized to default values
+ *   init_zero()    returns the struct initialized to zero
+ *   field_list     FieldList<Field<...>, ...> in the same order as fields
+ */
+template <typename T> struct MessageDescriptor;
+
+/* Value of SizeOffset for fields without a has_ or _count member. */
+constexpr std::size_t no_size = static_cast<std::size_t>(-1);
+
+/* Encoded tag of a field, computed at compile time. */
+struct TagBytes
+{
+    pb_byte_t bytes[5];
+    std::size_t size;
+};
+
+constexpr TagBytes make_tag(uint32_t tag, pb_wire_type_t wire_type)
+{
+    TagBytes result = {{0, 0, 0, 0, 0}, 0};
+    uint32_t value = (tag << 3) | static_cast<uint32_t>(wire_type);
+
+    while (value > 0x7F)
+    {
+        result.bytes[result.size++] = static_cast<pb_byte_t>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    result.bytes[result.size++] = static_cast<pb_byte_t>(value);
+    return result;
+}
+
+constexpr pb_wire_type_t wire_type_of(pb_type_t type)
+{
+    switch (PB_LTYPE(type))
+    {
+        case PB_LTYPE_VARINT:
+        case PB_LTYPE_UVARINT:
+        case PB_LTYPE_SVARINT:
+            return PB_WT_VARINT;
+        case PB_LTYPE_FIXED32:
+            return PB_WT_32BIT;
+        case PB_LTYPE_FIXED64:
+            return PB_WT_64BIT;
+        default:
+            return PB_WT_STRING;
+    }
+}
+
+/* Description of a single static field. The parameters correspond to the
+ * members of pb_field_t, except that the offsets are from the start of the
+ * struct and Submsg is the struct type of a submessage field. */
+template <uint32_t Tag, pb_type_t Type, std::size_t DataOffset, std::size_t SizeOffset,
+          std::size_t DataSize, std::size_t ArraySize = 0, typename Submsg = void>
+struct Field
+{
+    static constexpr uint32_t tag = Tag;
+    static constexpr pb_type_t type = Type;
+    static constexpr pb_type_t ltype = PB_LTYPE(Type);
+    static constexpr pb_type_t htype = PB_HTYPE(Type);
+    static constexpr std::size_t data_offset = DataOffset;
+    static constexpr std::size_t size_offset = SizeOffset;
+    static constexpr std::size_t data_size = DataSize;
+    static constexpr std::size_t array_size = ArraySize;
+    using submsg = Submsg;
+
+    static constexpr bool packable = (htype == PB_HTYPE_REPEATED &&
+                                      ltype <= PB_LTYPE_LAST_PACKABLE);
+    static constexpr pb_wire_type_t wire_type = wire_type_of(Type);
+    static constexpr TagBytes tag_bytes = make_tag(Tag, packable ? PB_WT_STRING : wire_type);
+};
+
+template <typename... Fields>
+struct FieldList
+{
+    static constexpr std::size_t size = sizeof...(Fields);
+};
+
+template <typename T> bool encode(pb_ostream_t &stream, const T &msg);
+template <typename T> bool decode(pb_istream_t &stream, T &msg);
+template <typename T> bool decode_noinit(pb_istream_t &stream, T &msg);
+
+namespace detail {
+
+/* Integer fields are accessed with memcpy(), because enum fields are
+ * stored in the enum type rather than the integer type of the same size. */
+template <std::size_t Size> struct IntTypes;
+template <> struct IntTypes<1> { typedef int_least8_t s; typedef uint_least8_t u; };
+template <> struct IntTypes<2> { typedef int_least16_t s; typedef uint_least16_t u; };
+template <> struct IntTypes<4> { typedef int32_t s; typedef uint32_t u; };
+template <> struct IntTypes<8> { typedef int64_t s; typedef uint64_t u; };
+
+template <typename I>
+inline I load(const char *src)
+{
+    I value;
+    std::memcpy(&value, src, sizeof(I));
+    return value;
+}
+
+template <typename I>
+inline void store(char *dest, I value)
+{
+    std::memcpy(dest, &value, sizeof(I));
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+    if (value < 0)
+        return ~(static_cast<uint64_t>(value) << 1);
+    else
+        return static_cast<uint64_t>(value) << 1;
+}
+
+inline bool write_tag(pb_ostream_t *stream, const TagBytes &tag)
+{
+    return pb_write(stream, tag.bytes, tag.size);
+}
+
+/* Encoded size of a packable value, without the tag. */
+template <typename F>
+inline std::size_t value_size(const char *src)
+{
+    typedef typename IntTypes<F::data_size>::s S;
+    typedef typename IntTypes<F::data_size>::u U;
+
+    if constexpr (F::ltype == PB_LTYPE_VARINT)
+        return pb_varint_size(static_cast<uint64_t>(static_cast<int64_t>(load<S>(src))));
+    else if constexpr (F::ltype == PB_LTYPE_UVARINT)
+        return pb_varint_size(load<U>(src));
+    else if constexpr (F::ltype == PB_LTYPE_SVARINT)
+        return pb_varint_size(zigzag(load<S>(src)));
+    else if constexpr (F::ltype == PB_LTYPE_FIXED32)
+        return 4;
+    else
+        return 8;
+}
+
+/* Check if a proto3 singular field has its default value, in which case
+ * it is not encoded. Same rules as in encode_basic_field(). */
+template <typename F>
+inline bool is_default(const char *src)
+{
+    if constexpr (F::ltype == PB_LTYPE_BYTES)
+        return reinterpret_cast<const pb_bytes_array_t*>(src)->size == 0;
+    else if constexpr (F::ltype == PB_LTYPE_STRING)
+        return *src == '\0';
+    else if constexpr (F::data_size == 1 || F::data_size == 2 ||
+                       F::data_size == 4 || F::data_size == 8)
+        return load<typename IntTypes<F::data_size>::u>(src) == 0;
+    else
+        return false;
+}
+
+/* Submessages are encoded by the C library, which writes them into memory
+ * buffers in a single pass and patches the length prefix afterwards. */
+template <typename T>
+inline bool encode_submessage(pb_ostream_t *stream, const T &msg)
+{
+    return pb_encode_submessage(stream, MessageDescriptor<T>::fields, &msg);
+}
+
+/* Encode a single value, without the tag. */
+template <typename F>
+inline bool encode_value(pb_ostream_t *stream, const char *src)
+{
+    if constexpr (F::ltype == PB_LTYPE_VARINT)
+    {
+        typedef typename IntTypes<F::data_size>::s I;
+        return pb_encode_varint(stream, static_cast<uint64_t>(static_cast<int64_t>(load<I>(src))));
+    }
+    else if constexpr (F::ltype == PB_LTYPE_UVARINT)
+    {
+        typedef typename IntTypes<F::data_size>::u I;
+        return pb_encode_varint(stream, load<I>(src));
+    }
+    else if constexpr (F::ltype == PB_LTYPE_SVARINT)
+    {
+        typedef typename IntTypes<F::data_size>::s I;
+        return pb_encode_svarint(stream, load<I>(src));
+    }
+    else if constexpr (F::ltype == PB_LTYPE_FIXED32)
+    {
+        return pb_encode_fixed32(stream, src);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_FIXED64)
+    {
+        return pb_encode_fixed64(stream, src);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_BYTES)
+    {
+        const pb_bytes_array_t *bytes = reinterpret_cast<const pb_bytes_array_t*>(src);
+        if (PB_BYTES_ARRAY_T_ALLOCSIZE(bytes->size) > F::data_size)
+            PB_RETURN_ERROR(stream, "bytes size exceeded");
+        return pb_encode_string(stream, bytes->bytes, bytes->size);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_STRING)
+    {
+        const void *end = std::memchr(src, '\0', F::data_size);
+        std::size_t size = end ? static_cast<std::size_t>(static_cast<const char*>(end) - src) : F::data_size;
+        return pb_encode_string(stream, reinterpret_cast<const pb_byte_t*>(src), size);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_FIXED_LENGTH_BYTES)
+    {
+        return pb_encode_string(stream, reinterpret_cast<const pb_byte_t*>(src), F::data_size);
+    }
+    else
+    {
+        static_assert(F::ltype == PB_LTYPE_SUBMESSAGE, "unsupported field type");
+        return encode_submessage(stream, *reinterpret_cast<const typename F::submsg*>(src));
+    }
+}
+
+template <typename F>
+inline bool encode_field(pb_ostream_t *stream, const char *base)
+{
+    const char *src = base + F::data_offset;
+
+    if constexpr (F::htype == PB_HTYPE_REPEATED)
+    {
+        pb_size_t count = load<pb_size_t>(base + F::size_offset);
+        pb_size_t i;
+
+        if (count == 0)
+            return true;
+
+        if (count > F::array_size)
+            PB_RETURN_ERROR(stream, "array max size exceeded");
+
+        if constexpr (F::packable)
+        {
+            std::size_t size = 0;
+
+            if constexpr (F::ltype == PB_LTYPE_FIXED32 || F::ltype == PB_LTYPE_FIXED64)
+            {
+                size = count * value_size<F>(src);
+            }
+            else
+            {
+                for (i = 0; i < count; i++)
+                    size += value_size<F>(src + i * F::data_size);
+            }
+
+            if (!write_tag(stream, F::tag_bytes))
+                return false;
+
+            if (!pb_encode_varint(stream, static_cast<uint64_t>(size)))
+                return false;
+
+            for (i = 0; i < count; i++)
+            {
+                if (!encode_value<F>(stream, src + i * F::data_size))
+                    return false;
+            }
+        }
+        else
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (!write_tag(stream, F::tag_bytes))
+                    return false;
+
+                if (!encode_value<F>(stream, src + i * F::data_size))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+    else
+    {
+        if constexpr (F::size_offset != no_size)
+        {
+            if (!load<bool>(base + F::size_offset))
+                return true;
+        }
+        else if constexpr (F::htype == PB_HTYPE_OPTIONAL)
+        {
+            /* proto3 singular field */
+            if (is_default<F>(src))
+                return true;
+        }
+
+        if (!write_tag(stream, F::tag_bytes))
+            return false;
+
+        return encode_value<F>(stream, src);
+    }
+}
+
+template <typename... F>
+inline bool encode_list(pb_ostream_t *stream, const char *src, FieldList<F...>)
+{
+    (void)stream;
+    (void)src;
+    return (encode_field<F>(stream, src) && ...);
+}
+
+template <typename T>
+bool encode_fields(pb_ostream_t *stream, const char *src)
+{
+    return encode_list(stream, src, typename MessageDescriptor<T>::field_list());
+}
+
+/* Index of the field at pos among the required fields of the list. */
+template <typename... F>
+constexpr unsigned required_index(FieldList<F...>, std::size_t pos)
+{
+    const bool required[] = {(F::htype == PB_HTYPE_REQUIRED)..., false};
+    unsigned count = 0;
+    std::size_t i;
+
+    for (i = 0; i < pos; i++)
+    {
+        if (required[i])
+            count++;
+    }
+    return count;
+}
+
+template <typename... F>
+constexpr uint64_t required_mask(FieldList<F...>)
+{
+    unsigned count = required_index(FieldList<F...>(), sizeof...(F));
+    return (count >= 64) ? ~static_cast<uint64_t>(0) : (static_cast<uint64_t>(1) << count) - 1;
+}
+
+template <typename F, typename S>
+inline bool decode_varint_value(pb_istream_t *stream, char *dest)
+{
+    typedef typename IntTypes<F::data_size>::s I;
+    int64_t value;
+
+    if constexpr (std::is_same<S, int64_t>::value)
+    {
+        /* SVARINT */
+        if (!pb_decode_svarint(stream, &value))
+            return false;
+    }
+    else
+    {
+        /* VARINT: sign of <=32 bit fields from the lower bits, see pb_dec_varint(). */
+        uint64_t raw;
+        if (!pb_decode_varint(stream, &raw))
+            return false;
+
+        if constexpr (F::data_size == sizeof(int64_t))
+            value = static_cast<int64_t>(raw);
+        else
+            value = static_cast<int32_t>(raw);
+    }
+
+    store<I>(dest, static_cast<I>(value));
+    if (static_cast<I>(value) != value)
+        PB_RETURN_ERROR(stream, "integer too large");
+
+    return true;
+}
+
+/* Decode a single value. Array items are initialized before decoding,
+ * other submessages have been initialized by decode(). */
+template <typename F>
+inline bool decode_value(pb_istream_t *stream, char *dest)
+{
+    if constexpr (F::ltype == PB_LTYPE_VARINT)
+    {
+        return decode_varint_value<F, uint64_t>(stream, dest);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_SVARINT)
+    {
+        return decode_varint_value<F, int64_t>(stream, dest);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_UVARINT)
+    {
+        typedef typename IntTypes<F::data_size>::u I;
+        uint64_t value;
+        if (!pb_decode_varint(stream, &value))
+            return false;
+
+        store<I>(dest, static_cast<I>(value));
+        if (static_cast<I>(value) != value)
+            PB_RETURN_ERROR(stream, "integer too large");
+
+        return true;
+    }
+    else if constexpr (F::ltype == PB_LTYPE_FIXED32)
+    {
+        return pb_decode_fixed32(stream, dest);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_FIXED64)
+    {
+        return pb_decode_fixed64(stream, dest);
+    }
+    else if constexpr (F::ltype == PB_LTYPE_BYTES ||
+                       F::ltype == PB_LTYPE_STRING ||
+                       F::ltype == PB_LTYPE_FIXED_LENGTH_BYTES)
+    {
+        uint64_t size;
+        if (!pb_decode_varint(stream, &size))
+            return false;
+
+        if constexpr (F::ltype == PB_LTYPE_BYTES)
+        {
+            pb_bytes_array_t *bytes = reinterpret_cast<pb_bytes_array_t*>(dest);
+            if (size > PB_SIZE_MAX || PB_BYTES_ARRAY_T_ALLOCSIZE(size) > F::data_size)
+                PB_RETURN_ERROR(stream, "bytes overflow");
+
+            bytes->size = static_cast<pb_size_t>(size);
+            return pb_read(stream, bytes->bytes, static_cast<std::size_t>(size));
+        }
+        else if constexpr (F::ltype == PB_LTYPE_STRING)
+        {
+            bool status;
+            if (size >= F::data_size)
+                PB_RETURN_ERROR(stream, "string overflow");
+
+            status = pb_read(stream, reinterpret_cast<pb_byte_t*>(dest), static_cast<std::size_t>(size));
+            dest[size] = '\0';
+            return status;
+        }
+        else
+        {
+            if (size != F::data_size)
+                PB_RETURN_ERROR(stream, "incorrect inline bytes size");
+
+            return pb_read(stream, reinterpret_cast<pb_byte_t*>(dest), F::data_size);
+        }
+    }
+    else
+    {
+        typedef typename F::submsg S;
+        pb_istream_t substream;
+        bool status;
+
+        static_assert(F::ltype == PB_LTYPE_SUBMESSAGE, "unsupported field type");
+
+        if (!pb_make_string_substream(stream, &substream))
+            return false;
+
+        if constexpr (F::htype == PB_HTYPE_REPEATED)
+            status = decode(substream, *reinterpret_cast<S*>(dest));
+        else
+            status = decode_noinit(substream, *reinterpret_cast<S*>(dest));
+
+        pb_close_string_substream(stream, &substream);
+        return status;
+    }
+}
+
+template <typename F>
+inline bool decode_field(pb_istream_t *stream, char *base, pb_wire_type_t wire_type)
+{
+    char *dest = base + F::data_offset;
+
+    if constexpr (F::htype == PB_HTYPE_REPEATED)
+    {
+        pb_size_t *count = reinterpret_cast<pb_size_t*>(base + F::size_offset);
+
+        if constexpr (F::packable)
+        {
+            if (wire_type == PB_WT_STRING)
+            {
+                bool status = true;
+                pb_istream_t substream;
+                if (!pb_make_string_substream(stream, &substream))
+                    return false;
+
+                while (substream.bytes_left > 0 && *count < F::array_size)
+                {
+                    if (!decode_value<F>(&substream, dest + F::data_size * (*count)))
+                    {
+                        status = false;
+                        break;
+                    }
+                    (*count)++;
+                }
+                pb_close_string_substream(stream, &substream);
+
+                if (substream.bytes_left != 0)
+                    PB_RETURN_ERROR(stream, "array overflow");
+
+                return status;
+            }
+        }
+
+        if (wire_type != F::wire_type)
+            PB_RETURN_ERROR(stream, "wrong wire type");
+
+        if (*count >= F::array_size)
+            PB_RETURN_ERROR(stream, "array overflow");
+
+        dest += F::data_size * (*count)++;
+        return decode_value<F>(stream, dest);
+    }
+    else
+    {
+        if (wire_type != F::wire_type)
+            PB_RETURN_ERROR(stream, "wrong wire type");
+
+        if constexpr (F::size_offset != no_size)
+            store<bool>(base + F::size_offset, true);
+
+        return decode_value<F>(stream, dest);
+    }
+}
+
+/* Decode the field if the tag matches. Returns false if it did not. */
+template <typename L, typename F, std::size_t Index>
+inline bool decode_if_match(pb_istream_t *stream, char *base, uint32_t tag, pb_wire_type_t wire_type,
+                            uint64_t *fields_seen, int *status)
+{
+    if (F::tag != tag)
+        return false;
+
+    *status = decode_field<F>(stream, base, wire_type) ? 1 : -1;
+
+    if constexpr (F::htype == PB_HTYPE_REQUIRED)
+        *fields_seen |= static_cast<uint64_t>(1) << required_index(L(), Index);
+
+    return true;
+}
+
+/* Find the field by tag and decode it. Returns 1 if the field was decoded,
+ * 0 if it is unknown and -1 on error. */
+template <typename L, typename... F, std::size_t... I>
+inline int decode_list(pb_istream_t *stream, char *base, uint32_t tag, pb_wire_type_t wire_type,
+                       uint64_t *fields_seen, FieldList<F...>, std::index_sequence<I...>)
+{
+    int status = 0;
+    (void)stream;
+    (void)base;
+    (void)tag;
+    (void)wire_type;
+    (void)fields_seen;
+    (void)(decode_if_match<L, F, I>(stream, base, tag, wire_type, fields_seen, &status) || ...);
+    return status;
+}
+
+template <typename T>
+bool decode_fields(pb_istream_t *stream, T &msg)
+{
+    typedef typename MessageDescriptor<T>::field_list L;
+    char *base = reinterpret_cast<char*>(&msg);
+    uint64_t fields_seen = 0;
+
+    while (stream->bytes_left)
+    {
+        uint32_t tag;
+        pb_wire_type_t wire_type;
+        bool eof;
+        int status;
+
+        if (!pb_decode_tag(stream, &wire_type, &tag, &eof))
+        {
+            if (eof)
+                break;
+            else
+                return false;
+        }
+
+        status = decode_list<L>(stream, base, tag, wire_type, &fields_seen,
+                                L(), std::make_index_sequence<L::size>());
+        if (status < 0)
+            return false;
+
+        if (status == 0 && !pb_skip_field(stream, wire_type))
+            return false;
+    }
+
+    if (fields_seen != required_mask(L()))
+        PB_RETURN_ERROR(stream, "missing required field");
+
+    return true;
+}
+
+} /* namespace detail */
+
+/* Encode a message to the stream. Same as pb_encode(stream, fields, &msg). */
+template <typename T>
+bool encode(pb_ostream_t &stream, const T &msg)
+{
+    typedef MessageDescriptor<T> D;
+
+    if constexpr (D::inline_codec)
+        return detail::encode_fields<T>(&stream, reinterpret_cast<const char*>(&msg));
+    else
+        return pb_encode(&stream, D::fields, &msg);
+}
+
+/* Encode a message into a memory buffer and return the number of bytes
+ * written in 'written'. */
+template <typename T>
+bool encode(pb_byte_t *buffer, std::size_t bufsize, const T &msg, std::size_t &written)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, bufsize);
+    bool status = encode(stream, msg);
+    written = stream.bytes_written;
+    return status;
+}
+
+/* Calculate the encoded size of a message. */
+template <typename T>
+bool get_encoded_size(std::size_t &size, const T &msg)
+{
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    if (!encode(stream, msg))
+        return false;
+    size = stream.bytes_written;
+    return true;
+}
+
+/* Decode a message from the stream, without first initializing the struct.
+ * Same as pb_decode_noinit(stream, fields, &msg). */
+template <typename T>
+bool decode_noinit(pb_istream_t &stream, T &msg)
+{
+    typedef MessageDescriptor<T> D;
+
+    if constexpr (D::inline_codec)
+        return detail::decode_fields(&stream, msg);
+    else
+        return pb_decode_noinit(&stream, D::fields, &msg);
+}
+
+/* Decode a message from the stream. Same as pb_decode(stream, fields, &msg). */
+template <typename T>
+bool decode(pb_istream_t &stream, T &msg)
+{
+    typedef MessageDescriptor<T> D;
+
+    if constexpr (D::inline_codec)
+    {
+        msg = D::init_default();
+        return detail::decode_fields(&stream, msg);
+    }
+    else
+    {
+        return pb_decode(&stream, D::fields, &msg);
+    }
+}
+
+/* Decode a message directly from memory, without copying the data. */
+template <typename T>
+bool decode(const pb_byte_t *data, std::size_t size, T &msg)
+{
+    pb_istream_t stream = pb_istream_from_buffer(data, size);
+    return decode(stream, msg);
+}
+
+template <typename T>
+bool decode(std::string_view data, T &msg)
+{
+    return decode(reinterpret_cast<const pb_byte_t*>(data.data()), data.size(), msg);
+}
+
+#ifdef __cpp_lib_span
+template <typename T>
+bool encode(std::span<pb_byte_t> buffer, const T &msg, std::size_t &written)
+{
+    return encode(buffer.data(), buffer.size(), msg, written);
+}
+
+template <typename T>
+bool decode(std::span<const pb_byte_t> data, T &msg)
+{
+    return decode(data.data(), data.size(), msg);
+}
+#endif
+
+/* View the contents of a static string field. */
+template <std::size_t N>
+std::string_view to_string_view(const char (&str)[N])
+{
+    const void *end = std::memchr(str, '\0', N);
+    return std::string_view(str, end ? static_cast<std::size_t>(static_cast<const char*>(end) - str) : N);
+}
+
+/* View the contents of a static bytes field. */
+template <typename B>
+auto to_string_view(const B &bytes) -> decltype(bytes.size, bytes.bytes, std::string_view())
+{
+    return std::string_view(reinterpret_cast<const char*>(bytes.bytes), bytes.size);
+}
+
+#ifdef PB_ENABLE_MALLOC
+/* Owning wrapper for a message struct with pointer fields. The destructor
+ * releases the allocated fields with pb_release(). Moving transfers the
+ * pointers to the new owner without allocating, and copies must be made
+ * explicitly with copy_to().
+ */
+template <typename T>
+class Message
+{
+public:
+    Message(): m_msg(MessageDescriptor<T>::init_default()) {}
+
+    /* Take ownership of the allocations in msg. msg is cleared. */
+    explicit Message(T &&msg): m_msg(msg)
+    {
+        msg = MessageDescriptor<T>::init_zero();
+    }
+
+    Message(Message &&other) noexcept: m_msg(other.m_msg)
+    {
+        other.m_msg = MessageDescriptor<T>::init_zero();
+    }
+
+    Message &operator=(Message &&other) noexcept
+    {
+        if (this != &other)
+        {
+            pb_release(MessageDescriptor<T>::fields, &m_msg);
+            m_msg = other.m_msg;
+            other.m_msg = MessageDescriptor<T>::init_zero();
+        }
+        return *this;
+    }
+
+    Message(const Message &) = delete;
+    Message &operator=(const Message &) = delete;
+
+    ~Message()
+    {
+        pb_release(MessageDescriptor<T>::fields, &m_msg);
+    }
+
+    T &operator*() { return m_msg; }
+    const T &operator*() const { return m_msg; }
+    T *operator->() { return &m_msg; }
+    const T *operator->() const { return &m_msg; }
+    T *get() { return &m_msg; }
+    const T *get() const { return &m_msg; }
+
+    /* Give up ownership of the struct. The caller must pb_release() it. */
+    T release()
+    {
+        T msg = m_msg;
+        m_msg = MessageDescriptor<T>::init_zero();
+        return msg;
+    }
+
+    /* Release the allocated fields and set the struct to default values. */
+    void reset()
+    {
+        pb_release(MessageDescriptor<T>::fields, &m_msg);
+        m_msg = MessageDescriptor<T>::init_default();
+    }
+
+    bool encode(pb_ostream_t &stream) const
+    {
+        return nanopb::encode(stream, m_msg);
+    }
+
+    /* Decode a new message, releasing the previous contents first. */
+    bool decode(pb_istream_t &stream)
+    {
+        pb_release(MessageDescriptor<T>::fields, &m_msg);
+        return nanopb::decode(stream, m_msg);
+    }
+
+    bool decode(std::string_view data)
+    {
+        pb_istream_t stream = pb_istream_from_buffer(
+            reinterpret_cast<const pb_byte_t*>(data.data()), data.size());
+        return decode(stream);
+    }
+
+    /* Make a deep copy of the message into dest, by encoding it into a
+     * temporary buffer and decoding from there. */
+    bool copy_to(Message &dest) const
+    {
+        std::size_t size;
+        if (!get_encoded_size(size, m_msg))
+            return false;
+
+        std::vector<pb_byte_t> buffer(size);
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer.data(), size);
+        if (!encode(ostream))
+            return false;
+
+        pb_istream_t istream = pb_istream_from_buffer(buffer.data(), ostream.bytes_written);
+        return dest.decode(istream);
+    }
+
+private:
+    T m_msg;
+};
+#endif
+
+} /* namespace nanopb */
+
+#endif
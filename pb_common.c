@@ -7,6 +7,12 @@
 
 bool pb_field_iter_begin(pb_field_iter_t *iter, const pb_field_t *fields, void *dest_struct)
 {
+#ifdef PB_ENCODE_CACHE
+    /* The encode_cache pseudo-field is not a field of the message. */
+    if (PB_IS_CACHED(fields))
+        fields++;
+#endif
+    
     iter->start = fields;
     iter->pos = fields;
     iter->required_field_index = 0;
@@ -46,13 +52,15 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
         {
             /* Don't advance pointers inside unions */
             prev_size = 0;
-            iter->pData = (char*)iter->pData - prev_field->data_offset;
+            iter->pData = (char*)iter->pData - PB_DATA_DELTA(prev_field);
         }
-        else if (PB_ATYPE(prev_field->type) == PB_ATYPE_STATIC &&
+        else if ((PB_ATYPE(prev_field->type) == PB_ATYPE_STATIC ||
+                  PB_ATYPE(prev_field->type) == PB_ATYPE_HYBRID) &&
                  PB_HTYPE(prev_field->type) == PB_HTYPE_REPEATED)
         {
             /* In static arrays, the data_size tells the size of a single entry and
-             * array_size is the number of entries */
+             * array_size is the number of entries. For hybrid arrays, the
+             * data_offset of the next field also skips the spill pointer. */
             prev_size *= prev_field->array_size;
         }
         else if (PB_ATYPE(prev_field->type) == PB_ATYPE_POINTER)
@@ -69,7 +77,17 @@ bool pb_field_iter_next(pb_field_iter_t *iter)
             iter->required_field_index++;
         }
     
-        iter->pData = (char*)iter->pData + prev_size + iter->pos->data_offset;
+        if (PB_HTYPE(prev_field->type) == PB_HTYPE_ONEOF &&
+            PB_HTYPE(iter->pos->type) != PB_HTYPE_ONEOF)
+        {
+            /* The offset after a union also covers the difference between
+             * the largest and the last member, and is always positive. */
+            iter->pData = (char*)iter->pData + prev_size + iter->pos->data_offset;
+        }
+        else
+        {
+            iter->pData = (char*)iter->pData + prev_size + PB_DATA_DELTA(iter->pos);
+        }
         iter->pSize = (char*)iter->pData + iter->pos->size_offset;
         return true;
     }
@@ -95,3 +113,22 @@ bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
 }
 
 
+
+/* Used for determining the alignment of pointers. */
+struct pb_pointer_align_s {
+    char c;
+    void *ptr;
+};
+
+size_t pb_hybrid_spill_offset(const pb_field_t *field)
+{
+    size_t align = offsetof(struct pb_pointer_align_s, ptr);
+    size_t size = field->array_size;
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+        size *= field->data_size;
+    else
+        size += offsetof(pb_bytes_array_t, bytes);
+    
+    return (size + align - 1) / align * align;
+}
@@ -34,6 +34,10 @@ bool pb_field_iter_next(pb_field_iter_t *iter);
  * Returns false if no such field exists. */
 bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag);
 
+/* Offset of the spill pointer of a hybrid field from the field data, i.e.
+ * the size of the inline storage rounded up to pointer alignment. */
+size_t pb_hybrid_spill_offset(const pb_field_t *field);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -24,9 +24,20 @@
 typedef bool (*pb_decoder_t)(pb_istream_t *stream, const pb_field_t *field, void *dest) checkreturn;
 
 static bool checkreturn buf_read(pb_istream_t *stream, pb_byte_t *buf, size_t count);
+#ifdef PB_IOVEC_STREAM
+#ifdef PB_BUFFER_ONLY
+#error PB_IOVEC_STREAM requires custom stream callbacks, it cannot be used with PB_BUFFER_ONLY
+#endif
+static bool checkreturn iovec_read(pb_istream_t *stream, pb_byte_t *buf, size_t count);
+#define SKIPS_DIRECTLY(stream) ((stream)->callback == buf_read || (stream)->callback == iovec_read)
+#else
+#define SKIPS_DIRECTLY(stream) ((stream)->callback == buf_read)
+#endif
 static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest);
 static bool checkreturn read_raw_value(pb_istream_t *stream, pb_wire_type_t wire_type, pb_byte_t *buf, size_t *size);
 static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
+static bool checkreturn hybrid_array_entry(pb_istream_t *stream, pb_field_iter_t *iter, void **pItem);
+static bool checkreturn decode_hybrid_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter);
 static void iter_from_extension(pb_field_iter_t *iter, pb_extension_t *extension);
@@ -45,6 +56,30 @@ static bool checkreturn pb_dec_string(pb_istream_t *stream, const pb_field_t *fi
 static bool checkreturn pb_dec_submessage(pb_istream_t *stream, const pb_field_t *field, void *dest);
 static bool checkreturn pb_skip_varint(pb_istream_t *stream);
 static bool checkreturn pb_skip_string(pb_istream_t *stream);
+static bool checkreturn check_required_fields(pb_istream_t *stream, const uint32_t *fields_seen, unsigned req_field_count);
+
+#ifdef PB_DECODE_TABLE
+static bool match_tag(pb_istream_t *stream, const pb_parse_entry_t *entry);
+static const pb_parse_entry_t *find_entry(const pb_parse_table_t *table, const pb_parse_entry_t *start, uint32_t tag);
+static bool checkreturn decode_entry(pb_istream_t *stream, const pb_parse_entry_t *entry, void *dest_struct);
+#endif
+
+#ifdef PB_ERROR_CONTEXT
+static void errctx_set(pb_istream_t *stream, pb_errcode_t code);
+static void errctx_unwind(pb_istream_t *stream);
+static void errctx_push_tag(pb_istream_t *stream, uint32_t tag);
+static void errctx_wire_type(pb_istream_t *stream, pb_wire_type_t wire_type, const pb_field_t *field);
+#define PB_RETURN_ERRCODE(stream, code, msg) return errctx_set(stream, code), PB_SET_ERROR(stream, msg), false
+#else
+#define errctx_unwind(stream) PB_UNUSED(stream)
+#define errctx_push_tag(stream, tag) PB_UNUSED(tag)
+#define errctx_wire_type(stream, wire_type, field) PB_UNUSED(wire_type)
+#define PB_RETURN_ERRCODE(stream, code, msg) PB_RETURN_ERROR(stream, msg)
+#endif
+
+#ifdef PB_ENCODE_CACHE
+static void invalidate_encode_cache(const pb_field_t fields[], void *dest_struct);
+#endif
 
 #ifdef PB_ENABLE_MALLOC
 static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t data_size, size_t array_size);
@@ -69,6 +104,25 @@ static const pb_decoder_t PB_DECODERS[PB_LTYPES_COUNT] = {
     &pb_dec_bytes /* PB_LTYPE_FIXED_LENGTH_BYTES */
 };
 
+#if defined(PB_ERROR_CONTEXT) || defined(PB_DECODE_TABLE)
+/* --- Expected wire types of the field types ---
+ * Order in the array must match pb_action_t LTYPE numbering.
+ */
+static const pb_wire_type_t PB_WIRE_TYPES[PB_LTYPES_COUNT] = {
+    PB_WT_VARINT,
+    PB_WT_VARINT,
+    PB_WT_VARINT,
+    PB_WT_32BIT,
+    PB_WT_64BIT,
+    
+    PB_WT_STRING,
+    PB_WT_STRING,
+    PB_WT_STRING,
+    PB_WT_STRING, /* extensions */
+    PB_WT_STRING  /* PB_LTYPE_FIXED_LENGTH_BYTES */
+};
+#endif
+
 /*******************************
  * pb_istream_t implementation *
  *******************************/
@@ -90,7 +144,7 @@ static bool checkreturn buf_read(pb_istream_t *stream, pb_byte_t *buf, size_t co
 bool checkreturn pb_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
 {
 #ifndef PB_BUFFER_ONLY
-	if (buf == NULL && stream->callback != buf_read)
+	if (buf == NULL && !SKIPS_DIRECTLY(stream))
 	{
 		/* Skip input bytes */
 		pb_byte_t tmp[16];
@@ -107,11 +161,11 @@ bool checkreturn pb_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
 #endif
 
     if (stream->bytes_left < count)
-        PB_RETURN_ERROR(stream, "end-of-stream");
+        PB_RETURN_ERRCODE(stream, PB_ERR_EOF, "end-of-stream");
     
 #ifndef PB_BUFFER_ONLY
     if (!stream->callback(stream, buf, count))
-        PB_RETURN_ERROR(stream, "io error");
+        PB_RETURN_ERRCODE(stream, PB_ERR_IO, "io error");
 #else
     if (!buf_read(stream, buf, count))
         return false;
@@ -126,11 +180,11 @@ bool checkreturn pb_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
 static bool checkreturn pb_readbyte(pb_istream_t *stream, pb_byte_t *buf)
 {
     if (stream->bytes_left == 0)
-        PB_RETURN_ERROR(stream, "end-of-stream");
+        PB_RETURN_ERRCODE(stream, PB_ERR_EOF, "end-of-stream");
 
 #ifndef PB_BUFFER_ONLY
     if (!stream->callback(stream, buf, 1))
-        PB_RETURN_ERROR(stream, "io error");
+        PB_RETURN_ERRCODE(stream, PB_ERR_IO, "io error");
 #else
     *buf = *(const pb_byte_t*)stream->state;
     stream->state = (pb_byte_t*)stream->state + 1;
@@ -162,8 +216,141 @@ pb_istream_t pb_istream_from_buffer(const pb_byte_t *buf, size_t bufsize)
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
 #endif
+#ifdef PB_ERROR_CONTEXT
+    stream.errctx = NULL;
+#endif
+    return stream;
+}
+
+#ifdef PB_IOVEC_STREAM
+/* Copy or skip count bytes. Reads within the current segment are done
+ * with a single memcpy(), and only reads that cross the end of a segment
+ * need another round of the loop. The caller has checked bytes_left, so
+ * the segments contain enough data. */
+static bool checkreturn iovec_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+    pb_iovec_reader_t *reader = (pb_iovec_reader_t*)stream->state;
+    
+    while (count > 0)
+    {
+        const pb_iovec_t *iov = reader->iov;
+        size_t avail = iov->size - reader->offset;
+        
+        if (avail > count)
+            avail = count;
+        
+        if (buf != NULL)
+        {
+            memcpy(buf, iov->base + reader->offset, avail);
+            buf += avail;
+        }
+        
+        reader->offset += avail;
+        count -= avail;
+        
+        if (reader->offset == iov->size)
+        {
+            reader->iov++;
+            reader->offset = 0;
+        }
+    }
+    
+    return true;
+}
+
+pb_istream_t pb_istream_from_iovec(pb_iovec_reader_t *reader, const pb_iovec_t *iov, size_t count)
+{
+    pb_istream_t stream = pb_istream_from_buffer(NULL, 0);
+    size_t i;
+    
+    reader->iov = iov;
+    reader->offset = 0;
+    
+    for (i = 0; i < count; i++)
+        stream.bytes_left += iov[i].size;
+    
+    stream.callback = &iovec_read;
+    stream.state = reader;
     return stream;
 }
+#endif
+
+#ifdef PB_ERROR_CONTEXT
+void pb_istream_set_errctx(pb_istream_t *stream, pb_errctx_t *errctx)
+{
+    memset(errctx, 0, sizeof(pb_errctx_t));
+    errctx->stream_size = stream->bytes_left;
+    stream->errctx = errctx;
+}
+
+/* Record the error code and the position of the error in the current
+ * (sub)stream. Only the first error is stored, like with errmsg. */
+static void errctx_set(pb_istream_t *stream, pb_errcode_t code)
+{
+    pb_errctx_t *ctx = stream->errctx;
+    if (ctx == NULL || ctx->code != PB_ERR_NONE)
+        return;
+    
+    ctx->code = code;
+    ctx->bytes_left = stream->bytes_left;
+    ctx->offset = ctx->stream_size - ctx->bytes_left;
+}
+
+/* Called on the parent stream after a substream has failed. Substreams
+ * are created by subtracting their length from the parent stream, so the
+ * number of bytes left in the top-level stream is the sum over all levels.
+ */
+static void errctx_unwind(pb_istream_t *stream)
+{
+    pb_errctx_t *ctx = stream->errctx;
+    if (ctx == NULL || ctx->code == PB_ERR_NONE)
+        return;
+    
+    ctx->bytes_left += stream->bytes_left;
+    ctx->offset = ctx->stream_size - ctx->bytes_left;
+}
+
+/* Add the tag of the field that failed to decode to the path. */
+static void errctx_push_tag(pb_istream_t *stream, uint32_t tag)
+{
+    pb_errctx_t *ctx = stream->errctx;
+    if (ctx == NULL)
+        return;
+    
+    if (ctx->code == PB_ERR_NONE)
+        errctx_set(stream, PB_ERR_CALLBACK); /* Callback without errmsg */
+    
+    if (ctx->depth < PB_ERRCTX_MAX_DEPTH)
+        ctx->path[ctx->depth] = tag;
+    
+    if (ctx->depth < PB_SIZE_MAX)
+        ctx->depth++;
+}
+
+/* Called after a field has failed to decode, before its tag is added to
+ * the path. If the wire type did not match the field type, that is the
+ * likely cause, so it is reported instead. Failures inside submessages
+ * already have their own path and are left alone. Repeated fields of
+ * packable types may also be packed. */
+static void errctx_wire_type(pb_istream_t *stream, pb_wire_type_t wire_type, const pb_field_t *field)
+{
+    pb_errctx_t *ctx = stream->errctx;
+    pb_wire_type_t expected = PB_WIRE_TYPES[PB_LTYPE(field->type)];
+    
+    if (ctx == NULL || ctx->depth != 0 || wire_type == expected ||
+        PB_ATYPE(field->type) == PB_ATYPE_CALLBACK)
+        return;
+    
+    if (wire_type == PB_WT_STRING &&
+        PB_HTYPE(field->type) == PB_HTYPE_REPEATED &&
+        PB_LTYPE(field->type) <= PB_LTYPE_LAST_PACKABLE)
+        return;
+    
+    ctx->code = PB_ERR_WRONG_WIRE_TYPE;
+    ctx->expected_wire_type = expected;
+    ctx->actual_wire_type = wire_type;
+}
+#endif
 
 /********************
  * Helper functions *
@@ -191,7 +378,7 @@ static bool checkreturn pb_decode_varint32(pb_istream_t *stream, uint32_t *dest)
         do
         {
             if (bitpos >= 32)
-                PB_RETURN_ERROR(stream, "varint overflow");
+                PB_RETURN_ERRCODE(stream, PB_ERR_VARINT_OVERFLOW, "varint overflow");
             
             if (!pb_readbyte(stream, &byte))
                 return false;
@@ -214,7 +401,7 @@ bool checkreturn pb_decode_varint(pb_istream_t *stream, uint64_t *dest)
     do
     {
         if (bitpos >= 64)
-            PB_RETURN_ERROR(stream, "varint overflow");
+            PB_RETURN_ERRCODE(stream, PB_ERR_VARINT_OVERFLOW, "varint overflow");
         
         if (!pb_readbyte(stream, &byte))
             return false;
@@ -281,7 +468,7 @@ bool checkreturn pb_skip_field(pb_istream_t *stream, pb_wire_type_t wire_type)
         case PB_WT_64BIT: return pb_read(stream, NULL, 8);
         case PB_WT_STRING: return pb_skip_string(stream);
         case PB_WT_32BIT: return pb_read(stream, NULL, 4);
-        default: PB_RETURN_ERROR(stream, "invalid wire_type");
+        default: PB_RETURN_ERRCODE(stream, PB_ERR_INVALID_WIRE_TYPE, "invalid wire_type");
     }
 }
 
@@ -311,7 +498,7 @@ static bool checkreturn read_raw_value(pb_istream_t *stream, pb_wire_type_t wire
             *size = 4;
             return pb_read(stream, buf, 4);
         
-        default: PB_RETURN_ERROR(stream, "invalid wire_type");
+        default: PB_RETURN_ERRCODE(stream, PB_ERR_INVALID_WIRE_TYPE, "invalid wire_type");
     }
 }
 
@@ -326,7 +513,7 @@ bool checkreturn pb_make_string_substream(pb_istream_t *stream, pb_istream_t *su
     
     *substream = *stream;
     if (substream->bytes_left < size)
-        PB_RETURN_ERROR(stream, "parent stream too short");
+        PB_RETURN_ERRCODE(stream, PB_ERR_SUBSTREAM, "parent stream too short");
     
     substream->bytes_left = size;
     stream->bytes_left -= size;
@@ -360,6 +547,11 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
             return func(stream, iter->pos, iter->pData);
             
         case PB_HTYPE_OPTIONAL:
+#ifdef PB_ENABLE_HAS_BITMAP
+            if (PB_HAS_BITMAP(iter->pos))
+                PB_SET_BIT((uint32_t*)iter->pSize, iter->pos->array_size - 1u);
+            else
+#endif
             if (iter->pSize != iter->pData)
                 *(bool*)iter->pSize = true;
             return func(stream, iter->pos, iter->pData);
@@ -387,8 +579,11 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
                 }
                 pb_close_string_substream(stream, &substream);
                 
+                if (!status)
+                    errctx_unwind(stream);
+                
                 if (substream.bytes_left != 0)
-                    PB_RETURN_ERROR(stream, "array overflow");
+                    PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "array overflow");
                 
                 return status;
             }
@@ -398,7 +593,7 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
                 pb_size_t *size = (pb_size_t*)iter->pSize;
                 void *pItem = (char*)iter->pData + iter->pos->data_size * (*size);
                 if (*size >= iter->pos->array_size)
-                    PB_RETURN_ERROR(stream, "array overflow");
+                    PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "array overflow");
                 
                 (*size)++;
                 return func(stream, iter->pos, pItem);
@@ -416,7 +611,7 @@ static bool checkreturn decode_static_field(pb_istream_t *stream, pb_wire_type_t
             return func(stream, iter->pos, iter->pData);
 
         default:
-            PB_RETURN_ERROR(stream, "invalid field type");
+            PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid field type");
     }
 }
 
@@ -430,7 +625,7 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
     void *ptr = *(void**)pData;
     
     if (data_size == 0 || array_size == 0)
-        PB_RETURN_ERROR(stream, "invalid size");
+        PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "invalid size");
     
     /* Check for multiplication overflows.
      * This code avoids the costly division if the sizes are small enough.
@@ -444,7 +639,7 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
             const size_t size_max = (size_t)-1;
             if (size_max / array_size < data_size)
             {
-                PB_RETURN_ERROR(stream, "size too large");
+                PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "size too large");
             }
         }
     }
@@ -454,7 +649,7 @@ static bool checkreturn allocate_field(pb_istream_t *stream, void *pData, size_t
      * the message must be freed by caller also on error return. */
     ptr = pb_realloc(ptr, array_size * data_size);
     if (ptr == NULL)
-        PB_RETURN_ERROR(stream, "realloc failed");
+        PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "realloc failed");
     
     *(void**)pData = ptr;
     return true;
@@ -480,7 +675,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
 #ifndef PB_ENABLE_MALLOC
     PB_UNUSED(wire_type);
     PB_UNUSED(iter);
-    PB_RETURN_ERROR(stream, "no malloc support");
+    PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "no malloc support");
 #else
     pb_type_t type;
     pb_decoder_t func;
@@ -562,6 +757,9 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                     {
 #ifndef PB_NO_ERRMSG
                         stream->errmsg = "too many array entries";
+#endif
+#ifdef PB_ERROR_CONTEXT
+                        errctx_set(&substream, PB_ERR_OVERFLOW);
 #endif
                         status = false;
                         break;
@@ -571,6 +769,9 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 }
                 pb_close_string_substream(stream, &substream);
                 
+                if (!status)
+                    errctx_unwind(stream);
+                
                 return status;
             }
             else
@@ -580,7 +781,7 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
                 void *pItem;
                 
                 if (*size == PB_SIZE_MAX)
-                    PB_RETURN_ERROR(stream, "too many array entries");
+                    PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "too many array entries");
                 
                 (*size)++;
                 if (!allocate_field(stream, iter->pData, iter->pos->data_size, *size))
@@ -592,11 +793,128 @@ static bool checkreturn decode_pointer_field(pb_istream_t *stream, pb_wire_type_
             }
 
         default:
-            PB_RETURN_ERROR(stream, "invalid field type");
+            PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid field type");
     }
 #endif
 }
 
+/* Find the storage for the next entry of a hybrid array. The entries are
+ * moved to the spill allocation when the inline storage is full, and the
+ * allocation is doubled in size whenever it is full. */
+static bool checkreturn hybrid_array_entry(pb_istream_t *stream, pb_field_iter_t *iter, void **pItem)
+{
+    size_t count = *(pb_size_t*)iter->pSize;
+    size_t inline_count = iter->pos->array_size;
+    size_t data_size = iter->pos->data_size;
+    
+    if (count < inline_count)
+    {
+        *pItem = (char*)iter->pData + data_size * count;
+        return true;
+    }
+    
+#ifndef PB_ENABLE_MALLOC
+    PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "array overflow");
+#else
+    {
+        void *pSpill = (char*)iter->pData + pb_hybrid_spill_offset(iter->pos);
+        size_t blocks = count / inline_count;
+        
+        if (count % inline_count == 0 && (blocks & (blocks - 1)) == 0)
+        {
+            if (!allocate_field(stream, pSpill, data_size, count * 2))
+                return false;
+            
+            if (count == inline_count)
+                memcpy(*(void**)pSpill, iter->pData, data_size * inline_count);
+        }
+        
+        *pItem = *(char**)pSpill + data_size * count;
+        return true;
+    }
+#endif
+}
+
+static bool checkreturn decode_hybrid_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
+{
+    pb_type_t type;
+    pb_decoder_t func;
+    
+    type = iter->pos->type;
+    func = PB_DECODERS[PB_LTYPE(type)];
+    
+    switch (PB_HTYPE(type))
+    {
+        case PB_HTYPE_REQUIRED:
+            return func(stream, iter->pos, iter->pData);
+        
+        case PB_HTYPE_OPTIONAL:
+            if (iter->pSize != iter->pData)
+                *(bool*)iter->pSize = true;
+            return func(stream, iter->pos, iter->pData);
+        
+        case PB_HTYPE_REPEATED:
+            if (wire_type == PB_WT_STRING
+                && PB_LTYPE(type) <= PB_LTYPE_LAST_PACKABLE)
+            {
+                /* Packed array */
+                bool status = true;
+                pb_size_t *size = (pb_size_t*)iter->pSize;
+                void *pItem;
+                pb_istream_t substream;
+                if (!pb_make_string_substream(stream, &substream))
+                    return false;
+                
+                while (substream.bytes_left > 0)
+                {
+                    if (*size == PB_SIZE_MAX)
+                    {
+#ifndef PB_NO_ERRMSG
+                        substream.errmsg = "too many array entries";
+#endif
+#ifdef PB_ERROR_CONTEXT
+                        errctx_set(&substream, PB_ERR_OVERFLOW);
+#endif
+                        status = false;
+                        break;
+                    }
+                    
+                    if (!hybrid_array_entry(&substream, iter, &pItem) ||
+                        !func(&substream, iter->pos, pItem))
+                    {
+                        status = false;
+                        break;
+                    }
+                    (*size)++;
+                }
+                pb_close_string_substream(stream, &substream);
+                
+                if (!status)
+                    errctx_unwind(stream);
+                
+                return status;
+            }
+            else
+            {
+                /* Repeated field */
+                pb_size_t *size = (pb_size_t*)iter->pSize;
+                void *pItem;
+                
+                if (*size == PB_SIZE_MAX)
+                    PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "too many array entries");
+                
+                if (!hybrid_array_entry(stream, iter, &pItem))
+                    return false;
+                
+                (*size)++;
+                return func(stream, iter->pos, pItem);
+            }
+        
+        default:
+            PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid field type");
+    }
+}
+
 static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type_t wire_type, pb_field_iter_t *iter)
 {
     pb_callback_t *pCallback = (pb_callback_t*)iter->pData;
@@ -620,7 +938,10 @@ static bool checkreturn decode_callback_field(pb_istream_t *stream, pb_wire_type
         do
         {
             if (!pCallback->funcs.decode(&substream, iter->pos, arg))
-                PB_RETURN_ERROR(stream, "callback failed");
+            {
+                errctx_unwind(stream);
+                PB_RETURN_ERRCODE(stream, PB_ERR_CALLBACK, "callback failed");
+            }
         } while (substream.bytes_left);
         
         pb_close_string_substream(stream, &substream);
@@ -664,11 +985,14 @@ static bool checkreturn decode_field(pb_istream_t *stream, pb_wire_type_t wire_t
         case PB_ATYPE_POINTER:
             return decode_pointer_field(stream, wire_type, iter);
         
+        case PB_ATYPE_HYBRID:
+            return decode_hybrid_field(stream, wire_type, iter);
+        
         case PB_ATYPE_CALLBACK:
             return decode_callback_field(stream, wire_type, iter);
         
         default:
-            PB_RETURN_ERROR(stream, "invalid field type");
+            PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid field type");
     }
 }
 
@@ -773,6 +1097,11 @@ static void pb_field_set_to_default(pb_field_iter_t *iter)
         {
             /* Set has_field to false. Still initialize the optional field
              * itself also. */
+#ifdef PB_ENABLE_HAS_BITMAP
+            if (PB_HAS_BITMAP(iter->pos))
+                PB_CLEAR_BIT((uint32_t*)iter->pSize, iter->pos->array_size - 1u);
+            else
+#endif
             *(bool*)iter->pSize = false;
         }
         else if (PB_HTYPE(type) == PB_HTYPE_REPEATED ||
@@ -815,6 +1144,26 @@ static void pb_field_set_to_default(pb_field_iter_t *iter)
             *(pb_size_t*)iter->pSize = 0;
         }
     }
+    else if (PB_ATYPE(type) == PB_ATYPE_HYBRID)
+    {
+        if (PB_HTYPE(type) == PB_HTYPE_REPEATED)
+        {
+            *(pb_size_t*)iter->pSize = 0;
+        }
+        else
+        {
+            if (PB_HTYPE(type) == PB_HTYPE_OPTIONAL && iter->pSize != iter->pData)
+                *(bool*)iter->pSize = false;
+            
+            if (iter->pos->ptr != NULL)
+                memcpy(iter->pData, iter->pos->ptr, iter->pos->data_size);
+            else
+                ((pb_bytes_array_t*)iter->pData)->size = 0;
+        }
+        
+        /* The spill pointer is not part of the default value */
+        *(void**)((char*)iter->pData + pb_hybrid_spill_offset(iter->pos)) = NULL;
+    }
     else if (PB_ATYPE(type) == PB_ATYPE_CALLBACK)
     {
         /* Don't overwrite callback */
@@ -838,13 +1187,54 @@ static void pb_message_set_to_defaults(const pb_field_t fields[], void *dest_str
  * Decode all fields *
  *********************/
 
+/* Check that the first req_field_count bits are set in fields_seen. */
+static bool checkreturn check_required_fields(pb_istream_t *stream, const uint32_t *fields_seen, unsigned req_field_count)
+{
+    const uint32_t allbits = ~(uint32_t)0;
+    unsigned i;
+    
+    if (req_field_count > 0)
+    {
+        /* Check the whole words */
+        for (i = 0; i < (req_field_count >> 5); i++)
+        {
+            if (fields_seen[i] != allbits)
+                PB_RETURN_ERRCODE(stream, PB_ERR_MISSING_REQUIRED, "missing required field");
+        }
+        
+        /* Check the remaining bits */
+        if ((req_field_count & 31) != 0 &&
+            fields_seen[req_field_count >> 5] != (allbits >> (32 - (req_field_count & 31))))
+            PB_RETURN_ERRCODE(stream, PB_ERR_MISSING_REQUIRED, "missing required field");
+    }
+    
+    return true;
+}
+
+#ifdef PB_ENCODE_CACHE
+/* Decoding modifies the message, so the encoded bytes stored by the
+ * encoder for the encode_cache option are no longer valid. */
+static void invalidate_encode_cache(const pb_field_t fields[], void *dest_struct)
+{
+    if (PB_IS_CACHED(fields))
+    {
+        pb_encode_cache_t *cache = *(pb_encode_cache_t**)((char*)dest_struct + fields->data_offset);
+        if (cache != NULL)
+            cache->valid = false;
+    }
+}
+#endif
+
 bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
 {
     uint32_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 31) / 32] = {0, 0};
-    const uint32_t allbits = ~(uint32_t)0;
     uint32_t extension_range_start = 0;
     pb_field_iter_t iter;
     
+#ifdef PB_ENCODE_CACHE
+    invalidate_encode_cache(fields, dest_struct);
+#endif
+
     /* Return value ignored, as empty message types will be correctly handled by
      * pb_field_iter_find() anyway. */
     (void)pb_field_iter_begin(&iter, fields, dest_struct);
@@ -878,7 +1268,10 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
                     size_t pos = stream->bytes_left;
                 
                     if (!decode_extension(stream, tag, wire_type, &iter))
+                    {
+                        errctx_push_tag(stream, tag);
                         return false;
+                    }
                     
                     if (pos != stream->bytes_left)
                     {
@@ -902,7 +1295,11 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
         }
             
         if (!decode_field(stream, wire_type, &iter))
+        {
+            errctx_wire_type(stream, wire_type, iter.pos);
+            errctx_push_tag(stream, tag);
             return false;
+        }
     }
     
     /* Check that all required fields were present. */
@@ -913,7 +1310,6 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
          */
         unsigned req_field_count;
         pb_type_t last_type;
-        unsigned i;
         do {
             req_field_count = iter.required_field_index;
             last_type = iter.pos->type;
@@ -923,22 +1319,8 @@ bool checkreturn pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[
         if (PB_HTYPE(last_type) == PB_HTYPE_REQUIRED && iter.pos->tag != 0)
             req_field_count++;
         
-        if (req_field_count > 0)
-        {
-            /* Check the whole words */
-            for (i = 0; i < (req_field_count >> 5); i++)
-            {
-                if (fields_seen[i] != allbits)
-                    PB_RETURN_ERROR(stream, "missing required field");
-            }
-            
-            /* Check the remaining bits */
-            if (fields_seen[req_field_count >> 5] != (allbits >> (32 - (req_field_count & 31))))
-                PB_RETURN_ERROR(stream, "missing required field");
-        }
+        return check_required_fields(stream, fields_seen, req_field_count);
     }
-    
-    return true;
 }
 
 bool checkreturn pb_decode(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
@@ -965,9 +1347,230 @@ bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *
     
     status = pb_decode(&substream, fields, dest_struct);
     pb_close_string_substream(stream, &substream);
+    
+    if (!status)
+        errctx_unwind(stream);
+    
     return status;
 }
 
+#ifdef PB_ENABLE_DELTA
+bool pb_decode_delta(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct)
+{
+    /* The encoder only writes changes that merging can apply. */
+    return pb_decode_noinit(stream, fields, dest_struct);
+}
+#endif
+
+#ifdef PB_DECODE_TABLE
+/*******************************
+ * Decode using a parse table  *
+ *******************************/
+
+/* Compare the next bytes of a memory buffer stream against the encoded
+ * tag of the entry, and consume them if they match. Other streams cannot
+ * be peeked, so the tag is decoded normally for them. */
+static bool match_tag(pb_istream_t *stream, const pb_parse_entry_t *entry)
+{
+    const pb_byte_t *p = (const pb_byte_t*)stream->state;
+    unsigned i;
+    
+#ifndef PB_BUFFER_ONLY
+    if (stream->callback != &buf_read)
+        return false;
+#endif
+    
+    if (entry->tag_size == 0 || stream->bytes_left < entry->tag_size)
+        return false;
+    
+    for (i = 0; i < entry->tag_size; i++)
+    {
+        if (p[i] != (pb_byte_t)(entry->tag_bytes >> (8 * i)))
+            return false;
+    }
+    
+    stream->state = (pb_byte_t*)stream->state + entry->tag_size;
+    stream->bytes_left -= entry->tag_size;
+    return true;
+}
+
+/* Find the entry for a tag, starting from the predicted entry and
+ * wrapping around at the end of the table. */
+static const pb_parse_entry_t *find_entry(const pb_parse_table_t *table, const pb_parse_entry_t *start, uint32_t tag)
+{
+    const pb_parse_entry_t *end = table->entries + table->entry_count;
+    const pb_parse_entry_t *entry = start;
+    
+    do {
+        if (entry->field->tag == tag)
+            return entry;
+        
+        entry++;
+        if (entry == end)
+            entry = table->entries;
+    } while (entry != start);
+    
+    return NULL;
+}
+
+/* Decode a field that has a handler other than PB_PARSE_FALLBACK.
+ * The results are the same as from decode_static_field(). */
+static bool checkreturn decode_entry(pb_istream_t *stream, const pb_parse_entry_t *entry, void *dest_struct)
+{
+    void *pData = (char*)dest_struct + entry->data_offset;
+    uint64_t value;
+    
+    if (entry->size_offset != PB_PARSE_NO_SIZE)
+        *(bool*)((char*)dest_struct + entry->size_offset) = true;
+    
+    switch (entry->handler)
+    {
+        case PB_PARSE_VARINT32:
+            if (!pb_decode_varint(stream, &value))
+                return false;
+            *(int32_t*)pData = (int32_t)value;
+            return true;
+        
+        case PB_PARSE_VARINT64:
+            if (!pb_decode_varint(stream, &value))
+                return false;
+            *(int64_t*)pData = (int64_t)value;
+            return true;
+        
+        case PB_PARSE_UVARINT32:
+            if (!pb_decode_varint(stream, &value))
+                return false;
+            *(uint32_t*)pData = (uint32_t)value;
+            if ((uint32_t)value != value)
+                PB_RETURN_ERRCODE(stream, PB_ERR_INTEGER_RANGE, "integer too large");
+            return true;
+        
+        case PB_PARSE_UVARINT64:
+            return pb_decode_varint(stream, (uint64_t*)pData);
+        
+        case PB_PARSE_FIXED32:
+            return pb_decode_fixed32(stream, pData);
+        
+        case PB_PARSE_FIXED64:
+            return pb_decode_fixed64(stream, pData);
+        
+        default:
+            return PB_DECODERS[PB_LTYPE(entry->field->type)](stream, entry->field, pData);
+    }
+}
+
+bool checkreturn pb_decode_table_noinit(pb_istream_t *stream, const pb_parse_table_t *table, void *dest_struct)
+{
+    uint32_t fields_seen[(PB_MAX_REQUIRED_FIELDS + 31) / 32] = {0, 0};
+    const pb_parse_entry_t *next;
+    const pb_parse_entry_t *end;
+    pb_field_iter_t iter;
+    
+    if (table->entries == NULL || table->entry_count == 0)
+        return pb_decode_noinit(stream, table->fields, dest_struct);
+    
+#ifdef PB_ENCODE_CACHE
+    invalidate_encode_cache(table->fields, dest_struct);
+#endif
+
+    (void)pb_field_iter_begin(&iter, table->fields, dest_struct);
+    next = table->entries;
+    end = table->entries + table->entry_count;
+    
+    while (stream->bytes_left)
+    {
+        const pb_parse_entry_t *entry = next;
+        pb_wire_type_t wire_type;
+        uint32_t tag;
+        bool status;
+        
+        if (match_tag(stream, entry))
+        {
+            /* Fields usually come in the declared order, so the tag
+             * matched the predicted entry without decoding it. */
+            tag = entry->field->tag;
+            wire_type = (pb_wire_type_t)(entry->tag_bytes & 7);
+        }
+        else
+        {
+            bool eof;
+            if (!pb_decode_tag(stream, &wire_type, &tag, &eof))
+            {
+                if (eof)
+                    break;
+                else
+                    return false;
+            }
+            
+            entry = find_entry(table, next, tag);
+            if (entry == NULL)
+            {
+                /* Unknown field, skip data */
+                if (!pb_skip_field(stream, wire_type))
+                    return false;
+                continue;
+            }
+        }
+        
+        if (PB_HTYPE(entry->field->type) == PB_HTYPE_REQUIRED)
+        {
+            unsigned index = entry->required_index;
+            if (index < PB_MAX_REQUIRED_FIELDS)
+                fields_seen[index >> 5] |= ((uint32_t)1 << (index & 31));
+        }
+        
+        if (entry->handler != PB_PARSE_FALLBACK
+            && wire_type == PB_WIRE_TYPES[PB_LTYPE(entry->field->type)])
+        {
+            status = decode_entry(stream, entry, dest_struct);
+        }
+        else
+        {
+            /* Repeated, oneof, pointer and callback fields, and fields
+             * with unexpected wire type go through the normal path. */
+            if (!pb_field_iter_find(&iter, tag))
+                PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid parse table");
+            
+            status = decode_field(stream, wire_type, &iter);
+            if (!status)
+                errctx_wire_type(stream, wire_type, iter.pos);
+        }
+        
+        if (!status)
+        {
+            errctx_push_tag(stream, tag);
+            return false;
+        }
+        
+        /* Repeated fields are often followed by another element of the
+         * same field, other fields by the next field in the table. */
+        next = entry;
+        if (PB_HTYPE(entry->field->type) != PB_HTYPE_REPEATED)
+        {
+            next++;
+            if (next == end)
+                next = table->entries;
+        }
+    }
+    
+    return check_required_fields(stream, fields_seen, table->required_count);
+}
+
+bool checkreturn pb_decode_table(pb_istream_t *stream, const pb_parse_table_t *table, void *dest_struct)
+{
+    bool status;
+    pb_message_set_to_defaults(table->fields, dest_struct);
+    status = pb_decode_table_noinit(stream, table, dest_struct);
+    
+#ifdef PB_ENABLE_MALLOC
+    if (!status)
+        pb_release(table->fields, dest_struct);
+#endif
+    
+    return status;
+}
+#endif
+
 #ifdef PB_ENABLE_MALLOC
 /* Given an oneof field, if there has already been a field inside this oneof,
  * release it before overwriting with a different one. */
@@ -985,14 +1588,14 @@ static bool pb_release_union_field(pb_istream_t *stream, pb_field_iter_t *iter)
     /* Release old data. The find can fail if the message struct contains
      * invalid data. */
     if (!pb_field_iter_find(iter, old_tag))
-        PB_RETURN_ERROR(stream, "invalid union tag");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid union tag");
 
     pb_release_single_field(iter);
 
     /* Restore iterator to where it should be.
      * This shouldn't fail unless the pb_field_t structure is corrupted. */
     if (!pb_field_iter_find(iter, new_tag))
-        PB_RETURN_ERROR(stream, "iterator error");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "iterator error");
     
     return true;
 }
@@ -1038,6 +1641,12 @@ static void pb_release_single_field(const pb_field_iter_t *iter)
         {
             count = *(pb_size_t*)iter->pSize;
 
+            if (PB_ATYPE(type) == PB_ATYPE_HYBRID && count > iter->pos->array_size)
+            {
+                /* The entries have been moved to the spill allocation */
+                pItem = *(void**)((char*)iter->pData + pb_hybrid_spill_offset(iter->pos));
+            }
+
             if (PB_ATYPE(type) == PB_ATYPE_STATIC && count > iter->pos->array_size)
             {
                 /* Protect against corrupted _count fields */
@@ -1081,6 +1690,24 @@ static void pb_release_single_field(const pb_field_iter_t *iter)
         pb_free(*(void**)iter->pData);
         *(void**)iter->pData = NULL;
     }
+    else if (PB_ATYPE(type) == PB_ATYPE_HYBRID)
+    {
+        void **pSpill = (void**)((char*)iter->pData + pb_hybrid_spill_offset(iter->pos));
+        
+        /* If the value was in the spill allocation, it is lost. */
+        if (PB_HTYPE(type) == PB_HTYPE_REPEATED)
+        {
+            if (*(pb_size_t*)iter->pSize > iter->pos->array_size)
+                *(pb_size_t*)iter->pSize = 0;
+        }
+        else if (((pb_bytes_array_t*)iter->pData)->size > iter->pos->array_size)
+        {
+            ((pb_bytes_array_t*)iter->pData)->size = 0;
+        }
+        
+        pb_free(*pSpill);
+        *pSpill = NULL;
+    }
 }
 
 void pb_release(const pb_field_t fields[], void *dest_struct)
@@ -1178,10 +1805,10 @@ static bool checkreturn pb_dec_varint(pb_istream_t *stream, const pb_field_t *fi
     else if (field->data_size == sizeof(int_least8_t))
         clamped = *(int_least8_t*)dest = (int_least8_t)svalue;
     else
-        PB_RETURN_ERROR(stream, "invalid data_size");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid data_size");
 
     if (clamped != svalue)
-        PB_RETURN_ERROR(stream, "integer too large");
+        PB_RETURN_ERRCODE(stream, PB_ERR_INTEGER_RANGE, "integer too large");
     
     return true;
 }
@@ -1202,10 +1829,10 @@ static bool checkreturn pb_dec_uvarint(pb_istream_t *stream, const pb_field_t *f
     else if (field->data_size == sizeof(uint_least8_t))
         clamped = *(uint_least8_t*)dest = (uint_least8_t)value;
     else
-        PB_RETURN_ERROR(stream, "invalid data_size");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid data_size");
     
     if (clamped != value)
-        PB_RETURN_ERROR(stream, "integer too large");
+        PB_RETURN_ERRCODE(stream, PB_ERR_INTEGER_RANGE, "integer too large");
 
     return true;
 }
@@ -1226,10 +1853,10 @@ static bool checkreturn pb_dec_svarint(pb_istream_t *stream, const pb_field_t *f
     else if (field->data_size == sizeof(int_least8_t))
         clamped = *(int_least8_t*)dest = (int_least8_t)value;
     else
-        PB_RETURN_ERROR(stream, "invalid data_size");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid data_size");
 
     if (clamped != value)
-        PB_RETURN_ERROR(stream, "integer too large");
+        PB_RETURN_ERRCODE(stream, PB_ERR_INTEGER_RANGE, "integer too large");
     
     return true;
 }
@@ -1256,32 +1883,51 @@ static bool checkreturn pb_dec_bytes(pb_istream_t *stream, const pb_field_t *fie
         return false;
     
     if (size > PB_SIZE_MAX)
-        PB_RETURN_ERROR(stream, "bytes overflow");
+        PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "bytes overflow");
     
     alloc_size = PB_BYTES_ARRAY_T_ALLOCSIZE(size);
     if (size > alloc_size)
-        PB_RETURN_ERROR(stream, "size too large");
+        PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "size too large");
     
     if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
     {
 #ifndef PB_ENABLE_MALLOC
-        PB_RETURN_ERROR(stream, "no malloc support");
+        PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "no malloc support");
 #else
         if (!allocate_field(stream, dest, alloc_size, 1))
             return false;
         bdest = *(pb_bytes_array_t**)dest;
 #endif
     }
+    else if (PB_ATYPE(field->type) == PB_ATYPE_HYBRID &&
+             PB_HTYPE(field->type) != PB_HTYPE_REPEATED)
+    {
+        /* Hybrid bytes are stored inline if they fit, otherwise in the
+         * spill allocation. Entries of hybrid arrays are like static. */
+        bdest = (pb_bytes_array_t*)dest;
+        if (size > field->array_size)
+        {
+#ifndef PB_ENABLE_MALLOC
+            PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "bytes overflow");
+#else
+            void *pSpill = (char*)dest + pb_hybrid_spill_offset(field);
+            if (!allocate_field(stream, pSpill, size, 1))
+                return false;
+            bdest->size = (pb_size_t)size;
+            return pb_read(stream, *(pb_byte_t**)pSpill, size);
+#endif
+        }
+    }
     else
     {
         if (PB_LTYPE(field->type) == PB_LTYPE_FIXED_LENGTH_BYTES) {
             if (size != field->data_size)
-                PB_RETURN_ERROR(stream, "incorrect inline bytes size");
+                PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "incorrect inline bytes size");
             return pb_read(stream, (pb_byte_t*)dest, field->data_size);
         }
 
         if (alloc_size > field->data_size)
-            PB_RETURN_ERROR(stream, "bytes overflow");
+            PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "bytes overflow");
         bdest = (pb_bytes_array_t*)dest;
     }
 
@@ -1301,12 +1947,12 @@ static bool checkreturn pb_dec_string(pb_istream_t *stream, const pb_field_t *fi
     alloc_size = size + 1;
     
     if (alloc_size < size)
-        PB_RETURN_ERROR(stream, "size too large");
+        PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "size too large");
     
     if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
     {
 #ifndef PB_ENABLE_MALLOC
-        PB_RETURN_ERROR(stream, "no malloc support");
+        PB_RETURN_ERRCODE(stream, PB_ERR_ALLOC, "no malloc support");
 #else
         if (!allocate_field(stream, dest, alloc_size, 1))
             return false;
@@ -1316,7 +1962,7 @@ static bool checkreturn pb_dec_string(pb_istream_t *stream, const pb_field_t *fi
     else
     {
         if (alloc_size > field->data_size)
-            PB_RETURN_ERROR(stream, "string overflow");
+            PB_RETURN_ERRCODE(stream, PB_ERR_OVERFLOW, "string overflow");
     }
     
     status = pb_read(stream, (pb_byte_t*)dest, size);
@@ -1334,7 +1980,7 @@ static bool checkreturn pb_dec_submessage(pb_istream_t *stream, const pb_field_t
         return false;
     
     if (field->ptr == NULL)
-        PB_RETURN_ERROR(stream, "invalid field descriptor");
+        PB_RETURN_ERRCODE(stream, PB_ERR_DESCRIPTOR, "invalid field descriptor");
     
     /* New array entries need to be initialized, while required and optional
      * submessages have already been initialized in the top-level pb_decode. */
@@ -1344,5 +1990,9 @@ static bool checkreturn pb_dec_submessage(pb_istream_t *stream, const pb_field_t
         status = pb_decode_noinit(&substream, submsg_fields, dest);
     
     pb_close_string_substream(stream, &substream);
+    
+    if (!status)
+        errctx_unwind(stream);
+    
     return status;
 }
@@ -12,6 +12,56 @@
 extern "C" {
 #endif
 
+#ifdef PB_ERROR_CONTEXT
+/* Number of field tags stored in pb_errctx_t path. */
+#ifndef PB_ERRCTX_MAX_DEPTH
+#define PB_ERRCTX_MAX_DEPTH 8
+#endif
+
+/* Error codes stored in pb_errctx_t. These correspond to the error
+ * messages, but remain available with PB_NO_ERRMSG. */
+typedef enum {
+    PB_ERR_NONE = 0,
+    PB_ERR_EOF,               /* Stream ended in the middle of a field */
+    PB_ERR_IO,                /* Stream callback returned false */
+    PB_ERR_VARINT_OVERFLOW,   /* Varint longer than 10 bytes or too large */
+    PB_ERR_INVALID_WIRE_TYPE, /* Wire type is not one of pb_wire_type_t */
+    PB_ERR_WRONG_WIRE_TYPE,   /* Wire type does not match the field type */
+    PB_ERR_SUBSTREAM,         /* Length prefix exceeds the parent message */
+    PB_ERR_OVERFLOW,          /* Array, string or bytes field too large */
+    PB_ERR_INTEGER_RANGE,     /* Integer value does not fit in the field */
+    PB_ERR_MISSING_REQUIRED,  /* Required field was not present */
+    PB_ERR_CALLBACK,          /* Callback or extension decoder failed */
+    PB_ERR_ALLOC,             /* Memory allocation failed or unavailable */
+    PB_ERR_DESCRIPTOR         /* Invalid pb_field_t or message contents */
+} pb_errcode_t;
+
+/* Structured information about a decoding failure. Attach it to the
+ * top-level input stream using pb_istream_set_errctx(). The structure is
+ * only written to when decoding fails, so the success path is unaffected.
+ */
+typedef struct pb_errctx_s pb_errctx_t;
+struct pb_errctx_s {
+    pb_errcode_t code;        /* First error that occurred */
+    size_t offset;            /* Byte offset of the error in the top-level stream */
+    
+    /* Field tags leading to the error, innermost first. For example
+     * path = {2, 7, 3} and depth = 3 is field 3.7.2 in the message.
+     * Only the first PB_ERRCTX_MAX_DEPTH tags are stored, but depth
+     * tells the real nesting level. */
+    uint32_t path[PB_ERRCTX_MAX_DEPTH];
+    pb_size_t depth;
+    
+    /* Valid when code is PB_ERR_WRONG_WIRE_TYPE. */
+    pb_wire_type_t expected_wire_type;
+    pb_wire_type_t actual_wire_type;
+    
+    /* Internal state for computing offset. */
+    size_t stream_size;
+    size_t bytes_left;
+};
+#endif
+
 /* Structure for defining custom input streams. You will need to provide
  * a callback function to read the bytes from your storage, which can be
  * for example a file or a network socket.
@@ -43,6 +93,10 @@ struct pb_istream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ERROR_CONTEXT
+    pb_errctx_t *errctx; /* Optional error context, NULL if not used. */
+#endif
 };
 
 /***************************
@@ -85,6 +139,27 @@ bool pb_decode_noinit(pb_istream_t *stream, const pb_field_t fields[], void *des
  */
 bool pb_decode_delimited(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
 
+#ifdef PB_ENABLE_DELTA
+/* Apply a delta written by pb_encode_delta() on top of dest_struct, which
+ * must contain the previous version of the message. This is the same as
+ * merging with pb_decode_noinit().
+ */
+bool pb_decode_delta(pb_istream_t *stream, const pb_field_t fields[], void *dest_struct);
+#endif
+
+#ifdef PB_DECODE_TABLE
+/* Same as pb_decode, but uses the MyMessage_parse_table generated with the
+ * parse_table option. Each field is first compared against the next one
+ * in declaration order, and the common field types are decoded without
+ * going through the pb_field_t iterator.
+ */
+bool pb_decode_table(pb_istream_t *stream, const pb_parse_table_t *table, void *dest_struct);
+
+/* Same as pb_decode_table, except does not initialize the destination
+ * structure. See pb_decode_noinit. */
+bool pb_decode_table_noinit(pb_istream_t *stream, const pb_parse_table_t *table, void *dest_struct);
+#endif
+
 #ifdef PB_ENABLE_MALLOC
 /* Release any allocated pointer fields. If you use dynamic allocation, you should
  * call this for any successfully decoded message when you are done with it. If
@@ -105,6 +180,32 @@ void pb_release(const pb_field_t fields[], void *dest_struct);
  */
 pb_istream_t pb_istream_from_buffer(const pb_byte_t *buf, size_t bufsize);
 
+#ifdef PB_IOVEC_STREAM
+/* Position of a stream created by pb_istream_from_iovec(). */
+typedef struct pb_iovec_reader_s pb_iovec_reader_t;
+struct pb_iovec_reader_s
+{
+    const pb_iovec_t *iov;  /* Current segment */
+    size_t offset;          /* Position within the current segment */
+};
+
+/* Create an input stream for reading the data in count memory segments,
+ * for example a chain of receive buffers, or the two parts of a ring
+ * buffer that wraps around. The data is read directly from each segment
+ * without copying it into one buffer first. The reader stores the position
+ * and must stay valid while the stream is used.
+ */
+pb_istream_t pb_istream_from_iovec(pb_iovec_reader_t *reader, const pb_iovec_t *iov, size_t count);
+#endif
+
+#ifdef PB_ERROR_CONTEXT
+/* Attach an error context to the stream and clear it. This should be done
+ * on the top-level stream before decoding, as the offset is computed
+ * relative to the bytes_left value at this point.
+ */
+void pb_istream_set_errctx(pb_istream_t *stream, pb_errctx_t *errctx);
+#endif
+
 /* Function to read from a pb_istream_t. You can use this if you need to
  * read some custom header data, or to read data in field callbacks.
  */
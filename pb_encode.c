@@ -17,13 +17,39 @@
     #define checkreturn __attribute__((warn_unused_result))
 #endif
 
+/* Count of leading zero bits, used for computing varint lengths.
+ * Value must be nonzero. On other compilers a portable version is used.
+ */
+#if !defined(__GNUC__) || ( __GNUC__ < 3) || (__GNUC__ == 3 && __GNUC_MINOR__ < 4)
+    #define PB_CLZ64(x) pb_clz64(x)
+    #define PB_NEED_CLZ64
+#else
+    #define PB_CLZ64(x) ((size_t)__builtin_clzll(x))
+#endif
+
+/* Count of trailing zero bits, used for skipping over unset has bits.
+ * Value must be nonzero. */
+#ifdef PB_ENABLE_HAS_BITMAP
+#if !defined(__GNUC__) || ( __GNUC__ < 3) || (__GNUC__ == 3 && __GNUC_MINOR__ < 4)
+    #define PB_CTZ32(x) pb_ctz32(x)
+    #define PB_NEED_CTZ32
+#else
+    #define PB_CTZ32(x) ((unsigned)__builtin_ctzl(x))
+#endif
+#endif
+
 /**************************************
  * Declarations internal to this file *
  **************************************/
 typedef bool (*pb_encoder_t)(pb_ostream_t *stream, const pb_field_t *field, const void *src) checkreturn;
 
 static bool checkreturn buf_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count);
-static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, pb_encoder_t func);
+static pb_byte_t *buf_reserve(pb_ostream_t *stream, size_t count);
+static void buf_advance(pb_ostream_t *stream, size_t count);
+static bool checkreturn encode_tag(pb_ostream_t *stream, const pb_field_t *field, const pb_parse_entry_t *entry);
+static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, pb_encoder_t func, const pb_parse_entry_t *entry);
+static bool checkreturn encode_basic_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData, const pb_parse_entry_t *entry);
+static bool checkreturn encode_callback_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
 static bool checkreturn encode_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
 static bool checkreturn default_extension_encoder(pb_ostream_t *stream, const pb_extension_t *extension);
 static bool checkreturn encode_extension_field(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
@@ -33,8 +59,76 @@ static bool checkreturn pb_enc_svarint(pb_ostream_t *stream, const pb_field_t *f
 static bool checkreturn pb_enc_fixed32(pb_ostream_t *stream, const pb_field_t *field, const void *src);
 static bool checkreturn pb_enc_fixed64(pb_ostream_t *stream, const pb_field_t *field, const void *src);
 static bool checkreturn pb_enc_bytes(pb_ostream_t *stream, const pb_field_t *field, const void *src);
+static const void *hybrid_items(const pb_field_t *field, const void *pData, pb_size_t count);
+static const pb_byte_t *bytes_data(const pb_field_t *field, const pb_bytes_array_t *bytes);
 static bool checkreturn pb_enc_string(pb_ostream_t *stream, const pb_field_t *field, const void *src);
+static bool checkreturn encode_string_field(pb_ostream_t *stream, const pb_byte_t *buffer, size_t size);
 static bool checkreturn pb_enc_submessage(pb_ostream_t *stream, const pb_field_t *field, const void *src);
+#ifdef PB_NEED_CLZ64
+static size_t pb_clz64(uint64_t value);
+#endif
+#ifdef PB_NEED_CTZ32
+static unsigned pb_ctz32(uint32_t value);
+#endif
+#ifdef PB_ENABLE_HAS_BITMAP
+static bool skip_unset_fields(pb_field_iter_t *iter);
+#endif
+static void varint_store(pb_byte_t *dest, uint64_t value, size_t size);
+static uint64_t varint_element(const pb_field_t *field, const void *p);
+static bool checkreturn packed_varint_size(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, size_t *size);
+static bool checkreturn encode_message(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct);
+static bool checkreturn encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct);
+static bool checkreturn encode_submessage_inplace(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct);
+static bool checkreturn encode_submessage_sized(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct, size_t size);
+#ifdef PB_ENCODE_SIZE_CACHE
+static bool checkreturn encode_submessage_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+#endif
+static bool checkreturn encode_fields(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+#ifdef PB_ENCODE_CACHE
+static bool checkreturn encode_cached_message(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+#endif
+#ifdef PB_ENCODE_PARALLEL
+typedef struct pb_parallel_array_s pb_parallel_array_t;
+static void encode_chunk(void *arg, size_t index);
+static bool checkreturn encode_array_parallel(pb_ostream_t *stream, const pb_field_t *field, const void *pData, size_t count, const pb_parallel_t *parallel);
+#endif
+#ifdef PB_ENABLE_DELTA
+static bool field_present(const pb_field_iter_t *iter);
+static const void *field_data(const pb_field_iter_t *iter);
+static bool value_equal(const pb_field_t *field, const void *a, const void *b);
+static bool element_equal(const pb_field_t *field, const void *a, const void *b);
+static bool field_equal(const pb_field_iter_t *a, const pb_field_iter_t *b);
+static bool message_equal(const pb_field_t fields[], const void *a, const void *b);
+static bool checkreturn encode_delta_field(pb_ostream_t *stream, const pb_field_iter_t *prev, const pb_field_iter_t *curr);
+static bool checkreturn encode_delta_callback(pb_ostream_t *stream, const pb_field_t *field, const void *pData);
+static void iter_from_extension(pb_field_iter_t *iter, const pb_extension_t *extension);
+static const pb_extension_t *find_extension(const pb_extension_t *list, const pb_extension_type_t *type);
+static bool checkreturn encode_delta_extensions(pb_ostream_t *stream, const void *prev_data, const void *curr_data);
+#endif
+#ifdef PB_ENCODE_PUMP
+#ifdef PB_BUFFER_ONLY
+#error PB_ENCODE_PUMP requires custom stream callbacks, it cannot be used with PB_BUFFER_ONLY
+#endif
+#if PB_ENCODE_PUMP_PENDING < 16
+#error PB_ENCODE_PUMP_PENDING must hold the tag and length of a submessage
+#endif
+static bool checkreturn pump_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count);
+static bool checkreturn pump_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
+static bool pump_by_entry(const pb_field_t *field);
+static bool pump_once(const pb_field_t *field, const void *pData);
+static bool checkreturn pump_field(pb_ostream_t *stream, const pb_encoder_level_t *level);
+static bool pump_next(pb_encoder_level_t *level);
+static bool pump_enter(pb_encoder_ctx_t *ctx);
+#endif
+#ifdef PB_CHAIN_STREAM
+#ifdef PB_BUFFER_ONLY
+#error PB_CHAIN_STREAM requires custom stream callbacks, it cannot be used with PB_BUFFER_ONLY
+#endif
+static pb_chunk_t *chunk_alloc(pb_chunk_pool_t *pool);
+static pb_chunk_t *chain_append(pb_chain_t *chain);
+static bool checkreturn chain_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count);
+static bool checkreturn chain_write_ref(pb_ostream_t *stream, const pb_byte_t *buf, size_t count);
+#endif
 
 /* --- Function pointers to field encoders ---
  * Order in the array must match pb_action_t LTYPE numbering.
@@ -62,12 +156,39 @@ static bool checkreturn buf_write(pb_ostream_t *stream, const pb_byte_t *buf, si
     pb_byte_t *dest = (pb_byte_t*)stream->state;
     stream->state = dest + count;
     
-    while (count--)
-        *dest++ = *buf++;
+    if (count > 0)
+        memcpy(dest, buf, count);
     
     return true;
 }
 
+/* Streams created by pb_ostream_from_buffer() can be written directly. */
+#ifdef PB_BUFFER_ONLY
+#define IS_BUFFER_STREAM(stream) ((stream)->callback != NULL)
+#else
+#define IS_BUFFER_STREAM(stream) ((stream)->callback == &buf_write)
+#endif
+
+/* For memory buffer streams with room for at least count bytes, returns
+ * the pointer where the next bytes go. The caller writes the data directly
+ * and then calls buf_advance() with the number of bytes actually written.
+ * Returns NULL for other streams or if there is not enough room, in which
+ * case the caller should use pb_write() instead.
+ */
+static pb_byte_t *buf_reserve(pb_ostream_t *stream, size_t count)
+{
+    if (!IS_BUFFER_STREAM(stream) || stream->max_size - stream->bytes_written < count)
+        return NULL;
+    
+    return (pb_byte_t*)stream->state;
+}
+
+static void buf_advance(pb_ostream_t *stream, size_t count)
+{
+    stream->state = (pb_byte_t*)stream->state + count;
+    stream->bytes_written += count;
+}
+
 pb_ostream_t pb_ostream_from_buffer(pb_byte_t *buf, size_t bufsize)
 {
     pb_ostream_t stream;
@@ -81,6 +202,9 @@ pb_ostream_t pb_ostream_from_buffer(pb_byte_t *buf, size_t bufsize)
     stream.bytes_written = 0;
 #ifndef PB_NO_ERRMSG
     stream.errmsg = NULL;
+#endif
+#ifdef PB_ENCODE_SIZE_CACHE
+    stream.sizecache = NULL;
 #endif
     return stream;
 }
@@ -105,13 +229,257 @@ bool checkreturn pb_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t cou
     return true;
 }
 
+#ifdef PB_CHAIN_STREAM
+/* Take a chunk from the pool, or allocate a new one if possible. */
+static pb_chunk_t *chunk_alloc(pb_chunk_pool_t *pool)
+{
+    pb_chunk_t *chunk = pool->free;
+    
+    if (chunk != NULL)
+    {
+        pool->free = chunk->next;
+    }
+    else
+    {
+#ifdef PB_ENABLE_MALLOC
+        chunk = (pb_chunk_t*)pb_realloc(NULL, sizeof(pb_chunk_t));
+        if (chunk == NULL)
+            return NULL;
+        chunk->allocated = true;
+#else
+        return NULL;
+#endif
+    }
+    
+    chunk->next = NULL;
+    chunk->size = 0;
+    chunk->ref = NULL;
+    chunk->ref_size = 0;
+    return chunk;
+}
+
+/* Append a new chunk to the chain. */
+static pb_chunk_t *chain_append(pb_chain_t *chain)
+{
+    pb_chunk_t *chunk = chunk_alloc(chain->pool);
+    if (chunk == NULL)
+        return NULL;
+    
+    if (chain->tail == NULL)
+        chain->head = chunk;
+    else
+        chain->tail->next = chunk;
+    chain->tail = chunk;
+    return chunk;
+}
+
+static bool checkreturn chain_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    pb_chain_t *chain = (pb_chain_t*)stream->state;
+    
+    while (count > 0)
+    {
+        pb_chunk_t *tail = chain->tail;
+        size_t space;
+        
+        if (tail == NULL || tail->size == PB_CHUNK_SIZE || tail->ref != NULL)
+        {
+            tail = chain_append(chain);
+            if (tail == NULL)
+                PB_RETURN_ERROR(stream, "out of memory");
+        }
+        
+        space = PB_CHUNK_SIZE - tail->size;
+        if (space > count)
+            space = count;
+        
+        memcpy(tail->data + tail->size, buf, space);
+        tail->size += space;
+        chain->size += space;
+        buf += space;
+        count -= space;
+    }
+    
+    return true;
+}
+
+/* Store a reference to the data in the chain instead of copying it.
+ * Called by pb_encode_string() for long fields. */
+static bool checkreturn chain_write_ref(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    pb_chain_t *chain = (pb_chain_t*)stream->state;
+    pb_chunk_t *tail = chain->tail;
+    
+    if (stream->bytes_written + count > stream->max_size)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    if (tail == NULL || tail->ref != NULL)
+    {
+        tail = chain_append(chain);
+        if (tail == NULL)
+            PB_RETURN_ERROR(stream, "out of memory");
+    }
+    
+    tail->ref = buf;
+    tail->ref_size = count;
+    chain->size += count;
+    stream->bytes_written += count;
+    return true;
+}
+
+pb_ostream_t pb_ostream_from_chain(pb_chain_t *chain, pb_chunk_pool_t *pool)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(NULL, (size_t)-1);
+    
+    chain->pool = pool;
+    chain->head = NULL;
+    chain->tail = NULL;
+    chain->size = 0;
+    chain->zerocopy_min = 0;
+    
+    stream.callback = &chain_write;
+    stream.state = chain;
+    return stream;
+}
+
+size_t pb_chain_to_iovec(const pb_chain_t *chain, pb_iovec_t *iov, size_t max_count)
+{
+    const pb_chunk_t *chunk;
+    size_t count = 0;
+    
+    for (chunk = chain->head; chunk != NULL; chunk = chunk->next)
+    {
+        if (chunk->size > 0)
+        {
+            if (count < max_count)
+            {
+                iov[count].base = chunk->data;
+                iov[count].size = chunk->size;
+            }
+            count++;
+        }
+        
+        if (chunk->ref != NULL)
+        {
+            if (count < max_count)
+            {
+                iov[count].base = chunk->ref;
+                iov[count].size = chunk->ref_size;
+            }
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+bool pb_chain_flatten(const pb_chain_t *chain, pb_byte_t *buf, size_t bufsize)
+{
+    const pb_chunk_t *chunk;
+    
+    if (bufsize < chain->size)
+        return false;
+    
+    for (chunk = chain->head; chunk != NULL; chunk = chunk->next)
+    {
+        memcpy(buf, chunk->data, chunk->size);
+        buf += chunk->size;
+        
+        if (chunk->ref != NULL)
+        {
+            memcpy(buf, chunk->ref, chunk->ref_size);
+            buf += chunk->ref_size;
+        }
+    }
+    
+    return true;
+}
+
+void pb_chain_release(pb_chain_t *chain)
+{
+    if (chain->tail != NULL)
+    {
+        chain->tail->next = chain->pool->free;
+        chain->pool->free = chain->head;
+    }
+    
+    chain->head = NULL;
+    chain->tail = NULL;
+    chain->size = 0;
+}
+
+void pb_chunk_pool_add(pb_chunk_pool_t *pool, pb_chunk_t *chunk)
+{
+#ifdef PB_ENABLE_MALLOC
+    chunk->allocated = false;
+#endif
+    chunk->next = pool->free;
+    pool->free = chunk;
+}
+
+#ifdef PB_ENABLE_MALLOC
+void pb_chunk_pool_free(pb_chunk_pool_t *pool)
+{
+    pb_chunk_t **prev = &pool->free;
+    
+    while (*prev != NULL)
+    {
+        pb_chunk_t *chunk = *prev;
+        if (chunk->allocated)
+        {
+            *prev = chunk->next;
+            pb_free(chunk);
+        }
+        else
+        {
+            prev = &chunk->next;
+        }
+    }
+}
+#endif
+#endif
+
 /*************************
  * Encode a single field *
  *************************/
 
+/* Write the tag for the field. If the field has a parse table entry, the
+ * tag is copied from the pre-encoded bytes instead of being encoded. */
+static bool checkreturn encode_tag(pb_ostream_t *stream, const pb_field_t *field,
+                                   const pb_parse_entry_t *entry)
+{
+    if (entry != NULL && entry->tag_size != 0)
+    {
+        pb_byte_t bytes[4];
+        pb_byte_t *dest = buf_reserve(stream, entry->tag_size);
+        size_t i;
+        
+        if (dest == NULL)
+            dest = bytes;
+        
+        for (i = 0; i < entry->tag_size; i++)
+            dest[i] = (pb_byte_t)(entry->tag_bytes >> (8 * i));
+        
+        if (dest == bytes)
+            return pb_write(stream, bytes, entry->tag_size);
+        
+        buf_advance(stream, entry->tag_size);
+        return true;
+    }
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED &&
+        PB_LTYPE(field->type) <= PB_LTYPE_LAST_PACKABLE)
+    {
+        return pb_encode_tag(stream, PB_WT_STRING, field->tag);
+    }
+    
+    return pb_encode_tag_for_field(stream, field);
+}
+
 /* Encode a static array. Handles the size calculations and possible packing. */
 static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *field,
-                         const void *pData, size_t count, pb_encoder_t func)
+                         const void *pData, size_t count, pb_encoder_t func,
+                         const pb_parse_entry_t *entry)
 {
     size_t i;
     const void *p;
@@ -120,13 +488,13 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
     if (count == 0)
         return true;
 
-    if (PB_ATYPE(field->type) != PB_ATYPE_POINTER && count > field->array_size)
+    if (PB_ATYPE(field->type) == PB_ATYPE_STATIC && count > field->array_size)
         PB_RETURN_ERROR(stream, "array max size exceeded");
     
     /* We always pack arrays if the datatype allows it. */
     if (PB_LTYPE(field->type) <= PB_LTYPE_LAST_PACKABLE)
     {
-        if (!pb_encode_tag(stream, PB_WT_STRING, field->tag))
+        if (!encode_tag(stream, field, entry))
             return false;
         
         /* Determine the total size of packed array. */
@@ -139,16 +507,9 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
             size = 8 * count;
         }
         else
-        { 
-            pb_ostream_t sizestream = PB_OSTREAM_SIZING;
-            p = pData;
-            for (i = 0; i < count; i++)
-            {
-                if (!func(&sizestream, field, p))
-                    return false;
-                p = (const char*)p + field->data_size;
-            }
-            size = sizestream.bytes_written;
+        {
+            if (!packed_varint_size(stream, field, pData, count, &size))
+                return false;
         }
         
         if (!pb_encode_varint(stream, (uint64_t)size))
@@ -157,6 +518,26 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
         if (stream->callback == NULL)
             return pb_write(stream, NULL, size); /* Just sizing.. */
         
+        if (PB_LTYPE(field->type) < PB_LTYPE_FIXED32)
+        {
+            pb_byte_t *dest = buf_reserve(stream, size);
+            if (dest != NULL)
+            {
+                /* Whole array fits, write the varints without any checks. */
+                p = pData;
+                for (i = 0; i < count; i++)
+                {
+                    uint64_t value = varint_element(field, p);
+                    size_t len = pb_varint_size(value);
+                    varint_store(dest, value, len);
+                    dest += len;
+                    p = (const char*)p + field->data_size;
+                }
+                buf_advance(stream, size);
+                return true;
+            }
+        }
+        
         /* Write the data */
         p = pData;
         for (i = 0; i < count; i++)
@@ -171,7 +552,7 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
         p = pData;
         for (i = 0; i < count; i++)
         {
-            if (!pb_encode_tag_for_field(stream, field))
+            if (!encode_tag(stream, field, entry))
                 return false;
 
             /* Normally the data is stored directly in the array entries, but
@@ -198,9 +579,10 @@ static bool checkreturn encode_array(pb_ostream_t *stream, const pb_field_t *fie
 }
 
 /* Encode a field with static or pointer allocation, i.e. one whose data
- * is available to the encoder directly. */
+ * is available to the encoder directly. entry is the parse table entry
+ * of the field, or NULL. */
 static bool checkreturn encode_basic_field(pb_ostream_t *stream,
-    const pb_field_t *field, const void *pData)
+    const pb_field_t *field, const void *pData, const pb_parse_entry_t *entry)
 {
     pb_encoder_t func;
     const void *pSize;
@@ -233,6 +615,14 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
     else
         pSize = &implicit_has;
 
+#ifdef PB_ENABLE_HAS_BITMAP
+    if (PB_HAS_BITMAP(field))
+    {
+        implicit_has = PB_HAS_BIT((const uint32_t*)pSize, field->array_size - 1u) != 0;
+        pSize = &implicit_has;
+    }
+#endif
+
     if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
     {
         /* pData is a pointer to the field, which contains pointer to
@@ -243,13 +633,20 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
         pData = *(const void* const*)pData;
         implicit_has = (pData != NULL);
     }
+    else if (PB_ATYPE(field->type) == PB_ATYPE_HYBRID &&
+             PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        pData = hybrid_items(field, pData, *(const pb_size_t*)pSize);
+        if (pData == NULL)
+            PB_RETURN_ERROR(stream, "array max size exceeded");
+    }
 
     switch (PB_HTYPE(field->type))
     {
         case PB_HTYPE_REQUIRED:
             if (!pData)
                 PB_RETURN_ERROR(stream, "missing required field");
-            if (!pb_encode_tag_for_field(stream, field))
+            if (!encode_tag(stream, field, entry))
                 return false;
             if (!func(stream, field, pData))
                 return false;
@@ -258,7 +655,7 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
         case PB_HTYPE_OPTIONAL:
             if (*(const bool*)pSize)
             {
-                if (!pb_encode_tag_for_field(stream, field))
+                if (!encode_tag(stream, field, entry))
                     return false;
             
                 if (!func(stream, field, pData))
@@ -267,14 +664,14 @@ static bool checkreturn encode_basic_field(pb_ostream_t *stream,
             break;
         
         case PB_HTYPE_REPEATED:
-            if (!encode_array(stream, field, pData, *(const pb_size_t*)pSize, func))
+            if (!encode_array(stream, field, pData, *(const pb_size_t*)pSize, func, entry))
                 return false;
             break;
         
         case PB_HTYPE_ONEOF:
             if (*(const pb_size_t*)pSize == field->tag)
             {
-                if (!pb_encode_tag_for_field(stream, field))
+                if (!encode_tag(stream, field, entry))
                     return false;
 
                 if (!func(stream, field, pData))
@@ -318,7 +715,8 @@ static bool checkreturn encode_field(pb_ostream_t *stream,
     {
         case PB_ATYPE_STATIC:
         case PB_ATYPE_POINTER:
-            return encode_basic_field(stream, field, pData);
+        case PB_ATYPE_HYBRID:
+            return encode_basic_field(stream, field, pData, NULL);
         
         case PB_ATYPE_CALLBACK:
             return encode_callback_field(stream, field, pData);
@@ -389,13 +787,88 @@ static void *remove_const(const void *p)
     return t.p1;
 }
 
-bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+#ifdef PB_ENABLE_HAS_BITMAP
+/* Advance the iterator past a field whose has bit is not set, and past
+ * any following fields whose bits are also clear. The generator numbers
+ * the bits in field order, so if the next set bit is in the same word,
+ * its field is normally that many descriptors ahead and the iterator is
+ * moved there directly. Otherwise the run of unset fields is found by
+ * comparing the descriptors only. The data of fields in the run is found
+ * from their size_offset, which points to the has_bits array. Returns
+ * false at the end of the message. */
+static bool skip_unset_fields(pb_field_iter_t *iter)
+{
+    const uint32_t *bits = (const uint32_t*)iter->pSize;
+    const pb_field_t *field = iter->pos;
+    const pb_field_t *prev;
+    unsigned bit = (unsigned)field->array_size - 1u;
+    unsigned shift = (bit & 31u) + 1u;
+    uint32_t word = (shift == 32u) ? 0 : bits[bit >> 5] >> shift;
+    unsigned end;
+    
+    if (word == 0)
+        end = (bit | 31u) + 1u; /* Rest of the word is clear */
+    else
+        end = bit + 1u + PB_CTZ32(word);
+    
+    if (word != 0 && PB_HAS_BITMAP(field + (end - bit)) &&
+        (unsigned)field[end - bit].array_size - 1u == end)
+    {
+        /* Only fields of the run are in between */
+        field += end - bit;
+    }
+    else
+    {
+        do
+        {
+            field++;
+            bit++;
+        } while (bit < end && PB_HAS_BITMAP(field) &&
+                 (unsigned)field->array_size - 1u == bit);
+    }
+    
+    if (PB_HAS_BITMAP(field))
+    {
+        iter->pos = field;
+        iter->pData = (char*)remove_const(bits) - field->size_offset;
+        iter->pSize = remove_const(bits);
+        return true;
+    }
+    
+    if (field->tag == 0)
+    {
+        /* Wrapped back to beginning, reinitialize */
+        (void)pb_field_iter_begin(iter, iter->start, iter->dest_struct);
+        return false;
+    }
+    
+    /* The previous field is the last one of the run, and these are all
+     * static optional fields, so the required field index does not change. */
+    prev = field - 1;
+    iter->pos = field;
+    iter->pData = (char*)remove_const(bits) - prev->size_offset + prev->data_size + PB_DATA_DELTA(field);
+    iter->pSize = (char*)iter->pData + field->size_offset;
+    return true;
+}
+#endif
+
+/* Encode all the fields of the message. */
+static bool checkreturn encode_fields(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
     pb_field_iter_t iter;
     if (!pb_field_iter_begin(&iter, fields, remove_const(src_struct)))
         return true; /* Empty message type */
     
     do {
+#ifdef PB_ENABLE_HAS_BITMAP
+        while (PB_HAS_BITMAP(iter.pos) &&
+               !PB_HAS_BIT((const uint32_t*)iter.pSize, iter.pos->array_size - 1u))
+        {
+            if (!skip_unset_fields(&iter))
+                return true;
+        }
+#endif
+
         if (PB_LTYPE(iter.pos->type) == PB_LTYPE_EXTENSION)
         {
             /* Special case for the extension field placeholder */
@@ -413,6 +886,77 @@ bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], cons
     return true;
 }
 
+#ifdef PB_ENCODE_CACHE
+/* Write the message from the storage pointed to by its encode_cache member,
+ * encoding it into the cache first if it has been invalidated. The first
+ * entry of the field list gives the offset of the member. Without storage
+ * the message is encoded normally. */
+static bool checkreturn encode_cached_message(pb_ostream_t *stream, const pb_field_t fields[],
+                                              const void *src_struct)
+{
+    pb_encode_cache_t *cache = *(pb_encode_cache_t* const*)((const char*)src_struct + fields->data_offset);
+    
+    if (cache == NULL)
+        return encode_fields(stream, fields, src_struct);
+    
+    if (!cache->valid)
+    {
+        pb_ostream_t cachestream = pb_ostream_from_buffer(cache->bytes, cache->max_size);
+        
+        if (!encode_fields(&cachestream, fields, src_struct))
+        {
+#ifndef PB_NO_ERRMSG
+            stream->errmsg = cachestream.errmsg;
+#endif
+            return false;
+        }
+        
+        cache->size = cachestream.bytes_written;
+        cache->valid = true;
+    }
+    
+    return pb_write(stream, cache->bytes, cache->size);
+}
+#endif
+
+bool checkreturn pb_encode(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+#ifdef PB_ENCODE_CACHE
+    if (PB_IS_CACHED(fields))
+        return encode_cached_message(stream, fields, src_struct);
+#endif
+
+    return encode_fields(stream, fields, src_struct);
+}
+
+#ifdef PB_ENCODE_TABLE
+bool checkreturn pb_encode_table(pb_ostream_t *stream, const pb_parse_table_t *table, const void *src_struct)
+{
+    pb_field_iter_t iter;
+    const pb_parse_entry_t *entry = table->entries;
+    
+    if (entry == NULL || !pb_field_iter_begin(&iter, table->fields, remove_const(src_struct)))
+        return pb_encode(stream, table->fields, src_struct);
+    
+    /* The entries are in the same order as the pb_field_t array, and
+     * messages with extension fields do not have entries. */
+    do {
+        bool status;
+        if (PB_ATYPE(iter.pos->type) == PB_ATYPE_CALLBACK)
+            status = encode_callback_field(stream, iter.pos, iter.pData);
+        else
+            status = encode_basic_field(stream, iter.pos, iter.pData, entry);
+        
+        if (!status)
+            return false;
+        
+        entry++;
+    } while (pb_field_iter_next(&iter));
+    
+    return true;
+}
+#endif
+
 bool pb_encode_delimited(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
 {
     return pb_encode_submessage(stream, fields, src_struct);
@@ -429,34 +973,993 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
     return true;
 }
 
-/********************
- * Helper functions *
- ********************/
-bool checkreturn pb_encode_varint(pb_ostream_t *stream, uint64_t value)
+#ifdef PB_ENCODE_SIZE_CACHE
+struct pb_sizecache_s
 {
-    pb_byte_t buffer[10];
-    size_t i = 0;
+    size_t *sizes;     /* Caller-provided array of submessage sizes. */
+    size_t max_count;  /* Number of entries in sizes. */
+    size_t index;      /* Index of the next submessage to encode. */
+};
+
+bool pb_encode_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                      size_t *sizes, size_t max_count)
+{
+    pb_sizecache_t cache;
+    pb_ostream_t sizestream = PB_OSTREAM_SIZING;
+    bool status;
     
-    if (value <= 0x7F)
-    {
-        pb_byte_t v = (pb_byte_t)value;
-        return pb_write(stream, &v, 1);
-    }
+    cache.sizes = sizes;
+    cache.max_count = max_count;
+    cache.index = 0;
     
-    while (value)
+    /* First pass stores the size of each submessage in the cache. Sizing
+     * streams encode each submessage only once, and the size of a message
+     * is known only after all its submessages have been processed. */
+    sizestream.sizecache = &cache;
+    if (!pb_encode(&sizestream, fields, src_struct))
     {
-        buffer[i] = (pb_byte_t)((value & 0x7F) | 0x80);
-        value >>= 7;
-        i++;
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = sizestream.errmsg;
+#endif
+        return false;
     }
-    buffer[i-1] &= 0x7F; /* Unset top bit on last byte */
     
-    return pb_write(stream, buffer, i);
+    /* Second pass writes out the data, taking the sizes from the cache. */
+    cache.index = 0;
+    stream->sizecache = &cache;
+    status = pb_encode(stream, fields, src_struct);
+    stream->sizecache = NULL;
+    return status;
 }
+#endif
 
-bool checkreturn pb_encode_svarint(pb_ostream_t *stream, int64_t value)
-{
-    uint64_t zigzagged;
+#ifdef PB_ENCODE_PARALLEL
+/*********************
+ * Parallel encoding *
+ *********************/
+
+/* State shared by the workers encoding the chunks of one array. */
+struct pb_parallel_array_s
+{
+    const pb_field_t *field;
+    const char *data;       /* First array entry */
+    size_t count;           /* Number of entries in the array */
+    size_t chunks;          /* Number of chunks it is split into */
+    pb_byte_t *dest;        /* Output position, NULL when sizing */
+    size_t sizes[PB_PARALLEL_CHUNKS];
+    size_t offsets[PB_PARALLEL_CHUNKS];
+    bool status[PB_PARALLEL_CHUNKS];
+#ifndef PB_NO_ERRMSG
+    const char *errmsg[PB_PARALLEL_CHUNKS];
+#endif
+};
+
+/* Size or encode one chunk of the array. The chunks do not share any
+ * data, so this can be called from several threads at once. */
+static void encode_chunk(void *arg, size_t index)
+{
+    pb_parallel_array_t *state = (pb_parallel_array_t*)arg;
+    const pb_field_t *field = state->field;
+    size_t start = state->count * index / state->chunks;
+    size_t end = state->count * (index + 1) / state->chunks;
+    pb_ostream_t chunkstream = PB_OSTREAM_SIZING;
+    pb_ostream_t *stream = &chunkstream;
+    bool status = true;
+    size_t i;
+    
+    if (state->dest != NULL)
+        chunkstream = pb_ostream_from_buffer(state->dest + state->offsets[index], state->sizes[index]);
+    
+    for (i = start; i < end && status; i++)
+    {
+        status = pb_encode_tag_for_field(stream, field) &&
+                 pb_encode_submessage(stream, (const pb_field_t*)field->ptr,
+                                      state->data + i * field->data_size);
+    }
+    
+    if (status && state->dest != NULL && stream->bytes_written != state->sizes[index])
+    {
+        PB_SET_ERROR(stream, "submsg size changed");
+        status = false;
+    }
+    
+    state->sizes[index] = stream->bytes_written;
+    state->status[index] = status;
+#ifndef PB_NO_ERRMSG
+    state->errmsg[index] = stream->errmsg;
+#endif
+}
+
+/* Encode an array of submessages into a memory buffer stream in chunks.
+ * The first round calculates the size of each chunk, and the second
+ * writes each chunk to its position in the output. */
+static bool checkreturn encode_array_parallel(pb_ostream_t *stream, const pb_field_t *field,
+                                              const void *pData, size_t count,
+                                              const pb_parallel_t *parallel)
+{
+    pb_parallel_array_t state;
+    size_t total = 0;
+    size_t i;
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_STATIC && count > field->array_size)
+        PB_RETURN_ERROR(stream, "array max size exceeded");
+    
+    state.field = field;
+    state.data = (const char*)pData;
+    state.count = count;
+    state.chunks = (count < PB_PARALLEL_CHUNKS) ? count : PB_PARALLEL_CHUNKS;
+    state.dest = NULL;
+    
+    for (i = 0; i < 2; i++)
+    {
+        size_t c;
+        
+        parallel->run(parallel->context, &encode_chunk, &state, state.chunks);
+        
+        for (c = 0; c < state.chunks; c++)
+        {
+            if (!state.status[c])
+            {
+#ifndef PB_NO_ERRMSG
+                stream->errmsg = state.errmsg[c];
+#endif
+                return false;
+            }
+        }
+        
+        if (state.dest == NULL)
+        {
+            for (c = 0; c < state.chunks; c++)
+            {
+                state.offsets[c] = total;
+                total += state.sizes[c];
+            }
+            
+            state.dest = buf_reserve(stream, total);
+            if (state.dest == NULL)
+                PB_RETURN_ERROR(stream, "stream full");
+        }
+    }
+    
+    buf_advance(stream, total);
+    return true;
+}
+
+bool checkreturn pb_encode_parallel(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                                    const pb_parallel_t *parallel)
+{
+    pb_field_iter_t iter;
+    
+    if (!IS_BUFFER_STREAM(stream) || !pb_field_iter_begin(&iter, fields, remove_const(src_struct)))
+        return pb_encode(stream, fields, src_struct);
+    
+    do {
+        const pb_field_t *field = iter.pos;
+        bool status;
+        
+        if (PB_LTYPE(field->type) == PB_LTYPE_SUBMESSAGE &&
+            PB_HTYPE(field->type) == PB_HTYPE_REPEATED &&
+            PB_ATYPE(field->type) != PB_ATYPE_CALLBACK &&
+            *(const pb_size_t*)iter.pSize > 0 &&
+            *(const pb_size_t*)iter.pSize >= parallel->min_count)
+        {
+            const void *pData = iter.pData;
+            if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+                pData = *(const void* const*)pData;
+            else if (PB_ATYPE(field->type) == PB_ATYPE_HYBRID)
+                pData = hybrid_items(field, pData, *(const pb_size_t*)iter.pSize);
+            
+            status = encode_array_parallel(stream, field, pData, *(const pb_size_t*)iter.pSize, parallel);
+        }
+        else if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+        {
+            status = encode_extension_field(stream, field, iter.pData);
+        }
+        else
+        {
+            status = encode_field(stream, field, iter.pData);
+        }
+        
+        if (!status)
+            return false;
+    } while (pb_field_iter_next(&iter));
+    
+    return true;
+}
+#endif
+
+#ifdef PB_ENABLE_DELTA
+/******************
+ * Delta encoding *
+ ******************/
+
+/* Check whether a non-repeated field has a value. Proto3 fields without
+ * a has_ flag always count as present, their value is compared instead. */
+static bool field_present(const pb_field_iter_t *iter)
+{
+    const pb_field_t *field = iter->pos;
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+        return *(const void* const*)iter->pData != NULL;
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_ONEOF)
+        return *(const pb_size_t*)iter->pSize == field->tag;
+    
+    if (PB_HTYPE(field->type) != PB_HTYPE_OPTIONAL)
+        return true;
+
+#ifdef PB_ENABLE_HAS_BITMAP
+    if (PB_HAS_BITMAP(field))
+        return PB_HAS_BIT((const uint32_t*)iter->pSize, field->array_size - 1u) != 0;
+#endif
+    
+    if (iter->pSize != iter->pData)
+        return *(const bool*)iter->pSize;
+    
+    return true;
+}
+
+/* Pointer to the value of the field, or to the first array entry. */
+static const void *field_data(const pb_field_iter_t *iter)
+{
+    if (PB_ATYPE(iter->pos->type) == PB_ATYPE_POINTER)
+        return *(const void* const*)iter->pData;
+    
+    if (PB_ATYPE(iter->pos->type) == PB_ATYPE_HYBRID &&
+        PB_HTYPE(iter->pos->type) == PB_HTYPE_REPEATED)
+        return hybrid_items(iter->pos, iter->pData, *(const pb_size_t*)iter->pSize);
+    
+    return iter->pData;
+}
+
+/* Compare a single value of the field. */
+static bool value_equal(const pb_field_t *field, const void *a, const void *b)
+{
+    switch (PB_LTYPE(field->type))
+    {
+        case PB_LTYPE_BYTES:
+        {
+            const pb_bytes_array_t *ba = (const pb_bytes_array_t*)a;
+            const pb_bytes_array_t *bb = (const pb_bytes_array_t*)b;
+            return ba->size == bb->size &&
+                   memcmp(bytes_data(field, ba), bytes_data(field, bb), ba->size) == 0;
+        }
+        
+        case PB_LTYPE_STRING:
+            if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+                return strcmp((const char*)a, (const char*)b) == 0;
+            else
+                return strncmp((const char*)a, (const char*)b, field->data_size) == 0;
+        
+        case PB_LTYPE_SUBMESSAGE:
+            return message_equal((const pb_field_t*)field->ptr, a, b);
+        
+        default:
+            return memcmp(a, b, field->data_size) == 0;
+    }
+}
+
+/* Compare an array entry. Pointer-type string and bytes arrays store
+ * pointers to the data in the entries. */
+static bool element_equal(const pb_field_t *field, const void *a, const void *b)
+{
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER &&
+        (PB_LTYPE(field->type) == PB_LTYPE_STRING ||
+         PB_LTYPE(field->type) == PB_LTYPE_BYTES))
+    {
+        a = *(const void* const*)a;
+        b = *(const void* const*)b;
+        if (a == NULL || b == NULL)
+            return a == b;
+    }
+    
+    return value_equal(field, a, b);
+}
+
+/* Compare the same field in two structures. Callback and extension
+ * fields are not compared. */
+static bool field_equal(const pb_field_iter_t *a, const pb_field_iter_t *b)
+{
+    const pb_field_t *field = a->pos;
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_CALLBACK ||
+        PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+    {
+        return true;
+    }
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        pb_size_t count = *(const pb_size_t*)a->pSize;
+        pb_size_t i;
+        const char *pa = (const char*)field_data(a);
+        const char *pb = (const char*)field_data(b);
+        
+        if (count != *(const pb_size_t*)b->pSize)
+            return false;
+        
+        for (i = 0; i < count; i++)
+        {
+            if (!element_equal(field, pa + i * field->data_size, pb + i * field->data_size))
+                return false;
+        }
+        return true;
+    }
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_ONEOF &&
+        *(const pb_size_t*)a->pSize != *(const pb_size_t*)b->pSize)
+    {
+        return false;
+    }
+    
+    if (field_present(a) != field_present(b))
+        return false;
+    
+    if (!field_present(a))
+        return true;
+    
+    return value_equal(field, field_data(a), field_data(b));
+}
+
+static bool message_equal(const pb_field_t fields[], const void *a, const void *b)
+{
+    pb_field_iter_t iter_a, iter_b;
+    
+    if (!pb_field_iter_begin(&iter_a, fields, remove_const(a)) ||
+        !pb_field_iter_begin(&iter_b, fields, remove_const(b)))
+    {
+        return true; /* Empty message type */
+    }
+    
+    do {
+        if (!field_equal(&iter_a, &iter_b))
+            return false;
+    } while (pb_field_iter_next(&iter_a) && pb_field_iter_next(&iter_b));
+    
+    return true;
+}
+
+/* Encode the field if it differs from the previous version. Changes that
+ * merging cannot express, i.e. cleared fields, modified array entries and
+ * modified oneof or pointer submessages, are reported as errors. */
+static bool checkreturn encode_delta_field(pb_ostream_t *stream,
+    const pb_field_iter_t *prev, const pb_field_iter_t *curr)
+{
+    const pb_field_t *field = curr->pos;
+    pb_encoder_t func = PB_ENCODERS[PB_LTYPE(field->type)];
+    const void *pData = field_data(curr);
+    
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED)
+    {
+        pb_size_t count = *(const pb_size_t*)curr->pSize;
+        pb_size_t prev_count = *(const pb_size_t*)prev->pSize;
+        const char *pPrev = (const char*)field_data(prev);
+        pb_size_t i;
+        
+        if (count < prev_count)
+            PB_RETURN_ERROR(stream, "field cleared");
+        
+        /* Merging appends to arrays, so only new entries can be sent. */
+        for (i = 0; i < prev_count; i++)
+        {
+            if (!element_equal(field, pPrev + i * field->data_size,
+                               (const char*)pData + i * field->data_size))
+                PB_RETURN_ERROR(stream, "repeated field changed");
+        }
+        
+        if (count == prev_count)
+            return true;
+        
+        return encode_array(stream, field, (const char*)pData + prev_count * field->data_size,
+                            (size_t)(count - prev_count), func, NULL);
+    }
+    
+    if (!field_present(curr))
+    {
+        if (PB_HTYPE(field->type) == PB_HTYPE_REQUIRED)
+            PB_RETURN_ERROR(stream, "missing required field");
+        
+        if (PB_HTYPE(field->type) == PB_HTYPE_ONEOF)
+        {
+            /* Switching to another member is encoded by that member. */
+            if (*(const pb_size_t*)curr->pSize != 0 || !field_present(prev))
+                return true;
+        }
+        else if (!field_present(prev))
+        {
+            return true;
+        }
+        
+        PB_RETURN_ERROR(stream, "field cleared");
+    }
+    
+    /* Required fields are always included, so that the delta is a
+     * valid message by itself. */
+    if (PB_HTYPE(field->type) != PB_HTYPE_REQUIRED && field_present(prev) &&
+        value_equal(field, field_data(prev), pData))
+    {
+        return true;
+    }
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_SUBMESSAGE && field_present(prev))
+    {
+        /* Protobuf merges a submessage into the existing value, but nanopb
+         * reinitializes oneof and pointer submessages when decoding them.
+         * Neither a delta nor the whole value works for both, so these
+         * can only be sent when they were not present before. */
+        if (PB_ATYPE(field->type) != PB_ATYPE_STATIC ||
+            PB_HTYPE(field->type) == PB_HTYPE_ONEOF)
+        {
+            PB_RETURN_ERROR(stream, "submessage changed");
+        }
+        
+        if (!pb_encode_tag_for_field(stream, field))
+            return false;
+        
+        return encode_submessage(stream, (const pb_field_t*)field->ptr,
+                                 field_data(prev), pData);
+    }
+    
+    if (!pb_encode_tag_for_field(stream, field))
+        return false;
+    
+    return func(stream, field, pData);
+}
+
+/* Callback fields are encoded in full. Merging would append the entries
+ * of repeated callback fields after the previous ones. */
+static bool checkreturn encode_delta_callback(pb_ostream_t *stream,
+    const pb_field_t *field, const void *pData)
+{
+    if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED &&
+        ((const pb_callback_t*)pData)->funcs.encode != NULL)
+    {
+        PB_RETURN_ERROR(stream, "repeated callback field");
+    }
+    
+    return encode_callback_field(stream, field, pData);
+}
+
+/* Fake a field iterator for the extension field, like the decoder does.
+ * It is not safe to advance this iterator. */
+static void iter_from_extension(pb_field_iter_t *iter, const pb_extension_t *extension)
+{
+    const pb_field_t *field = (const pb_field_t*)extension->type->arg;
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+    {
+        /* For pointer extensions, the pointer is stored directly
+         * in the extension structure. */
+        (void)pb_field_iter_begin(iter, field, remove_const(&extension->dest));
+        iter->pData = remove_const(&extension->dest);
+    }
+    else
+    {
+        (void)pb_field_iter_begin(iter, field, extension->dest);
+        iter->pData = extension->dest;
+    }
+    
+    iter->pSize = (char*)iter->pData + field->size_offset;
+}
+
+static const pb_extension_t *find_extension(const pb_extension_t *list,
+    const pb_extension_type_t *type)
+{
+    while (list != NULL && list->type != type)
+        list = list->next;
+    return list;
+}
+
+/* Extensions are matched to the previous version by their type, and
+ * compared like normal fields. Custom extension encoders can write
+ * anything, so they cannot be compared. */
+static bool checkreturn encode_delta_extensions(pb_ostream_t *stream,
+    const void *prev_data, const void *curr_data)
+{
+    const pb_extension_t *prev_list = *(const pb_extension_t* const*)prev_data;
+    const pb_extension_t *extension = *(const pb_extension_t* const*)curr_data;
+    
+    for (; extension != NULL; extension = extension->next)
+    {
+        const pb_extension_t *prev = find_extension(prev_list, extension->type);
+        const pb_field_t *field = (const pb_field_t*)extension->type->arg;
+        pb_field_iter_t prev_iter, curr_iter;
+        bool status;
+        
+        if (extension->type->encode != NULL)
+            PB_RETURN_ERROR(stream, "custom extension encoder");
+        
+        if (PB_ATYPE(field->type) == PB_ATYPE_CALLBACK)
+            status = encode_delta_callback(stream, field, extension->dest);
+        else if (prev == NULL)
+            status = default_extension_encoder(stream, extension);
+        else
+        {
+            iter_from_extension(&prev_iter, prev);
+            iter_from_extension(&curr_iter, extension);
+            status = encode_delta_field(stream, &prev_iter, &curr_iter);
+        }
+        
+        if (!status)
+            return false;
+    }
+    
+    /* An extension that was removed from the list is not written at all. */
+    for (; prev_list != NULL; prev_list = prev_list->next)
+    {
+        const pb_field_t *field = (const pb_field_t*)prev_list->type->arg;
+        pb_field_iter_t prev_iter;
+        
+        if (prev_list->type->encode != NULL ||
+            PB_ATYPE(field->type) == PB_ATYPE_CALLBACK ||
+            find_extension(*(const pb_extension_t* const*)curr_data, prev_list->type) != NULL)
+        {
+            continue;
+        }
+        
+        iter_from_extension(&prev_iter, prev_list);
+        if (PB_HTYPE(field->type) == PB_HTYPE_REPEATED ?
+            *(const pb_size_t*)prev_iter.pSize != 0 : field_present(&prev_iter))
+        {
+            PB_RETURN_ERROR(stream, "field cleared");
+        }
+    }
+    
+    return true;
+}
+
+bool checkreturn pb_encode_delta(pb_ostream_t *stream, const pb_field_t fields[],
+                                 const void *prev_struct, const void *src_struct)
+{
+    pb_field_iter_t prev, curr;
+    
+    if (!pb_field_iter_begin(&prev, fields, remove_const(prev_struct)) ||
+        !pb_field_iter_begin(&curr, fields, remove_const(src_struct)))
+    {
+        return true; /* Empty message type */
+    }
+    
+    do {
+        bool status;
+        
+        if (PB_LTYPE(curr.pos->type) == PB_LTYPE_EXTENSION)
+            status = encode_delta_extensions(stream, prev.pData, curr.pData);
+        else if (PB_ATYPE(curr.pos->type) == PB_ATYPE_CALLBACK)
+            status = encode_delta_callback(stream, curr.pos, curr.pData);
+        else
+            status = encode_delta_field(stream, &prev, &curr);
+        
+        if (!status)
+            return false;
+    } while (pb_field_iter_next(&prev) && pb_field_iter_next(&curr));
+    
+    return true;
+}
+#endif
+
+#ifdef PB_ENCODE_PUMP
+/*******************
+ * Encoder pumping *
+ *******************/
+
+/* Stream callback that drops the bytes of the current field that were
+ * returned on earlier calls. Bytes that do not fit in the output buffer
+ * are kept in ctx->pending, and the encoding stops when that is full. */
+static bool checkreturn pump_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    pb_encoder_ctx_t *ctx = (pb_encoder_ctx_t*)stream->state;
+    size_t n;
+    
+    if (ctx->skip > 0)
+    {
+        n = (count < ctx->skip) ? count : ctx->skip;
+        ctx->skip -= n;
+        buf += n;
+        count -= n;
+    }
+    
+    n = ctx->out_len - ctx->out_pos;
+    if (n > count)
+        n = count;
+    if (n > 0)
+        memcpy(ctx->out + ctx->out_pos, buf, n);
+    ctx->out_pos += n;
+    ctx->field_done += n;
+    buf += n;
+    count -= n;
+    
+    n = sizeof(ctx->pending) - ctx->pending_len;
+    if (n > count)
+        n = count;
+    if (n > 0)
+        memcpy(ctx->pending + ctx->pending_len, buf, n);
+    ctx->pending_len += n;
+    ctx->field_done += n;
+    
+    if (count > n)
+    {
+        ctx->full = true;
+        return false;
+    }
+    
+    return true;
+}
+
+/* Called from pb_enc_submessage() when writing to the pump. The first
+ * submessage of a field or entry only gets its tag and length written,
+ * and pb_encoder_pump() continues with its fields on the next level. */
+static bool checkreturn pump_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+    pb_encoder_ctx_t *ctx = (pb_encoder_ctx_t*)stream->state;
+    pb_ostream_t substream = PB_OSTREAM_SIZING;
+    
+    if (!ctx->descend)
+        return pb_encode_submessage(stream, fields, src_struct);
+    
+    if (!pb_encode(&substream, fields, src_struct))
+    {
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = substream.errmsg;
+#endif
+        return false;
+    }
+    
+    ctx->descend = false;
+    ctx->sub_fields = fields;
+    ctx->sub_struct = src_struct;
+    ctx->sub_size = substream.bytes_written;
+    return pb_encode_varint(stream, (uint64_t)substream.bytes_written);
+}
+
+/* Arrays of strings, bytes and submessages are pumped one entry at a time. */
+static bool pump_by_entry(const pb_field_t *field)
+{
+    return PB_ATYPE(field->type) != PB_ATYPE_CALLBACK &&
+           PB_HTYPE(field->type) == PB_HTYPE_REPEATED &&
+           PB_LTYPE(field->type) > PB_LTYPE_LAST_PACKABLE &&
+           PB_LTYPE(field->type) != PB_LTYPE_EXTENSION;
+}
+
+/* Callback fields and extensions with a custom encoder are encoded only
+ * once, so the application code is not called again for every piece. */
+static bool pump_once(const pb_field_t *field, const void *pData)
+{
+    if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+    {
+        const pb_extension_t *extension = *(const pb_extension_t* const*)pData;
+        for (; extension != NULL; extension = extension->next)
+        {
+            if (extension->type->encode != NULL)
+                return true;
+        }
+        return false;
+    }
+    
+    return PB_ATYPE(field->type) == PB_ATYPE_CALLBACK;
+}
+
+/* Encode the current field, or the current entry of an array. */
+static bool checkreturn pump_field(pb_ostream_t *stream, const pb_encoder_level_t *level)
+{
+    const pb_field_t *field = level->iter.pos;
+    const void *pData = level->iter.pData;
+    pb_size_t count;
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_EXTENSION)
+        return encode_extension_field(stream, field, pData);
+    
+    if (!pump_by_entry(field))
+        return encode_field(stream, field, pData);
+    
+    count = *(const pb_size_t*)level->iter.pSize;
+    if (level->index >= count)
+        return true; /* Empty array */
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_STATIC && count > field->array_size)
+        PB_RETURN_ERROR(stream, "array max size exceeded");
+    
+    if (PB_ATYPE(field->type) == PB_ATYPE_POINTER)
+    {
+        pData = *(const void* const*)pData;
+    }
+    else if (PB_ATYPE(field->type) == PB_ATYPE_HYBRID)
+    {
+        pData = hybrid_items(field, pData, count);
+        if (pData == NULL)
+            PB_RETURN_ERROR(stream, "array max size exceeded");
+    }
+    
+    return encode_array(stream, field, (const char*)pData + level->index * field->data_size,
+                        1, PB_ENCODERS[PB_LTYPE(field->type)], NULL);
+}
+
+/* Move to the next array entry or field. Returns false at the end. */
+static bool pump_next(pb_encoder_level_t *level)
+{
+    if (pump_by_entry(level->iter.pos))
+    {
+        level->index++;
+        if (level->index < *(const pb_size_t*)level->iter.pSize)
+            return true;
+    }
+    
+    level->index = 0;
+    return pb_field_iter_next(&level->iter);
+}
+
+/* Start a new level for the submessage found by pump_submessage(). */
+static bool pump_enter(pb_encoder_ctx_t *ctx)
+{
+    pb_encoder_level_t *level = &ctx->levels[ctx->depth + 1];
+    
+    if (ctx->sub_fields == NULL)
+        return false;
+    
+    level->fields_left = pb_field_iter_begin(&level->iter, ctx->sub_fields, remove_const(ctx->sub_struct));
+    level->index = 0;
+    level->end = ctx->encoded + ctx->sub_size;
+    ctx->depth++;
+    return true;
+}
+
+bool checkreturn pb_encoder_init(pb_encoder_ctx_t *ctx, const pb_field_t fields[], const void *src_struct)
+{
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    bool status = pb_encode(&stream, fields, src_struct);
+    pb_encoder_level_t *level = &ctx->levels[0];
+    
+    ctx->fields = fields;
+    ctx->src_struct = src_struct;
+    ctx->total_size = stream.bytes_written;
+    ctx->position = 0;
+    level->fields_left = pb_field_iter_begin(&level->iter, fields, remove_const(src_struct));
+    level->index = 0;
+    level->end = stream.bytes_written;
+    ctx->depth = 0;
+    ctx->encoded = 0;
+    ctx->field_done = 0;
+    ctx->pending_len = 0;
+    ctx->pending_pos = 0;
+#ifndef PB_NO_ERRMSG
+    ctx->errmsg = stream.errmsg;
+#endif
+    
+    return status;
+}
+
+bool checkreturn pb_encoder_pump(pb_encoder_ctx_t *ctx, pb_byte_t *out_buf, size_t out_len, size_t *count)
+{
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    
+    ctx->out = out_buf;
+    ctx->out_len = out_len;
+    ctx->out_pos = 0;
+    
+    stream.callback = &pump_write;
+    stream.state = ctx;
+    stream.max_size = (size_t)-1;
+    
+    while (ctx->out_pos < out_len)
+    {
+        pb_encoder_level_t *level = &ctx->levels[ctx->depth];
+        
+        if (ctx->pending_pos < ctx->pending_len)
+        {
+            /* End of the previous field */
+            size_t n = ctx->pending_len - ctx->pending_pos;
+            if (n > out_len - ctx->out_pos)
+                n = out_len - ctx->out_pos;
+            memcpy(out_buf + ctx->out_pos, ctx->pending + ctx->pending_pos, n);
+            ctx->pending_pos += n;
+            ctx->out_pos += n;
+            continue;
+        }
+        
+        if (!level->fields_left)
+        {
+            if (ctx->depth == 0)
+                break;
+            
+            /* End of a submessage, continue in the parent message. */
+            if (ctx->encoded != level->end)
+            {
+                ctx->position += ctx->out_pos;
+                *count = ctx->out_pos;
+                PB_SET_ERROR(ctx, "message changed");
+                return false;
+            }
+            
+            ctx->depth--;
+            level = &ctx->levels[ctx->depth];
+            level->fields_left = pump_next(level);
+            continue;
+        }
+        
+        ctx->pending_len = 0;
+        ctx->pending_pos = 0;
+        ctx->skip = ctx->field_done;
+        ctx->full = false;
+        ctx->descend = (ctx->depth + 1 < PB_ENCODE_PUMP_MAX_DEPTH &&
+                        !pump_once(level->iter.pos, level->iter.pData));
+        ctx->sub_fields = NULL;
+        stream.bytes_written = 0;
+        
+        if (!pump_field(&stream, level))
+        {
+            if (!ctx->full || pump_once(level->iter.pos, level->iter.pData))
+            {
+#ifndef PB_NO_ERRMSG
+                ctx->errmsg = ctx->full ? "callback field too large" : stream.errmsg;
+#endif
+                *count = 0;
+                return false;
+            }
+            
+            /* The field is encoded again on the next call. */
+            break;
+        }
+        
+        ctx->field_done = 0;
+        ctx->encoded += stream.bytes_written;
+        
+        if (!pump_enter(ctx))
+            level->fields_left = pump_next(level);
+    }
+    
+    ctx->position += ctx->out_pos;
+    *count = ctx->out_pos;
+    
+    if (ctx->position > ctx->total_size ||
+        (ctx->depth == 0 && !ctx->levels[0].fields_left &&
+         ctx->pending_pos == ctx->pending_len && ctx->position != ctx->total_size))
+    {
+        PB_SET_ERROR(ctx, "message changed");
+        return false;
+    }
+    
+    return true;
+}
+#endif
+
+/********************
+ * Helper functions *
+ ********************/
+#ifdef PB_NEED_CLZ64
+static size_t pb_clz64(uint64_t value)
+{
+    size_t count = 0;
+    
+    if ((value >> 32) == 0) { count += 32; value <<= 32; }
+    if ((value >> 48) == 0) { count += 16; value <<= 16; }
+    if ((value >> 56) == 0) { count += 8; value <<= 8; }
+    if ((value >> 60) == 0) { count += 4; value <<= 4; }
+    if ((value >> 62) == 0) { count += 2; value <<= 2; }
+    if ((value >> 63) == 0) { count += 1; }
+    
+    return count;
+}
+#endif
+
+#ifdef PB_NEED_CTZ32
+static unsigned pb_ctz32(uint32_t value)
+{
+    unsigned count = 0;
+    
+    if ((value & 0xFFFF) == 0) { count += 16; value >>= 16; }
+    if ((value & 0xFF) == 0) { count += 8; value >>= 8; }
+    if ((value & 0xF) == 0) { count += 4; value >>= 4; }
+    if ((value & 0x3) == 0) { count += 2; value >>= 2; }
+    if ((value & 0x1) == 0) { count += 1; }
+    
+    return count;
+}
+#endif
+
+size_t pb_varint_size(uint64_t value)
+{
+    /* Each byte holds 7 bits of the value. For 1 to 64 significant bits,
+     * (bits * 9 + 64) / 64 equals ceil(bits / 7). */
+    size_t bits = 64 - PB_CLZ64(value | 1);
+    return (bits * 9 + 64) / 64;
+}
+
+/* Store value as a varint of the given length, as computed by pb_varint_size().
+ * Length is known, so only the last byte lacks the continuation bit. */
+static void varint_store(pb_byte_t *dest, uint64_t value, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size - 1; i++)
+    {
+        dest[i] = (pb_byte_t)(value | 0x80);
+        value >>= 7;
+    }
+    dest[i] = (pb_byte_t)value;
+}
+
+/* Get the value to encode for an element of a varint, uvarint or svarint
+ * array. The data_size must have been checked by packed_varint_size(). */
+static uint64_t varint_element(const pb_field_t *field, const void *p)
+{
+    int64_t value;
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_UVARINT)
+    {
+        if (field->data_size == sizeof(uint_least8_t))
+            return *(const uint_least8_t*)p;
+        else if (field->data_size == sizeof(uint_least16_t))
+            return *(const uint_least16_t*)p;
+        else if (field->data_size == sizeof(uint32_t))
+            return *(const uint32_t*)p;
+        else
+            return *(const uint64_t*)p;
+    }
+    
+    if (field->data_size == sizeof(int_least8_t))
+        value = *(const int_least8_t*)p;
+    else if (field->data_size == sizeof(int_least16_t))
+        value = *(const int_least16_t*)p;
+    else if (field->data_size == sizeof(int32_t))
+        value = *(const int32_t*)p;
+    else
+        value = *(const int64_t*)p;
+    
+    if (PB_LTYPE(field->type) == PB_LTYPE_SVARINT)
+    {
+        if (value < 0)
+            return ~((uint64_t)value << 1);
+        else
+            return (uint64_t)value << 1;
+    }
+    
+    return (uint64_t)value;
+}
+
+/* Calculate the total length of a packed varint array from the values,
+ * without running them through the field encoder. */
+static bool checkreturn packed_varint_size(pb_ostream_t *stream, const pb_field_t *field,
+                                           const void *pData, size_t count, size_t *size)
+{
+    size_t i;
+    size_t total = 0;
+    const char *p = (const char*)pData;
+    
+    if (field->data_size != 1 && field->data_size != 2 &&
+        field->data_size != 4 && field->data_size != 8)
+    {
+        PB_RETURN_ERROR(stream, "invalid data_size");
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        total += pb_varint_size(varint_element(field, p));
+        p += field->data_size;
+    }
+    
+    *size = total;
+    return true;
+}
+
+bool checkreturn pb_encode_varint(pb_ostream_t *stream, uint64_t value)
+{
+    pb_byte_t buffer[10];
+    size_t size = pb_varint_size(value);
+    pb_byte_t *bytes = buf_reserve(stream, size);
+    
+    if (bytes == NULL)
+        bytes = buffer;
+    
+    varint_store(bytes, value, size);
+    
+    if (bytes == buffer)
+        return pb_write(stream, bytes, size);
+    
+    buf_advance(stream, size);
+    return true;
+}
+
+bool checkreturn pb_encode_svarint(pb_ostream_t *stream, int64_t value)
+{
+    uint64_t zigzagged;
     if (value < 0)
         zigzagged = ~((uint64_t)value << 1);
     else
@@ -468,18 +1971,33 @@ bool checkreturn pb_encode_svarint(pb_ostream_t *stream, int64_t value)
 bool checkreturn pb_encode_fixed32(pb_ostream_t *stream, const void *value)
 {
     uint32_t val = *(const uint32_t*)value;
-    pb_byte_t bytes[4];
+    pb_byte_t buffer[4];
+    pb_byte_t *bytes = buf_reserve(stream, 4);
+    
+    if (bytes == NULL)
+        bytes = buffer;
+    
     bytes[0] = (pb_byte_t)(val & 0xFF);
     bytes[1] = (pb_byte_t)((val >> 8) & 0xFF);
     bytes[2] = (pb_byte_t)((val >> 16) & 0xFF);
     bytes[3] = (pb_byte_t)((val >> 24) & 0xFF);
-    return pb_write(stream, bytes, 4);
+    
+    if (bytes == buffer)
+        return pb_write(stream, bytes, 4);
+    
+    buf_advance(stream, 4);
+    return true;
 }
 
 bool checkreturn pb_encode_fixed64(pb_ostream_t *stream, const void *value)
 {
     uint64_t val = *(const uint64_t*)value;
-    pb_byte_t bytes[8];
+    pb_byte_t buffer[8];
+    pb_byte_t *bytes = buf_reserve(stream, 8);
+    
+    if (bytes == NULL)
+        bytes = buffer;
+    
     bytes[0] = (pb_byte_t)(val & 0xFF);
     bytes[1] = (pb_byte_t)((val >> 8) & 0xFF);
     bytes[2] = (pb_byte_t)((val >> 16) & 0xFF);
@@ -488,7 +2006,12 @@ bool checkreturn pb_encode_fixed64(pb_ostream_t *stream, const void *value)
     bytes[5] = (pb_byte_t)((val >> 40) & 0xFF);
     bytes[6] = (pb_byte_t)((val >> 48) & 0xFF);
     bytes[7] = (pb_byte_t)((val >> 56) & 0xFF);
-    return pb_write(stream, bytes, 8);
+    
+    if (bytes == buffer)
+        return pb_write(stream, bytes, 8);
+    
+    buf_advance(stream, 8);
+    return true;
 }
 
 bool checkreturn pb_encode_tag(pb_ostream_t *stream, pb_wire_type_t wiretype, uint32_t field_number)
@@ -538,14 +2061,34 @@ bool checkreturn pb_encode_string(pb_ostream_t *stream, const pb_byte_t *buffer,
     return pb_write(stream, buffer, size);
 }
 
-bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+/* Encode a submessage into a memory buffer in a single pass. One byte is
+ * reserved for the length prefix, which is enough for submessages shorter
+ * than 128 bytes. Longer submessages are moved forward afterwards to make
+ * room for the longer prefix. This avoids encoding nested submessages
+ * multiple times.
+ */
+static bool checkreturn encode_submessage_inplace(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct)
 {
-    /* First calculate the message size using a non-writing substream. */
-    pb_ostream_t substream = PB_OSTREAM_SIZING;
-    size_t size;
-    bool status;
+    pb_ostream_t substream;
+    pb_byte_t *dest = (pb_byte_t*)stream->state;
+    size_t avail = stream->max_size - stream->bytes_written;
+    size_t size, prefix;
     
-    if (!pb_encode(&substream, fields, src_struct))
+    if (avail < 1)
+        PB_RETURN_ERROR(stream, "stream full");
+    
+    substream.callback = stream->callback;
+    substream.state = dest + 1;
+    substream.max_size = avail - 1;
+    substream.bytes_written = 0;
+#ifndef PB_NO_ERRMSG
+    substream.errmsg = NULL;
+#endif
+#ifdef PB_ENCODE_SIZE_CACHE
+    substream.sizecache = NULL;
+#endif
+    
+    if (!encode_message(&substream, fields, prev_struct, src_struct))
     {
 #ifndef PB_NO_ERRMSG
         stream->errmsg = substream.errmsg;
@@ -554,6 +2097,120 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
     }
     
     size = substream.bytes_written;
+    prefix = pb_varint_size((uint64_t)size);
+    
+    if (prefix > 1)
+    {
+        /* The reserved byte was too short for the length prefix. */
+        if (prefix - 1 > avail - 1 - size)
+            PB_RETURN_ERROR(stream, "stream full");
+        
+        memmove(dest + prefix, dest + 1, size);
+    }
+    
+    if (!pb_encode_varint(stream, (uint64_t)size))
+        return false;
+    
+    stream->state = (pb_byte_t*)stream->state + size;
+    stream->bytes_written += size;
+    return true;
+}
+
+#ifdef PB_ENCODE_SIZE_CACHE
+/* Encode a submessage using the size stored by the first pass of
+ * pb_encode_cached(). During the first pass (sizing stream) the size is
+ * calculated and stored into the cache instead. Submessages that do not
+ * fit in the cache are sized separately.
+ */
+static bool checkreturn encode_submessage_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+    pb_sizecache_t *cache = stream->sizecache;
+    size_t index = cache->index++;
+    size_t size;
+    
+    if (stream->callback != NULL && index < cache->max_count)
+    {
+        size = cache->sizes[index];
+    }
+    else
+    {
+        pb_ostream_t substream = PB_OSTREAM_SIZING;
+        
+        /* When sizing, submessages further down store their sizes too. */
+        if (stream->callback == NULL)
+            substream.sizecache = cache;
+        
+        if (!pb_encode(&substream, fields, src_struct))
+        {
+#ifndef PB_NO_ERRMSG
+            stream->errmsg = substream.errmsg;
+#endif
+            return false;
+        }
+        
+        size = substream.bytes_written;
+        
+        if (stream->callback == NULL && index < cache->max_count)
+            cache->sizes[index] = size;
+    }
+    
+    return encode_submessage_sized(stream, fields, NULL, src_struct, size);
+}
+#endif
+
+/* Encode the whole message, or only its changes from prev_struct if that
+ * is not NULL. */
+static bool checkreturn encode_message(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct)
+{
+#ifdef PB_ENABLE_DELTA
+    if (prev_struct != NULL)
+        return pb_encode_delta(stream, fields, prev_struct, src_struct);
+#else
+    PB_UNUSED(prev_struct);
+#endif
+    
+    return pb_encode(stream, fields, src_struct);
+}
+
+/* Encode a submessage with its length prefix. Deltas of submessages use
+ * the same paths as whole submessages, so that each level is encoded once
+ * into memory buffers. */
+static bool checkreturn encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct)
+{
+    pb_ostream_t substream = PB_OSTREAM_SIZING;
+    
+#ifdef PB_ENCODE_SIZE_CACHE
+    if (stream->sizecache != NULL && prev_struct == NULL)
+        return encode_submessage_cached(stream, fields, src_struct);
+#endif
+    
+    /* Memory buffers can be patched afterwards, so encode in a single pass. */
+    if (IS_BUFFER_STREAM(stream))
+        return encode_submessage_inplace(stream, fields, prev_struct, src_struct);
+    
+    /* First calculate the message size using a non-writing substream. */
+    if (!encode_message(&substream, fields, prev_struct, src_struct))
+    {
+#ifndef PB_NO_ERRMSG
+        stream->errmsg = substream.errmsg;
+#endif
+        return false;
+    }
+    
+    return encode_submessage_sized(stream, fields, prev_struct, src_struct, substream.bytes_written);
+}
+
+bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct)
+{
+    return encode_submessage(stream, fields, NULL, src_struct);
+}
+
+/* Write the length prefix and the data of a submessage whose encoded size
+ * is already known. */
+static bool checkreturn encode_submessage_sized(pb_ostream_t *stream, const pb_field_t fields[], const void *prev_struct, const void *src_struct, size_t size)
+{
+    pb_ostream_t substream;
+    bool status;
     
     if (!pb_encode_varint(stream, (uint64_t)size))
         return false;
@@ -573,8 +2230,11 @@ bool checkreturn pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fie
 #ifndef PB_NO_ERRMSG
     substream.errmsg = NULL;
 #endif
+#ifdef PB_ENCODE_SIZE_CACHE
+    substream.sizecache = stream->sizecache;
+#endif
     
-    status = pb_encode(&substream, fields, src_struct);
+    status = encode_message(&substream, fields, prev_struct, src_struct);
     
     stream->bytes_written += substream.bytes_written;
     stream->state = substream.state;
@@ -656,28 +2316,77 @@ static bool checkreturn pb_enc_fixed32(pb_ostream_t *stream, const pb_field_t *f
     return pb_encode_fixed32(stream, src);
 }
 
+/* Encode the contents of a bytes or string field. Long fields written to
+ * a chain stream are stored as references to the message data. This is not
+ * done in pb_encode_string(), because callbacks may pass temporary buffers
+ * to it. */
+static bool checkreturn encode_string_field(pb_ostream_t *stream, const pb_byte_t *buffer, size_t size)
+{
+#ifdef PB_CHAIN_STREAM
+    if (stream->callback == &chain_write && size > 0)
+    {
+        size_t zerocopy_min = ((const pb_chain_t*)stream->state)->zerocopy_min;
+        if (zerocopy_min != 0 && size >= zerocopy_min)
+        {
+            return pb_encode_varint(stream, (uint64_t)size) &&
+                   chain_write_ref(stream, buffer, size);
+        }
+    }
+#endif
+    
+    return pb_encode_string(stream, buffer, size);
+}
+
+/* Entries of a hybrid array are in the spill allocation when there are
+ * more of them than fit in the inline storage. */
+static const void *hybrid_items(const pb_field_t *field, const void *pData, pb_size_t count)
+{
+    if (count > field->array_size)
+        return *(const void* const*)((const char*)pData + pb_hybrid_spill_offset(field));
+    
+    return pData;
+}
+
+/* Data of a bytes field. Hybrid bytes are in the spill allocation when
+ * they do not fit in the inline storage. */
+static const pb_byte_t *bytes_data(const pb_field_t *field, const pb_bytes_array_t *bytes)
+{
+    if (PB_ATYPE(field->type) == PB_ATYPE_HYBRID &&
+        PB_HTYPE(field->type) != PB_HTYPE_REPEATED &&
+        bytes->size > field->array_size)
+    {
+        return *(const pb_byte_t* const*)((const char*)bytes + pb_hybrid_spill_offset(field));
+    }
+    
+    return bytes->bytes;
+}
+
 static bool checkreturn pb_enc_bytes(pb_ostream_t *stream, const pb_field_t *field, const void *src)
 {
+    const pb_byte_t *data;
     const pb_bytes_array_t *bytes = NULL;
 
     if (PB_LTYPE(field->type) == PB_LTYPE_FIXED_LENGTH_BYTES)
-        return pb_encode_string(stream, (const pb_byte_t*)src, field->data_size);
+        return encode_string_field(stream, (const pb_byte_t*)src, field->data_size);
 
     bytes = (const pb_bytes_array_t*)src;
     
     if (src == NULL)
     {
         /* Treat null pointer as an empty bytes field */
-        return pb_encode_string(stream, NULL, 0);
+        return encode_string_field(stream, NULL, 0);
     }
     
-    if (PB_ATYPE(field->type) == PB_ATYPE_STATIC &&
-        PB_BYTES_ARRAY_T_ALLOCSIZE(bytes->size) > field->data_size)
+    data = bytes_data(field, bytes);
+    
+    if (data == NULL ||
+        (data == bytes->bytes && PB_ATYPE(field->type) != PB_ATYPE_POINTER &&
+         PB_BYTES_ARRAY_T_ALLOCSIZE(bytes->size) > field->data_size))
     {
         PB_RETURN_ERROR(stream, "bytes size exceeded");
     }
     
-    return pb_encode_string(stream, bytes->bytes, bytes->size);
+    return encode_string_field(stream, data, bytes->size);
 }
 
 static bool checkreturn pb_enc_string(pb_ostream_t *stream, const pb_field_t *field, const void *src)
@@ -703,7 +2412,7 @@ static bool checkreturn pb_enc_string(pb_ostream_t *stream, const pb_field_t *fi
         }
     }
 
-    return pb_encode_string(stream, (const pb_byte_t*)src, size);
+    return encode_string_field(stream, (const pb_byte_t*)src, size);
 }
 
 static bool checkreturn pb_enc_submessage(pb_ostream_t *stream, const pb_field_t *field, const void *src)
@@ -711,6 +2420,11 @@ static bool checkreturn pb_enc_submessage(pb_ostream_t *stream, const pb_field_t
     if (field->ptr == NULL)
         PB_RETURN_ERROR(stream, "invalid field descriptor");
     
+#ifdef PB_ENCODE_PUMP
+    if (stream->callback == &pump_write)
+        return pump_submessage(stream, (const pb_field_t*)field->ptr, src);
+#endif
+    
     return pb_encode_submessage(stream, (const pb_field_t*)field->ptr, src);
 }
 
@@ -8,10 +8,86 @@
 
 #include "pb.h"
 
+#ifdef PB_ENCODE_PUMP
+#include "pb_common.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifdef PB_ENCODE_SIZE_CACHE
+/* Internal state of pb_encode_cached(). */
+typedef struct pb_sizecache_s pb_sizecache_t;
+#endif
+
+#ifdef PB_ENCODE_PARALLEL
+/* Maximum number of chunks that an array is split into. */
+#ifndef PB_PARALLEL_CHUNKS
+#define PB_PARALLEL_CHUNKS 16
+#endif
+
+/* Function that calls func(arg, 0) ... func(arg, count - 1), possibly in
+ * parallel on several threads, and returns after all the calls have
+ * finished. Provided by the application for pb_encode_parallel(). */
+typedef void (*pb_parallel_run_t)(void *context, void (*func)(void *arg, size_t index),
+                                  void *arg, size_t count);
+
+typedef struct pb_parallel_s pb_parallel_t;
+struct pb_parallel_s
+{
+    pb_parallel_run_t run;
+    void *context;      /* Passed to run, e.g. a thread pool. */
+    size_t min_count;   /* Shorter arrays are encoded on the calling thread. */
+};
+#endif
+
+#ifdef PB_CHAIN_STREAM
+/* Number of data bytes in each chunk of a chained buffer. */
+#ifndef PB_CHUNK_SIZE
+#define PB_CHUNK_SIZE 256
+#endif
+
+/* Fixed-size piece of a chained output buffer. */
+typedef struct pb_chunk_s pb_chunk_t;
+struct pb_chunk_s
+{
+    pb_chunk_t *next;
+    size_t size;        /* Number of bytes used in data. */
+#ifdef PB_ENABLE_MALLOC
+    bool allocated;     /* Allocated by the pool, released in pb_chunk_pool_free(). */
+#endif
+    const pb_byte_t *ref; /* Data outside the chunk that follows data, or NULL. */
+    size_t ref_size;
+    pb_byte_t data[PB_CHUNK_SIZE];
+};
+
+/* List of free chunks. Chunks return here when the chain that used them
+ * is released, so that encoding does not allocate once the pool has
+ * enough chunks for the largest message. */
+typedef struct pb_chunk_pool_s pb_chunk_pool_t;
+struct pb_chunk_pool_s
+{
+    pb_chunk_t *free;
+};
+#define PB_CHUNK_POOL_INIT {NULL}
+
+/* Encoded data stored in a list of chunks. */
+typedef struct pb_chain_s pb_chain_t;
+struct pb_chain_s
+{
+    pb_chunk_pool_t *pool;
+    pb_chunk_t *head;
+    pb_chunk_t *tail;
+    size_t size;        /* Total number of bytes in the chain. */
+    
+    /* Bytes and string fields of at least this many bytes are stored as
+     * references to the source data instead of being copied. 0 disables.
+     * Can be set after pb_ostream_from_chain(). */
+    size_t zerocopy_min;
+};
+#endif
+
 /* Structure for defining custom output streams. You will need to provide
  * a callback function to write the bytes to your storage, which can be
  * for example a file or a network socket.
@@ -44,6 +120,10 @@ struct pb_ostream_s
 #ifndef PB_NO_ERRMSG
     const char *errmsg;
 #endif
+
+#ifdef PB_ENCODE_SIZE_CACHE
+    pb_sizecache_t *sizecache; /* Set by pb_encode_cached(), otherwise NULL. */
+#endif
 };
 
 /***************************
@@ -75,6 +155,139 @@ bool pb_encode_delimited(pb_ostream_t *stream, const pb_field_t fields[], const
  * the data. */
 bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *src_struct);
 
+#ifdef PB_ENCODE_TABLE
+/* Same as pb_encode, but uses the MyMessage_parse_table generated with the
+ * parse_table option. The field tags are copied from the pre-encoded bytes
+ * in the table instead of being encoded for each field.
+ */
+bool pb_encode_table(pb_ostream_t *stream, const pb_parse_table_t *table, const void *src_struct);
+#endif
+
+#ifdef PB_ENCODE_SIZE_CACHE
+/* Same as pb_encode, but first calculates the sizes of all submessages in
+ * one pass and stores them in the sizes array, in the order the submessages
+ * are written. The actual encoding then uses the stored sizes, so that each
+ * submessage is encoded only once even for callback streams.
+ *
+ * The array must have room for max_count entries. If the message contains
+ * more submessages than that, the rest are encoded the normal way.
+ */
+bool pb_encode_cached(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                      size_t *sizes, size_t max_count);
+#endif
+
+#ifdef PB_ENCODE_PARALLEL
+/* Same as pb_encode, but repeated submessage fields of the message that
+ * have at least parallel->min_count entries are encoded in parallel.
+ * The array is split into PB_PARALLEL_CHUNKS chunks, whose sizes are first
+ * calculated with parallel->run. The chunks are then encoded with another
+ * call, each directly to its final position in the output buffer.
+ *
+ * The output is identical to pb_encode. Only memory buffer streams are
+ * supported, others are encoded with pb_encode.
+ */
+bool pb_encode_parallel(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct,
+                        const pb_parallel_t *parallel);
+#endif
+
+#ifdef PB_ENABLE_DELTA
+/* Encode only the fields of src_struct that differ from prev_struct.
+ * Decoding the result with pb_decode_delta() on top of a copy of
+ * prev_struct gives src_struct, using the normal protobuf merge rules.
+ *
+ * Required fields, callback fields and extensions are always encoded.
+ * Static submessages are encoded as deltas of the previous value. Merging
+ * can only add entries to arrays and cannot clear fields, so if an array
+ * entry was changed or removed, or an optional field was cleared, the
+ * function returns false. It also fails if a oneof or pointer submessage
+ * that was already present is changed, or if a repeated callback field
+ * has an encode callback. Send the whole message with pb_encode() then.
+ */
+bool pb_encode_delta(pb_ostream_t *stream, const pb_field_t fields[],
+                     const void *prev_struct, const void *src_struct);
+#endif
+
+#ifdef PB_ENCODE_PUMP
+/* Number of bytes that pb_encoder_pump() keeps from a field that does not
+ * fit in the output buffer. Callback fields must fit in this and the
+ * output buffer, larger fields of other types are encoded again. */
+#ifndef PB_ENCODE_PUMP_PENDING
+#define PB_ENCODE_PUMP_PENDING 32
+#endif
+
+/* Number of message levels that pb_encoder_pump() keeps its position in.
+ * Submessages nested deeper are encoded as a single field. */
+#ifndef PB_ENCODE_PUMP_MAX_DEPTH
+#define PB_ENCODE_PUMP_MAX_DEPTH 4
+#endif
+
+/* Position of pb_encoder_pump() in one message level. */
+typedef struct pb_encoder_level_s pb_encoder_level_t;
+struct pb_encoder_level_s
+{
+    pb_field_iter_t iter;   /* Field being encoded */
+    bool fields_left;
+    pb_size_t index;        /* Entry being encoded, for arrays that are not packed */
+    size_t end;             /* Offset where the submessage ends */
+};
+
+/* State of a message being encoded with pb_encoder_pump(). */
+typedef struct pb_encoder_ctx_s pb_encoder_ctx_t;
+struct pb_encoder_ctx_s
+{
+    const pb_field_t *fields;
+    const void *src_struct;
+    size_t total_size;  /* Size of the whole encoded message. */
+    size_t position;    /* Number of bytes already produced. */
+    
+    /* Used internally during pb_encoder_pump() */
+    pb_encoder_level_t levels[PB_ENCODE_PUMP_MAX_DEPTH];
+    pb_size_t depth;        /* Index of the current level */
+    size_t encoded;         /* Bytes of the fields and entries finished so far */
+    size_t field_done;      /* Bytes of the field or entry already produced */
+    pb_byte_t pending[PB_ENCODE_PUMP_PENDING];
+    size_t pending_len;
+    size_t pending_pos;
+    pb_byte_t *out;
+    size_t out_len;
+    size_t out_pos;
+    size_t skip;
+    bool full;
+    bool descend;           /* Next submessage starts a new level */
+    const pb_field_t *sub_fields;
+    const void *sub_struct;
+    size_t sub_size;
+    
+#ifndef PB_NO_ERRMSG
+    const char *errmsg;
+#endif
+};
+
+/* Start encoding src_struct in pieces. Calculates the size of the message,
+ * which is available in ctx->total_size afterwards. Returns false if the
+ * message cannot be encoded. */
+bool pb_encoder_init(pb_encoder_ctx_t *ctx, const pb_field_t fields[], const void *src_struct);
+
+/* Write the next at most out_len bytes of the message to out_buf, and
+ * store the number of bytes written in *count. The position is kept in
+ * ctx, so when a non-blocking write accepts only part of the data, call
+ * this again for the rest once the output is ready.
+ *
+ * The fields are encoded one at a time, and arrays that are not packed
+ * one entry at a time. Submessages are entered, so that their fields are
+ * also encoded one at a time, up to PB_ENCODE_PUMP_MAX_DEPTH levels. The
+ * end of a field that does not fit in out_buf is kept in ctx, up to
+ * PB_ENCODE_PUMP_PENDING bytes. A longer field is encoded again on the
+ * next call, discarding the bytes already produced. Callback fields are
+ * encoded only once, and fail if they do not fit. The message must stay
+ * the same until pb_encoder_done() is true.
+ */
+bool pb_encoder_pump(pb_encoder_ctx_t *ctx, pb_byte_t *out_buf, size_t out_len, size_t *count);
+
+/* True when the whole message has been produced. */
+#define pb_encoder_done(ctx) ((ctx)->position >= (ctx)->total_size)
+#endif
+
 /**************************************
  * Functions for manipulating streams *
  **************************************/
@@ -88,6 +301,37 @@ bool pb_get_encoded_size(size_t *size, const pb_field_t fields[], const void *sr
  */
 pb_ostream_t pb_ostream_from_buffer(pb_byte_t *buf, size_t bufsize);
 
+#ifdef PB_CHAIN_STREAM
+/* Create an output stream that stores the data in chain, taking chunks
+ * from pool as needed. Earlier data is never moved. If the pool runs out
+ * of chunks, new ones are allocated when PB_ENABLE_MALLOC is defined,
+ * otherwise the write fails.
+ */
+pb_ostream_t pb_ostream_from_chain(pb_chain_t *chain, pb_chunk_pool_t *pool);
+
+/* Store the location of each segment of data in iov. Returns the number
+ * of segments in the chain, which may be more than max_count. The data
+ * stays valid until pb_chain_release(). With zerocopy_min, some segments
+ * point to the fields of the message, which must not change before the
+ * data has been sent. */
+size_t pb_chain_to_iovec(const pb_chain_t *chain, pb_iovec_t *iov, size_t max_count);
+
+/* Copy the data into one contiguous buffer. Returns false if bufsize is
+ * less than chain->size. */
+bool pb_chain_flatten(const pb_chain_t *chain, pb_byte_t *buf, size_t bufsize);
+
+/* Return the chunks of the chain to its pool and empty the chain. */
+void pb_chain_release(pb_chain_t *chain);
+
+/* Add a chunk, for example from a static array, to the pool. */
+void pb_chunk_pool_add(pb_chunk_pool_t *pool, pb_chunk_t *chunk);
+
+#ifdef PB_ENABLE_MALLOC
+/* Release the chunks in the pool that were allocated by it. */
+void pb_chunk_pool_free(pb_chunk_pool_t *pool);
+#endif
+#endif
+
 /* Pseudo-stream for measuring the size of a message without actually storing
  * the encoded data.
  * 
@@ -97,7 +341,9 @@ pb_ostream_t pb_ostream_from_buffer(pb_byte_t *buf, size_t bufsize);
  *    pb_encode(&stream, MyMessage_fields, &msg);
  *    printf("Message size is %d\n", stream.bytes_written);
  */
-#ifndef PB_NO_ERRMSG
+#if !defined(PB_NO_ERRMSG) && defined(PB_ENCODE_SIZE_CACHE)
+#define PB_OSTREAM_SIZING {0,0,0,0,0,0}
+#elif !defined(PB_NO_ERRMSG) || defined(PB_ENCODE_SIZE_CACHE)
 #define PB_OSTREAM_SIZING {0,0,0,0,0}
 #else
 #define PB_OSTREAM_SIZING {0,0,0,0}
@@ -125,6 +371,10 @@ bool pb_encode_tag(pb_ostream_t *stream, pb_wire_type_t wiretype, uint32_t field
  * This works for bool, enum, int32, int64, uint32 and uint64 field types. */
 bool pb_encode_varint(pb_ostream_t *stream, uint64_t value);
 
+/* Number of bytes that pb_encode_varint() would write for value.
+ * Useful for calculating message sizes without encoding. */
+size_t pb_varint_size(uint64_t value);
+
 /* Encode an integer in the zig-zagged svarint format.
  * This works for sint32 and sint64. */
 bool pb_encode_svarint(pb_ostream_t *stream, int64_t value);
@@ -142,8 +392,10 @@ bool pb_encode_fixed64(pb_ostream_t *stream, const void *value);
 
 /* Encode a submessage field.
  * You need to pass the pb_field_t array and pointer to struct, just like
- * with pb_encode(). This internally encodes the submessage twice, first to
- * calculate message size and then to actually write it out.
+ * with pb_encode(). For streams created with pb_ostream_from_buffer() the
+ * submessage is encoded once and the length prefix is patched afterwards.
+ * Other streams encode the submessage twice, first to calculate message
+ * size and then to actually write it out.
  */
 bool pb_encode_submessage(pb_ostream_t *stream, const pb_field_t fields[], const void *src_struct);
 
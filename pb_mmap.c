@@ -0,0 +1,209 @@
+/* pb_mmap.c -- read and write files through a memory mapping
+ *
+ * The file functions are declared by the POSIX headers only when a feature
+ * test macro is defined before including any header, also in strict ANSI C
+ * mode. mremap() is a Linux extension; without it the file is mapped again.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pb.h"
+#include "pb_mmap.h"
+
+/* Use the GCC warn_unused_result attribute to check that all return values
+ * are propagated correctly. On other compilers and gcc before 3.4.0 just
+ * ignore the annotation.
+ */
+#if !defined(__GNUC__) || ( __GNUC__ < 3) || (__GNUC__ == 3 && __GNUC_MINOR__ < 4)
+    #define checkreturn
+#else
+    #define checkreturn __attribute__((warn_unused_result))
+#endif
+
+#ifndef PB_BUFFER_ONLY
+static bool checkreturn mmap_grow(pb_mmap_file_t *file, size_t size);
+static bool checkreturn mmap_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count);
+#endif
+
+/*********
+ * Input *
+ *********/
+
+bool pb_istream_from_mmap(pb_istream_t *stream, pb_mmap_file_t *file, const char *path)
+{
+    struct stat st;
+
+    file->data = NULL;
+    file->size = 0;
+    file->capacity = 0;
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+        return false;
+
+    if (fstat(file->fd, &st) != 0 || (uint64_t)st.st_size > (size_t)-1)
+    {
+        pb_istream_close_mmap(file);
+        return false;
+    }
+
+    /* Empty files cannot be mapped, they decode as an empty message. */
+    if (st.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            pb_istream_close_mmap(file);
+            return false;
+        }
+
+        file->data = (pb_byte_t*)map;
+        file->size = file->capacity = (size_t)st.st_size;
+
+        /* The decoder reads the file from start to end. The hint is only
+         * for performance, so the result is ignored. */
+        (void)posix_madvise(map, file->capacity, POSIX_MADV_SEQUENTIAL);
+    }
+
+    *stream = pb_istream_from_buffer(file->data, file->size);
+    return true;
+}
+
+void pb_istream_close_mmap(pb_mmap_file_t *file)
+{
+    if (file->data != NULL)
+        munmap(file->data, file->capacity);
+
+    if (file->fd >= 0)
+        close(file->fd);
+
+    file->data = NULL;
+    file->size = 0;
+    file->capacity = 0;
+    file->fd = -1;
+}
+
+/**********
+ * Output *
+ **********/
+
+#ifndef PB_BUFFER_ONLY
+/* Grow the file and the mapping to at least size bytes. The capacity is
+ * doubled each time, so that writing a large file needs only a few remaps
+ * and the data is not copied. The disk space is allocated before it is
+ * mapped, so that a full disk is reported here instead of raising SIGBUS
+ * when the mapping is written to. */
+static bool checkreturn mmap_grow(pb_mmap_file_t *file, size_t size)
+{
+    size_t capacity = file->capacity;
+    void *map;
+
+    if (capacity == 0)
+        capacity = size;
+
+    while (capacity < size)
+    {
+        if (capacity > (size_t)-1 / 2)
+            capacity = size;
+        else
+            capacity *= 2;
+    }
+
+    if (posix_fallocate(file->fd, (off_t)file->capacity, (off_t)(capacity - file->capacity)) != 0)
+        return false;
+
+#ifdef MREMAP_MAYMOVE
+    if (file->data != NULL)
+    {
+        map = mremap(file->data, file->capacity, capacity, MREMAP_MAYMOVE);
+    }
+    else
+#endif
+    {
+        /* Without mremap(), map the file again. The data written so far is
+         * already in the file, so nothing is lost if mapping fails. */
+        if (file->data != NULL)
+        {
+            munmap(file->data, file->capacity);
+            file->data = NULL;
+            file->capacity = 0;
+        }
+
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    }
+
+    if (map == MAP_FAILED)
+        return false;
+
+    file->data = (pb_byte_t*)map;
+    file->capacity = capacity;
+    return true;
+}
+
+static bool checkreturn mmap_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    pb_mmap_file_t *file = (pb_mmap_file_t*)stream->state;
+
+    if (count > file->capacity - file->size)
+    {
+        if (count > (size_t)-1 - file->size || !mmap_grow(file, file->size + count))
+            PB_RETURN_ERROR(stream, "file grow failed");
+    }
+
+    memcpy(file->data + file->size, buf, count);
+    file->size += count;
+    return true;
+}
+
+bool pb_ostream_to_mmap(pb_ostream_t *stream, pb_mmap_file_t *file, const char *path, size_t initial_size)
+{
+    file->data = NULL;
+    file->size = 0;
+    file->capacity = 0;
+    file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (file->fd < 0)
+        return false;
+
+    if (initial_size > 0 && !mmap_grow(file, initial_size))
+    {
+        close(file->fd);
+        file->fd = -1;
+        return false;
+    }
+
+    *stream = pb_ostream_from_buffer(NULL, (size_t)-1);
+    stream->callback = &mmap_write;
+    stream->state = file;
+    return true;
+}
+
+bool pb_ostream_close_mmap(pb_mmap_file_t *file)
+{
+    bool status = true;
+
+    if (file->data != NULL && munmap(file->data, file->capacity) != 0)
+        status = false;
+
+    /* Cut off the unused space at the end of the last allocation. */
+    if (file->fd >= 0)
+    {
+        if (ftruncate(file->fd, (off_t)file->size) != 0)
+            status = false;
+        if (close(file->fd) != 0)
+            status = false;
+    }
+
+    file->data = NULL;
+    file->size = 0;
+    file->capacity = 0;
+    file->fd = -1;
+    return status;
+}
+#endif
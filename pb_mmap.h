@@ -0,0 +1,52 @@
+/* pb_mmap.h: Streams for reading and writing files through a memory mapping.
+ * These require the POSIX mmap() functions. Add pb_mmap.c to the list of
+ * files to compile to use them.
+ */
+
+#ifndef PB_MMAP_H_INCLUDED
+#define PB_MMAP_H_INCLUDED
+
+#include "pb.h"
+#include "pb_decode.h"
+#include "pb_encode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* File opened by pb_istream_from_mmap() or pb_ostream_to_mmap(). */
+typedef struct pb_mmap_file_s pb_mmap_file_t;
+struct pb_mmap_file_s {
+    pb_byte_t *data;    /* Start of the mapping, NULL if nothing is mapped. */
+    size_t size;        /* Number of bytes of data in the file. */
+    size_t capacity;    /* Size of the mapping. */
+    int fd;
+};
+
+/* Open the file at path and map it read-only, then create a buffer stream
+ * that reads the mapped data directly. Returns false if the file cannot be
+ * opened or mapped. The file must stay open while the stream is used.
+ */
+bool pb_istream_from_mmap(pb_istream_t *stream, pb_mmap_file_t *file, const char *path);
+
+/* Unmap and close a file opened by pb_istream_from_mmap(). */
+void pb_istream_close_mmap(pb_mmap_file_t *file);
+
+#ifndef PB_BUFFER_ONLY
+/* Create or truncate the file at path, and create an output stream that
+ * writes into a shared memory mapping of it. Disk space for initial_size
+ * bytes is allocated first, and the file grows as needed by doubling its
+ * size. Returns false if the file cannot be created or mapped.
+ */
+bool pb_ostream_to_mmap(pb_ostream_t *stream, pb_mmap_file_t *file, const char *path, size_t initial_size);
+
+/* Unmap and close a file opened by pb_ostream_to_mmap(), after truncating
+ * it to the number of bytes written. Returns false if an error occurs. */
+bool pb_ostream_close_mmap(pb_mmap_file_t *file);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+/* Checks that a message written into a chained buffer is the same as the
+ * output of pb_encode() into a flat buffer, and that the chunks are reused
+ * from the pool. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "chain_stream.pb.h"
+#include "unittests.h"
+
+#define POOL_CHUNKS 8
+
+static pb_chunk_t g_chunks[POOL_CHUNKS];
+
+static bool write_payload(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    const size_t *size = (const size_t*)*arg;
+    pb_byte_t data[100];
+    size_t i;
+
+    for (i = 0; i < *size; i++)
+        data[i] = (pb_byte_t)i;
+
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, data, *size);
+}
+
+static size_t pool_count(const pb_chunk_pool_t *pool)
+{
+    const pb_chunk_t *chunk;
+    size_t count = 0;
+    for (chunk = pool->free; chunk != NULL; chunk = chunk->next)
+        count++;
+    return count;
+}
+
+/* Encode into the chain and compare with pb_encode(). */
+static bool same_encoding(const Log *msg, pb_chain_t *chain, pb_chunk_pool_t *pool)
+{
+    pb_byte_t expected[256], flat[256];
+    pb_iovec_t iov[16];
+    pb_ostream_t stream1 = pb_ostream_from_buffer(expected, sizeof(expected));
+    pb_ostream_t stream2 = pb_ostream_from_chain(chain, pool);
+    size_t count, i, pos;
+
+    if (!pb_encode(&stream1, Log_fields, msg) ||
+        !pb_encode(&stream2, Log_fields, msg))
+        return false;
+
+    if (chain->size != stream1.bytes_written || stream2.bytes_written != chain->size)
+        return false;
+
+    if (!pb_chain_flatten(chain, flat, sizeof(flat)) ||
+        memcmp(flat, expected, chain->size) != 0)
+        return false;
+
+    count = pb_chain_to_iovec(chain, iov, 16);
+    if (count != (chain->size + PB_CHUNK_SIZE - 1) / PB_CHUNK_SIZE)
+        return false;
+
+    pos = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (memcmp(iov[i].base, expected + pos, iov[i].size) != 0)
+            return false;
+        pos += iov[i].size;
+    }
+
+    return pos == chain->size;
+}
+
+int main()
+{
+    int status = 0;
+    pb_chunk_pool_t pool = PB_CHUNK_POOL_INIT;
+    pb_chain_t chain;
+    Log msg = Log_init_zero;
+    size_t payload_size = 40;
+    size_t i;
+
+    for (i = 0; i < POOL_CHUNKS; i++)
+        pb_chunk_pool_add(&pool, &g_chunks[i]);
+
+    msg.records_count = 3;
+    for (i = 0; i < 3; i++)
+    {
+        msg.records[i].id = (uint32_t)(i * 1000);
+        msg.records[i].has_name = true;
+        strcpy(msg.records[i].name, "a record name");
+    }
+    msg.payload.funcs.encode = &write_payload;
+    msg.payload.arg = &payload_size;
+
+    COMMENT("Test encoding into a chain")
+    TEST(same_encoding(&msg, &chain, &pool))
+    TEST(chain.size > 4 * PB_CHUNK_SIZE)
+    TEST(pool_count(&pool) == POOL_CHUNKS - (chain.size + PB_CHUNK_SIZE - 1) / PB_CHUNK_SIZE)
+
+    COMMENT("Test reusing the chunks")
+    pb_chain_release(&chain);
+    TEST(pool_count(&pool) == POOL_CHUNKS)
+    TEST(chain.size == 0 && chain.head == NULL)
+    TEST(same_encoding(&msg, &chain, &pool))
+    pb_chain_release(&chain);
+    TEST(pool_count(&pool) == POOL_CHUNKS)
+
+    {
+        pb_byte_t small[8];
+        pb_iovec_t iov[2];
+
+        COMMENT("Test small output buffers")
+        TEST(same_encoding(&msg, &chain, &pool))
+        TEST(!pb_chain_flatten(&chain, small, sizeof(small)))
+        TEST(pb_chain_to_iovec(&chain, iov, 2) > 2)
+        TEST(iov[1].base == chain.head->next->data)
+        pb_chain_release(&chain);
+    }
+
+    {
+        pb_ostream_t stream;
+
+        msg.records_count = 6;
+        for (i = 3; i < 6; i++)
+            msg.records[i] = msg.records[0];
+        payload_size = 100;
+
+#ifdef PB_ENABLE_MALLOC
+        COMMENT("Test allocating more chunks")
+        TEST(same_encoding(&msg, &chain, &pool))
+        TEST(chain.size > POOL_CHUNKS * PB_CHUNK_SIZE)
+        pb_chain_release(&chain);
+        TEST(pool_count(&pool) > POOL_CHUNKS)
+        pb_chunk_pool_free(&pool);
+        TEST(pool_count(&pool) == POOL_CHUNKS)
+#else
+        COMMENT("Test running out of chunks")
+        stream = pb_ostream_from_chain(&chain, &pool);
+        TEST(!pb_encode(&stream, Log_fields, &msg))
+        TEST(strcmp(PB_GET_ERROR(&stream), "out of memory") == 0)
+        pb_chain_release(&chain);
+        TEST(pool_count(&pool) == POOL_CHUNKS)
+#endif
+        (void)stream;
+    }
+
+    {
+        Media media = Media_init_zero;
+        pb_byte_t expected[256], flat[256];
+        pb_iovec_t iov[16];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(expected, sizeof(expected));
+        pb_ostream_t stream2 = pb_ostream_from_chain(&chain, &pool);
+
+        media.id = 5;
+        media.has_blob = true;
+        media.blob.size = 50;
+        for (i = 0; i < 50; i++)
+            media.blob.bytes[i] = (pb_byte_t)(i * 3);
+        media.has_text = true;
+        strcpy(media.text, "short");
+        media.has_record = true;
+        media.record.has_name = true;
+        strcpy(media.record.name, "a name longer than 16");
+
+        COMMENT("Test zero-copy bytes fields")
+        chain.zerocopy_min = 20;
+        TEST(pb_encode(&stream1, Media_fields, &media))
+        TEST(pb_encode(&stream2, Media_fields, &media))
+        TEST(stream2.bytes_written == stream1.bytes_written)
+        TEST(chain.size == stream1.bytes_written)
+        TEST(pb_chain_flatten(&chain, flat, sizeof(flat)))
+        TEST(memcmp(flat, expected, chain.size) == 0)
+
+        /* Header, blob, text and record header, record name */
+        TEST(pb_chain_to_iovec(&chain, iov, 16) == 4)
+        TEST(iov[0].size == 4)
+        TEST(iov[1].base == media.blob.bytes && iov[1].size == 50)
+        TEST(iov[2].size == 13)
+        TEST(iov[3].base == (const pb_byte_t*)media.record.name && iov[3].size == 21)
+        pb_chain_release(&chain);
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
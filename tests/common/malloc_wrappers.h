@@ -1,7 +1,15 @@
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void* malloc_with_check(size_t size);
 void free_with_check(void *mem);
 void* counting_realloc(void *ptr, size_t size);
 void counting_free(void *ptr);
 size_t get_alloc_count();
+
+#ifdef __cplusplus
+}
+#endif
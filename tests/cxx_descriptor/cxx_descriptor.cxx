@@ -0,0 +1,268 @@
+/* Checks that nanopb::encode() and nanopb::decode() from pb.hpp produce
+ * the same results as pb_encode() and pb_decode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb.hpp>
+#include "cxx_descriptor.pb.h"
+#include "unittests.h"
+
+/* Custom stream that writes to a memory buffer through a callback. */
+static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t *dest = (uint8_t*)stream->state;
+    memcpy(dest, buf, count);
+    stream->state = dest + count;
+    return true;
+}
+
+static void fill_composite(Composite *msg)
+{
+    Composite init = Composite_init_default;
+    *msg = init;
+    
+    msg->scalars.req_int32 = -1234;
+    msg->scalars.has_opt_int64 = true;
+    msg->scalars.opt_int64 = -9876543210LL;
+    msg->scalars.has_opt_uint32 = true;
+    msg->scalars.opt_uint32 = 4000000000u;
+    msg->scalars.has_opt_uint64 = true;
+    msg->scalars.opt_uint64 = 18000000000000000000ULL;
+    msg->scalars.has_opt_sint32 = true;
+    msg->scalars.opt_sint32 = -77;
+    msg->scalars.has_opt_sint64 = true;
+    msg->scalars.opt_sint64 = -123456789012LL;
+    msg->scalars.has_opt_bool = true;
+    msg->scalars.opt_bool = true;
+    msg->scalars.has_opt_fixed32 = true;
+    msg->scalars.opt_fixed32 = 0xDEADBEEF;
+    msg->scalars.has_opt_sfixed32 = true;
+    msg->scalars.opt_sfixed32 = -5;
+    msg->scalars.has_opt_float = true;
+    msg->scalars.opt_float = 1.5f;
+    msg->scalars.has_opt_fixed64 = true;
+    msg->scalars.opt_fixed64 = 0x0123456789ABCDEFULL;
+    msg->scalars.has_opt_sfixed64 = true;
+    msg->scalars.opt_sfixed64 = -6;
+    msg->scalars.has_opt_double = true;
+    msg->scalars.opt_double = -2.25;
+    msg->scalars.has_opt_color = true;
+    msg->scalars.opt_color = Color_GREEN;
+    msg->scalars.has_opt_sign = true;
+    msg->scalars.opt_sign = Sign_NEGATIVE;
+    msg->scalars.has_small = true;
+    msg->scalars.small = -100;
+    msg->scalars.has_usmall = true;
+    msg->scalars.usmall = 60000;
+    
+    msg->has_arrays = true;
+    msg->arrays.rep_int32_count = 3;
+    msg->arrays.rep_int32[0] = 1;
+    msg->arrays.rep_int32[1] = -1;
+    msg->arrays.rep_int32[2] = 300;
+    msg->arrays.rep_sint64_count = 2;
+    msg->arrays.rep_sint64[0] = -1;
+    msg->arrays.rep_sint64[1] = 1000000;
+    msg->arrays.rep_uint32_count = 1;
+    msg->arrays.rep_uint32[0] = 0xFFFFFFFF;
+    msg->arrays.rep_fixed32_count = 2;
+    msg->arrays.rep_fixed32[0] = 1;
+    msg->arrays.rep_fixed32[1] = 2;
+    msg->arrays.rep_double_count = 1;
+    msg->arrays.rep_double[0] = 3.0;
+    msg->arrays.rep_bool_count = 2;
+    msg->arrays.rep_bool[0] = true;
+    msg->arrays.rep_bool[1] = false;
+    msg->arrays.rep_sign_count = 2;
+    msg->arrays.rep_sign[0] = Sign_NEGATIVE;
+    msg->arrays.rep_sign[1] = Sign_ZERO;
+    msg->arrays.rep_string_count = 2;
+    strcpy(msg->arrays.rep_string[0], "abc");
+    strcpy(msg->arrays.rep_string[1], "");
+    msg->arrays.rep_bytes_count = 1;
+    msg->arrays.rep_bytes[0].size = 3;
+    memcpy(msg->arrays.rep_bytes[0].bytes, "\x00\x01\x02", 3);
+    msg->arrays.rep_leaf_count = 2;
+    msg->arrays.rep_leaf[0].a = 5;
+    msg->arrays.rep_leaf[1].a = 6;
+    msg->arrays.rep_leaf[1].has_s = true;
+    strcpy(msg->arrays.rep_leaf[1].s, "leaf");
+    
+    strcpy(msg->name, "composite");
+    msg->has_data = true;
+    msg->data.size = 4;
+    memcpy(msg->data.bytes, "data", 4);
+    msg->has_fixed = true;
+    memcpy(msg->fixed, "\x01\x02\x03\x04", 4);
+    msg->has_leaf = true;
+    msg->leaf.a = 42;
+    msg->has_plain = true;
+    msg->plain.has_z = true;
+    msg->plain.z = -3;
+    msg->plains_count = 2;
+    msg->plains[1].has_z = true;
+    msg->plains[1].z = 4;
+    msg->p3_int = 7;
+    strcpy(msg->p3_str, "p3");
+    msg->p3_bytes.size = 1;
+    msg->p3_bytes.bytes[0] = 0xFF;
+    msg->p3_float = -0.5f;
+    msg->last = 99;
+}
+
+int main()
+{
+    int status = 0;
+    Composite msg;
+    uint8_t expected[512];
+    size_t expected_size;
+    
+    fill_composite(&msg);
+    
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Composite_fields, &msg))
+        expected_size = stream.bytes_written;
+    }
+    
+    {
+        uint8_t buffer[512];
+        size_t size = 0;
+        pb_ostream_t stream;
+        
+        COMMENT("Test nanopb::encode into a buffer")
+        TEST(nanopb::encode(buffer, sizeof(buffer), msg, size))
+        TEST(size == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        
+        COMMENT("Test nanopb::encode into a callback stream")
+        stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        stream.callback = &write_callback;
+        TEST(nanopb::encode(stream, msg))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        
+        COMMENT("Test nanopb::get_encoded_size")
+        TEST(nanopb::get_encoded_size(size, msg) && size == expected_size)
+        
+        COMMENT("Test nanopb::encode into a too small buffer")
+        TEST(!nanopb::encode(buffer, expected_size - 1, msg, size))
+    }
+    
+    {
+        Composite decoded;
+        uint8_t buffer[512];
+        std::string_view data((const char*)expected, expected_size);
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        
+        COMMENT("Test nanopb::decode from a string_view")
+        TEST(nanopb::decode(data, decoded))
+        TEST(decoded.scalars.opt_sint64 == -123456789012LL)
+        TEST(decoded.scalars.small == -100 && decoded.scalars.usmall == 60000)
+        TEST(decoded.arrays.rep_int32_count == 3 && decoded.arrays.rep_int32[1] == -1)
+        TEST(decoded.arrays.rep_sign_count == 2 && decoded.arrays.rep_sign[0] == Sign_NEGATIVE)
+        TEST(nanopb::to_string_view(decoded.arrays.rep_leaf[1].s) == "leaf")
+        TEST(nanopb::to_string_view(decoded.data) == "data")
+        TEST(decoded.plains_count == 2 && decoded.plains[1].z == 4)
+        TEST(decoded.p3_float == -0.5f)
+        TEST(decoded.last == 99)
+        
+        /* Re-encode with the descriptor based encoder */
+        TEST(pb_encode(&ostream, Composite_fields, &decoded))
+        TEST(ostream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+    }
+    
+    {
+        Composite empty = Composite_init_default;
+        uint8_t buffer1[64], buffer2[64];
+        size_t size;
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        
+        COMMENT("Test encoding a message with default values")
+        TEST(pb_encode(&stream1, Composite_fields, &empty))
+        TEST(nanopb::encode(buffer2, sizeof(buffer2), empty, size))
+        TEST(stream1.bytes_written == size)
+        TEST(memcmp(buffer1, buffer2, size) == 0)
+    }
+    
+    {
+        /* rep_int32 = 1, 2 unpacked, then 3 packed */
+        const uint8_t buf[] = {0x08, 0x01, 0x08, 0x02, 0x0A, 0x01, 0x03};
+        Arrays arrays;
+        
+        COMMENT("Test decoding unpacked and packed arrays")
+        TEST(nanopb::decode(buf, sizeof(buf), arrays))
+        TEST(arrays.rep_int32_count == 3)
+        TEST(arrays.rep_int32[0] == 1 && arrays.rep_int32[1] == 2 && arrays.rep_int32[2] == 3)
+    }
+    
+    {
+        const uint8_t buf[] = {0x0A, 0x06, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
+        Arrays arrays;
+        pb_istream_t stream = pb_istream_from_buffer(buf, sizeof(buf));
+        
+        COMMENT("Test array overflow")
+        TEST(!nanopb::decode(stream, arrays))
+        TEST(strcmp(PB_GET_ERROR(&stream), "array overflow") == 0)
+    }
+    
+    {
+        const uint8_t string_overflow[] = {0x08, 0x01, 0x12, 0x08, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h'};
+        const uint8_t wrong_wire_type[] = {0x0D, 0x01, 0x00, 0x00, 0x00};
+        const uint8_t missing_required[] = {0x12, 0x01, 'a'};
+        Leaf leaf;
+        pb_istream_t stream;
+        
+        COMMENT("Test decoding errors")
+        stream = pb_istream_from_buffer(string_overflow, sizeof(string_overflow));
+        TEST(!nanopb::decode(stream, leaf))
+        TEST(strcmp(PB_GET_ERROR(&stream), "string overflow") == 0)
+        
+        stream = pb_istream_from_buffer(wrong_wire_type, sizeof(wrong_wire_type));
+        TEST(!nanopb::decode(stream, leaf))
+        TEST(strcmp(PB_GET_ERROR(&stream), "wrong wire type") == 0)
+        
+        stream = pb_istream_from_buffer(missing_required, sizeof(missing_required));
+        TEST(!nanopb::decode(stream, leaf))
+        TEST(strcmp(PB_GET_ERROR(&stream), "missing required field") == 0)
+    }
+    
+    {
+        /* req_int32 = 1, small = 300 */
+        const uint8_t buf[] = {0x08, 0x01, 0x80, 0x01, 0xAC, 0x02};
+        Scalars scalars;
+        pb_istream_t stream = pb_istream_from_buffer(buf, sizeof(buf));
+        
+        COMMENT("Test integer range check")
+        TEST(!nanopb::decode(stream, scalars))
+        TEST(strcmp(PB_GET_ERROR(&stream), "integer too large") == 0)
+    }
+    
+    {
+        WithCallback cbmsg = WithCallback_init_zero;
+        uint8_t buffer1[32], buffer2[32];
+        size_t size;
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        
+        COMMENT("Test message with fields that need the descriptors")
+        TEST(!nanopb::MessageDescriptor<WithCallback>::inline_codec)
+        cbmsg.has_x = true;
+        cbmsg.x = 5;
+        cbmsg.has_leaf = true;
+        cbmsg.leaf.a = 1;
+        TEST(pb_encode(&stream1, WithCallback_fields, &cbmsg))
+        TEST(nanopb::encode(buffer2, sizeof(buffer2), cbmsg, size))
+        TEST(stream1.bytes_written == size)
+        TEST(memcmp(buffer1, buffer2, size) == 0)
+        
+        memset(&cbmsg, 0, sizeof(cbmsg));
+        TEST(nanopb::decode(buffer1, stream1.bytes_written, cbmsg))
+        TEST(cbmsg.x == 5 && cbmsg.leaf.a == 1)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
@@ -0,0 +1,131 @@
+/* Checks that nanopb::Message releases the pointer fields and that moving
+ * it does not allocate or copy the data. */
+
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include <pb.hpp>
+#include <malloc_wrappers.h>
+#include "cxx_message_wrapper.pb.h"
+#include "unittests.h"
+
+/* Encode a Batch with static data to use as the decoder input. */
+static size_t encode_batch(uint8_t *buffer, size_t size)
+{
+    char label[] = "batch";
+    char name0[] = "zero";
+    Item items[2] = {Item_init_zero, Item_init_zero};
+    Batch batch = Batch_init_zero;
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    
+    items[0].id = 10;
+    items[0].name = name0;
+    items[1].id = 11;
+    batch.label = label;
+    batch.items_count = 2;
+    batch.items = items;
+    batch.first = &items[0];
+    
+    if (!pb_encode(&stream, Batch_fields, &batch))
+        return 0;
+    
+    return stream.bytes_written;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[128];
+    size_t size = encode_batch(buffer, sizeof(buffer));
+    std::string_view data((const char*)buffer, size);
+    
+    TEST(size > 0)
+    
+    {
+        nanopb::Message<Batch> batch;
+        
+        COMMENT("Test default construction")
+        TEST(batch->label == NULL && batch->items == NULL)
+        TEST(batch->sequence == 7)
+        
+        COMMENT("Test decoding into the wrapper")
+        TEST(batch.decode(data))
+        TEST(get_alloc_count() > 0)
+        TEST(strcmp(batch->label, "batch") == 0)
+        TEST(batch->items_count == 2 && batch->items[1].id == 11)
+        TEST(strcmp(batch->items[0].name, "zero") == 0)
+        TEST(batch->first != NULL && batch->first->id == 10)
+        
+        COMMENT("Test decoding again releases the old contents")
+        {
+            size_t count = get_alloc_count();
+            TEST(batch.decode(data))
+            TEST(get_alloc_count() == count)
+        }
+    }
+    
+    COMMENT("Test destructor releases everything")
+    TEST(get_alloc_count() == 0)
+    
+    {
+        std::vector<nanopb::Message<Batch> > queue;
+        nanopb::Message<Batch> batch;
+        const char *label;
+        size_t count;
+        
+        TEST(batch.decode(data))
+        label = batch->label;
+        count = get_alloc_count();
+        
+        COMMENT("Test moving transfers the pointers")
+        queue.reserve(2);
+        queue.push_back(std::move(batch));
+        TEST(get_alloc_count() == count)
+        TEST(batch->label == NULL && batch->items_count == 0)
+        TEST(queue[0]->label == label)
+        
+        COMMENT("Test move assignment releases the old contents")
+        {
+            nanopb::Message<Batch> other;
+            TEST(other.decode(data))
+            TEST(get_alloc_count() == 2 * count)
+            other = std::move(queue[0]);
+            TEST(get_alloc_count() == count)
+            TEST(other->label == label)
+            queue[0] = std::move(other);
+        }
+        TEST(get_alloc_count() == count)
+        
+        COMMENT("Test explicit copy")
+        {
+            nanopb::Message<Batch> copy;
+            uint8_t buffer2[128];
+            pb_ostream_t stream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+            
+            TEST(queue[0].copy_to(copy))
+            TEST(get_alloc_count() == 2 * count)
+            TEST(copy->label != label && strcmp(copy->label, "batch") == 0)
+            TEST(copy.encode(stream))
+            TEST(stream.bytes_written == size && memcmp(buffer, buffer2, size) == 0)
+        }
+        TEST(get_alloc_count() == count)
+        
+        COMMENT("Test release() and adopting a struct")
+        {
+            Batch raw = queue[0].release();
+            TEST(queue[0]->label == NULL)
+            TEST(raw.label == label)
+            
+            nanopb::Message<Batch> adopted(std::move(raw));
+            TEST(raw.label == NULL)
+            TEST(adopted->label == label)
+        }
+        TEST(get_alloc_count() == 0)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
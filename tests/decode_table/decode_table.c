@@ -0,0 +1,164 @@
+/* Checks that pb_decode_table() gives the same results as pb_decode(),
+ * both for fields in declaration order and in other orders. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "decode_table.pb.h"
+#include "unittests.h"
+
+/* Custom stream that reads from a memory buffer through a callback. */
+static bool read_callback(pb_istream_t *stream, uint8_t *buf, size_t count)
+{
+    const uint8_t *src = (const uint8_t*)stream->state;
+    memcpy(buf, src, count);
+    stream->state = (uint8_t*)stream->state + count;
+    return true;
+}
+
+/* Decode the data with both pb_decode() and pb_decode_table() and
+ * check that the results are identical. */
+static bool decode_both(const uint8_t *buf, size_t size, Table *msg)
+{
+    Table expected;
+    pb_istream_t stream;
+    
+    memset(&expected, 0, sizeof(expected));
+    stream = pb_istream_from_buffer(buf, size);
+    if (!pb_decode(&stream, Table_fields, &expected))
+        return false;
+    
+    memset(msg, 0, sizeof(Table));
+    stream = pb_istream_from_buffer(buf, size);
+    if (!pb_decode_table(&stream, &Table_parse_table, msg) || stream.bytes_left != 0)
+        return false;
+    
+    return memcmp(msg, &expected, sizeof(Table)) == 0;
+}
+
+static bool decode_error(const uint8_t *buf, size_t size, const char *errmsg)
+{
+    Table msg;
+    pb_istream_t stream = pb_istream_from_buffer(buf, size);
+    
+    if (pb_decode_table(&stream, &Table_parse_table, &msg))
+        return false;
+    
+    return strcmp(PB_GET_ERROR(&stream), errmsg) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    
+    {
+        Table msg = Table_init_zero;
+        Table decoded;
+        uint8_t buffer[256];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+        
+        msg.req_int32 = -5;
+        msg.has_opt_int64 = true;
+        msg.opt_int64 = -1234567890123LL;
+        msg.has_opt_uint32 = true;
+        msg.opt_uint32 = 4000000000u;
+        msg.has_opt_uint64 = true;
+        msg.opt_uint64 = 18000000000000000000ULL;
+        msg.has_opt_sint32 = true;
+        msg.opt_sint32 = -77;
+        msg.has_opt_bool = true;
+        msg.opt_bool = true;
+        msg.has_opt_fixed32 = true;
+        msg.opt_fixed32 = 0xDEADBEEF;
+        msg.has_opt_sfixed64 = true;
+        msg.opt_sfixed64 = -6;
+        msg.has_opt_float = true;
+        msg.opt_float = 1.5f;
+        msg.has_opt_double = true;
+        msg.opt_double = -2.25;
+        msg.has_opt_kind = true;
+        msg.opt_kind = Kind_SECOND;
+        msg.has_small = true;
+        msg.small = -100;
+        strcpy(msg.name, "table");
+        msg.has_data = true;
+        msg.data.size = 3;
+        memcpy(msg.data.bytes, "\x00\x01\x02", 3);
+        msg.has_sub = true;
+        msg.sub.a = 7;
+        msg.values_count = 3;
+        msg.values[0] = 1;
+        msg.values[1] = -1;
+        msg.values[2] = 300;
+        msg.subs_count = 2;
+        msg.subs[1].a = 8;
+        msg.subs[1].has_s = true;
+        strcpy(msg.subs[1].s, "sub");
+        msg.which_choice = Table_c_str_tag;
+        strcpy(msg.choice.c_str, "choice");
+        msg.p3_uint32 = 21;
+        msg.last = 99;
+        
+        TEST(pb_encode(&ostream, Table_fields, &msg))
+        
+        COMMENT("Test decoding fields in declaration order")
+        TEST(decode_both(buffer, ostream.bytes_written, &decoded))
+        TEST(decoded.opt_uint64 == 18000000000000000000ULL)
+        TEST(decoded.values_count == 3 && decoded.values[2] == 300)
+        TEST(strcmp(decoded.subs[1].s, "sub") == 0)
+        TEST(decoded.which_choice == Table_c_str_tag)
+        TEST(decoded.last == 99)
+        
+        COMMENT("Test decoding from a callback stream")
+        memset(&decoded, 0, sizeof(decoded));
+        istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+        istream.callback = &read_callback;
+        TEST(pb_decode_table(&istream, &Table_parse_table, &decoded))
+        TEST(decoded.opt_int64 == -1234567890123LL && decoded.last == 99)
+    }
+    
+    {
+        /* last, unknown field 50, name, values unpacked twice, req_int32 */
+        const uint8_t buf[] = {0xC1, 0x0C, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                               0x90, 0x03, 0x01,
+                               0x6A, 0x01, 'x',
+                               0x80, 0x01, 0x05, 0x80, 0x01, 0x06,
+                               0x08, 0x05};
+        Table decoded;
+        
+        COMMENT("Test decoding fields out of order")
+        TEST(decode_both(buf, sizeof(buf), &decoded))
+        TEST(decoded.req_int32 == 5 && strcmp(decoded.name, "x") == 0)
+        TEST(decoded.values_count == 2 && decoded.values[1] == 6)
+        TEST(decoded.last == 0x0807060504030201ULL)
+    }
+    
+    {
+        const uint8_t missing[] = {0x08, 0x01};
+        const uint8_t uint32_range[] = {0x18, 0x80, 0x80, 0x80, 0x80, 0x10};
+        const uint8_t int8_range[] = {0x60, 0xAC, 0x02};
+        
+        COMMENT("Test decoding errors")
+        TEST(decode_error(missing, sizeof(missing), "missing required field"))
+        TEST(decode_error(uint32_range, sizeof(uint32_range), "integer too large"))
+        TEST(decode_error(int8_range, sizeof(int8_range), "integer too large"))
+    }
+    
+    {
+        const uint8_t buf[] = {0x08, 0x2A};
+        Extendable msg = Extendable_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(buf, sizeof(buf));
+        
+        COMMENT("Test message without parse table entries")
+        TEST(Extendable_parse_table.entries == NULL)
+        TEST(pb_decode_table(&stream, &Extendable_parse_table, &msg))
+        TEST(msg.x == 42)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
@@ -0,0 +1,354 @@
+/* Checks that pb_encode_delta() writes only the changed fields, and that
+ * applying the delta with pb_decode_delta() gives the new message. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "delta.pb.h"
+#include "unittests.h"
+
+/* Encode the delta from prev to curr, apply it on a copy of prev that
+ * has been through the decoder, and check that the result encodes the
+ * same as curr. Returns the size of the delta, or 0 on failure. */
+static size_t check_delta(const State *prev, const State *curr)
+{
+    uint8_t full[256], delta[256], result[256];
+    pb_ostream_t ostream;
+    pb_istream_t istream;
+    size_t full_size, delta_size;
+    State receiver = State_init_zero;
+
+    ostream = pb_ostream_from_buffer(full, sizeof(full));
+    if (!pb_encode(&ostream, State_fields, prev))
+        return 0;
+    istream = pb_istream_from_buffer(full, ostream.bytes_written);
+    if (!pb_decode(&istream, State_fields, &receiver))
+        return 0;
+
+    ostream = pb_ostream_from_buffer(delta, sizeof(delta));
+    if (!pb_encode_delta(&ostream, State_fields, prev, curr))
+        return 0;
+    delta_size = ostream.bytes_written;
+
+    istream = pb_istream_from_buffer(delta, delta_size);
+    if (!pb_decode_delta(&istream, State_fields, &receiver))
+        return 0;
+
+    ostream = pb_ostream_from_buffer(full, sizeof(full));
+    if (!pb_encode(&ostream, State_fields, curr))
+        return 0;
+    full_size = ostream.bytes_written;
+
+    ostream = pb_ostream_from_buffer(result, sizeof(result));
+    if (!pb_encode(&ostream, State_fields, &receiver))
+        return 0;
+
+    if (ostream.bytes_written != full_size || memcmp(result, full, full_size) != 0)
+        return 0;
+
+    return delta_size;
+}
+
+static bool write_note(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    (void)arg;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const pb_byte_t*)"note", 4);
+}
+
+/* Returns the error message of pb_encode_delta(), or NULL on success. */
+static const char *delta_error(const State *prev, const State *curr)
+{
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    if (pb_encode_delta(&stream, State_fields, prev, curr))
+        return NULL;
+    return PB_GET_ERROR(&stream);
+}
+
+/* Repeated extensions are not generated, so this one is defined here. */
+typedef struct {
+    pb_size_t values_count;
+    int32_t values[4];
+} Tags;
+
+static const pb_field_t tags_field =
+    PB_FIELD(102, INT32, REPEATED, STATIC, FIRST, Tags, values, values, 0);
+
+static const pb_extension_type_t config_tags = {NULL, NULL, &tags_field};
+
+static bool write_extension(pb_ostream_t *stream, const pb_extension_t *extension)
+{
+    (void)extension;
+    return pb_encode_tag(stream, PB_WT_VARINT, 103) &&
+           pb_encode_varint(stream, 1);
+}
+
+static const pb_extension_type_t config_custom = {NULL, &write_extension, NULL};
+
+/* Encodes the delta of two Configs, returns the size or 0 on failure. */
+static size_t config_delta(const Config *prev, const Config *curr, uint8_t *buffer, const char **error)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, 64);
+    if (pb_encode_delta(&stream, Config_fields, prev, curr))
+        return stream.bytes_written;
+    *error = PB_GET_ERROR(&stream);
+    return 0;
+}
+
+int main()
+{
+    int status = 0;
+    State prev = State_init_zero;
+    State curr;
+
+    prev.sequence = 1;
+    prev.has_temperature = true;
+    prev.temperature = 21;
+    prev.has_voltage = true;
+    prev.voltage = 3.3f;
+    prev.has_status = true;
+    strcpy(prev.status, "running normally");
+    prev.has_blob = true;
+    prev.blob.size = 4;
+    memcpy(prev.blob.bytes, "\x01\x02\x03\x04", 4);
+    prev.samples_count = 3;
+    prev.samples[0] = 100;
+    prev.samples[1] = -200;
+    prev.samples[2] = 300;
+    prev.has_position = true;
+    prev.position.x = 10;
+    prev.position.y = 20;
+    prev.position.has_label = true;
+    strcpy(prev.position.label, "home");
+    prev.waypoints_count = 1;
+    prev.waypoints[0].x = 1;
+    prev.waypoints[0].y = 2;
+    prev.counter = 5;
+    prev.which_mode = State_target_tag;
+    prev.mode.target.x = 7;
+    prev.mode.target.y = 8;
+
+    {
+        /* Only the required field is written. */
+        const uint8_t expected[] = {0x08, 0x01};
+        uint8_t buffer[64];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test delta of identical messages")
+        curr = prev;
+        TEST(pb_encode_delta(&stream, State_fields, &prev, &curr))
+        TEST(stream.bytes_written == sizeof(expected))
+        TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+        TEST(check_delta(&prev, &curr) == sizeof(expected))
+    }
+
+    {
+        /* sequence = 2, temperature = 22 */
+        const uint8_t expected[] = {0x08, 0x02, 0x10, 0x16};
+        uint8_t buffer[64];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test delta of changed scalar")
+        curr = prev;
+        curr.sequence = 2;
+        curr.temperature = 22;
+        TEST(pb_encode_delta(&stream, State_fields, &prev, &curr))
+        TEST(stream.bytes_written == sizeof(expected))
+        TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+        TEST(check_delta(&prev, &curr) == sizeof(expected))
+    }
+
+    {
+        /* sequence = 1, position { x = 10, y = 21 } */
+        const uint8_t expected[] = {0x08, 0x01, 0x3A, 0x04, 0x08, 0x0A, 0x10, 0x15};
+        uint8_t buffer[64];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test delta of nested submessage")
+        curr = prev;
+        curr.position.y = 21;
+        TEST(pb_encode_delta(&stream, State_fields, &prev, &curr))
+        TEST(stream.bytes_written == sizeof(expected))
+        TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+        TEST(check_delta(&prev, &curr) == sizeof(expected))
+    }
+
+    COMMENT("Test delta of other field types")
+    curr = prev;
+    strcpy(curr.status, "overheating");
+    TEST(check_delta(&prev, &curr) != 0)
+    curr = prev;
+    curr.blob.bytes[3] = 5;
+    TEST(check_delta(&prev, &curr) != 0)
+    curr = prev;
+    curr.voltage = 3.2f;
+    TEST(check_delta(&prev, &curr) == 7)
+    curr = prev;
+    curr.counter = 0;
+    TEST(check_delta(&prev, &curr) == 4)
+    curr = prev;
+    curr.position.has_label = false;
+    curr.has_temperature = true;
+    TEST(strcmp(delta_error(&prev, &curr), "field cleared") == 0)
+
+    COMMENT("Test delta of oneof")
+    curr = prev;
+    TEST(check_delta(&prev, &curr) == 2)
+    curr.mode.target.y = 9;
+    TEST(strcmp(delta_error(&prev, &curr), "submessage changed") == 0)
+    curr = prev;
+    curr.which_mode = State_idle_tag;
+    curr.mode.idle = 1;
+    TEST(check_delta(&prev, &curr) == 4)
+    TEST(check_delta(&curr, &prev) == 8)
+    curr = prev;
+    curr.which_mode = 0;
+    TEST(strcmp(delta_error(&prev, &curr), "field cleared") == 0)
+
+    COMMENT("Test delta of arrays")
+    curr = prev;
+    curr.samples_count = 4;
+    curr.samples[3] = 400;
+    TEST(check_delta(&prev, &curr) == 6)
+    curr.waypoints_count = 2;
+    curr.waypoints[1].x = 3;
+    curr.waypoints[1].y = 4;
+    TEST(check_delta(&prev, &curr) == 12)
+    curr = prev;
+    curr.samples[1] = 0;
+    TEST(strcmp(delta_error(&prev, &curr), "repeated field changed") == 0)
+    curr = prev;
+    curr.waypoints[0].y = 0;
+    TEST(strcmp(delta_error(&prev, &curr), "repeated field changed") == 0)
+    curr = prev;
+    curr.samples_count = 2;
+    TEST(strcmp(delta_error(&prev, &curr), "field cleared") == 0)
+
+    COMMENT("Test delta of repeated callback field")
+    curr = prev;
+    curr.notes.funcs.encode = &write_note;
+    TEST(strcmp(delta_error(&prev, &curr), "repeated callback field") == 0)
+
+    {
+        Config cprev = Config_init_zero, ccurr;
+        int32_t level = 3, next_level;
+        Position origin = Position_init_zero, next_origin;
+        Tags tags = {2, {1, 2}}, next_tags;
+        pb_extension_t ext_level, ext_origin, ext_tags;
+        pb_extension_t next_ext_level, next_ext_origin, next_ext_tags, ext_custom;
+        uint8_t buffer[64];
+        const char *error = NULL;
+        
+        cprev.version = 1;
+        cprev.extensions = &ext_level;
+        ext_level.type = &config_level;
+        ext_level.dest = &level;
+        ext_level.next = &ext_origin;
+        ext_origin.type = &config_origin;
+        ext_origin.dest = &origin;
+        ext_origin.next = &ext_tags;
+        ext_tags.type = &config_tags;
+        ext_tags.dest = tags.values;
+        ext_tags.next = NULL;
+        origin.x = 5;
+        origin.y = 6;
+        
+        /* The next version has its own copies, listed in another order. */
+        next_level = level;
+        next_origin = origin;
+        next_tags = tags;
+        ccurr = cprev;
+        ccurr.extensions = &next_ext_tags;
+        next_ext_tags.type = &config_tags;
+        next_ext_tags.dest = next_tags.values;
+        next_ext_tags.next = &next_ext_origin;
+        next_ext_origin.type = &config_origin;
+        next_ext_origin.dest = &next_origin;
+        next_ext_origin.next = &next_ext_level;
+        next_ext_level.type = &config_level;
+        next_ext_level.dest = &next_level;
+        next_ext_level.next = NULL;
+        
+        COMMENT("Test delta of unchanged extensions")
+        TEST(config_delta(&cprev, &ccurr, buffer, &error) == 2)
+        
+        COMMENT("Test delta of changed extensions")
+        {
+            /* version = 1, config_origin { x = 5, y = 7 }, config_level = 4 */
+            const uint8_t expected[] = {0x08, 0x01, 0xAA, 0x06, 0x04, 0x08, 0x05,
+                                        0x10, 0x07, 0xA0, 0x06, 0x04};
+            Config receiver = Config_init_zero;
+            pb_istream_t stream;
+            
+            next_level = 4;
+            next_origin.y = 7;
+            TEST(config_delta(&cprev, &ccurr, buffer, &error) == sizeof(expected))
+            TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+            
+            level = 3;
+            origin.y = 6;
+            receiver.extensions = &ext_level;
+            ext_level.next = &ext_origin;
+            ext_origin.next = NULL;
+            stream = pb_istream_from_buffer(buffer, sizeof(expected));
+            TEST(pb_decode_delta(&stream, Config_fields, &receiver))
+            TEST(level == 4 && origin.x == 5 && origin.y == 7)
+            ext_origin.next = &ext_tags;
+            level = 3;
+            origin.y = 6;
+            next_level = level;
+            next_origin = origin;
+        }
+        
+        COMMENT("Test delta of repeated extension")
+        {
+            /* version = 1, config_tags = [3], packed */
+            const uint8_t expected[] = {0x08, 0x01, 0xB2, 0x06, 0x01, 0x03};
+            
+            next_tags.values_count = 3;
+            next_tags.values[2] = 3;
+            TEST(config_delta(&cprev, &ccurr, buffer, &error) == sizeof(expected))
+            TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+            next_tags.values[0] = 0;
+            TEST(config_delta(&cprev, &ccurr, buffer, &error) == 0)
+            TEST(strcmp(error, "repeated field changed") == 0)
+            next_tags = tags;
+        }
+        
+        COMMENT("Test delta of added and removed extensions")
+        {
+            /* version = 1, config_level = 3 */
+            const uint8_t expected[] = {0x08, 0x01, 0xA0, 0x06, 0x03};
+            
+            cprev.extensions = &ext_origin;
+            TEST(config_delta(&cprev, &ccurr, buffer, &error) == sizeof(expected))
+            TEST(memcmp(buffer, expected, sizeof(expected)) == 0)
+            TEST(config_delta(&ccurr, &cprev, buffer, &error) == 0)
+            TEST(strcmp(error, "field cleared") == 0)
+            cprev.extensions = &ext_level;
+        }
+        
+        COMMENT("Test delta of extension with custom encoder")
+        ext_custom.type = &config_custom;
+        ext_custom.dest = NULL;
+        ext_custom.next = NULL;
+        next_ext_level.next = &ext_custom;
+        TEST(config_delta(&cprev, &ccurr, buffer, &error) == 0)
+        TEST(strcmp(error, "custom extension encoder") == 0)
+        next_ext_level.next = NULL;
+    }
+
+    COMMENT("Test delta of newly set fields")
+    {
+        State empty = State_init_zero;
+        empty.sequence = 1;
+        empty.position.y = 99; /* Not set, must not affect the result */
+        TEST(check_delta(&empty, &prev) != 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
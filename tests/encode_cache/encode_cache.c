@@ -0,0 +1,150 @@
+/* Checks that messages with the encode_cache option encode the same as
+ * messages without it, and that the cached bytes are reused until the
+ * cache is invalidated. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "encode_cache.pb.h"
+#include "unittests.h"
+
+static pb_byte_t cache_bytes[4][Block_size];
+static pb_encode_cache_t caches[4] = {
+    PB_ENCODE_CACHE_INIT(cache_bytes[0]), PB_ENCODE_CACHE_INIT(cache_bytes[1]),
+    PB_ENCODE_CACHE_INIT(cache_bytes[2]), PB_ENCODE_CACHE_INIT(cache_bytes[3])
+};
+
+/* The message is const, only the cache is written by the encoder. */
+static pb_byte_t rom_cache_bytes[Block_size];
+static pb_encode_cache_t rom_cache = PB_ENCODE_CACHE_INIT(rom_cache_bytes);
+static const Block rom_block = {1, {{5, true, "rom"}}, true, 7, &rom_cache};
+
+static void fill_block(Block *block, PlainBlock *plain, uint32_t id)
+{
+    pb_size_t i;
+
+    block->has_id = plain->has_id = true;
+    block->id = plain->id = id;
+    block->leaves_count = plain->leaves_count = 3;
+    for (i = 0; i < 3; i++)
+    {
+        block->leaves[i].a = plain->leaves[i].a = (int32_t)(id * 10 + i);
+        block->leaves[i].has_s = plain->leaves[i].has_s = true;
+        strcpy(block->leaves[i].s, "leaf");
+        strcpy(plain->leaves[i].s, "leaf");
+    }
+}
+
+/* Encode both messages and check that the output is the same. */
+static bool same_encoding(const Snapshot *msg, const PlainSnapshot *plain)
+{
+    uint8_t buffer1[512], buffer2[512];
+    pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+    pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+    if (!pb_encode(&stream1, Snapshot_fields, msg) ||
+        !pb_encode(&stream2, PlainSnapshot_fields, plain))
+        return false;
+
+    return stream1.bytes_written == stream2.bytes_written &&
+           memcmp(buffer1, buffer2, stream1.bytes_written) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    Snapshot msg = Snapshot_init_zero;
+    PlainSnapshot plain = PlainSnapshot_init_zero;
+
+    msg.seq = plain.seq = 1;
+    msg.has_first = plain.has_first = true;
+    fill_block(&msg.first, &plain.first, 1);
+    msg.blocks_count = plain.blocks_count = 2;
+    fill_block(&msg.blocks[0], &plain.blocks[0], 2);
+    fill_block(&msg.blocks[1], &plain.blocks[1], 3);
+
+    COMMENT("Test encoding without cache storage")
+    TEST(msg.first.encode_cache == NULL)
+    TEST(same_encoding(&msg, &plain))
+
+    COMMENT("Test initial encoding")
+    msg.first.encode_cache = &caches[0];
+    msg.blocks[0].encode_cache = &caches[1];
+    msg.blocks[1].encode_cache = &caches[2];
+    TEST(!msg.first.encode_cache->valid)
+    TEST(same_encoding(&msg, &plain))
+    TEST(msg.first.encode_cache->valid)
+    TEST(msg.blocks[1].encode_cache->valid)
+
+    COMMENT("Test encoding again from the cache")
+    TEST(same_encoding(&msg, &plain))
+    msg.seq = plain.seq = 2;
+    TEST(same_encoding(&msg, &plain))
+
+    COMMENT("Test that the cached bytes are used until invalidated")
+    msg.first.id = plain.first.id = 100;
+    TEST(!same_encoding(&msg, &plain))
+    PB_INVALIDATE_CACHE(&msg.first);
+    TEST(same_encoding(&msg, &plain))
+    msg.blocks[0].leaves[1].a = plain.blocks[0].leaves[1].a = -1;
+    PB_INVALIDATE_CACHE(&msg.blocks[0]);
+    TEST(same_encoding(&msg, &plain))
+
+    {
+        size_t size1, size2;
+        uint8_t buffer[512];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test sizing and top-level messages")
+        PB_INVALIDATE_CACHE(&msg.first);
+        TEST(pb_get_encoded_size(&size1, Snapshot_fields, &msg))
+        TEST(pb_get_encoded_size(&size2, PlainSnapshot_fields, &plain))
+        TEST(size1 == size2)
+        TEST(msg.first.encode_cache->valid)
+        TEST(pb_get_encoded_size(&size1, Block_fields, &msg.blocks[1]))
+        TEST(pb_encode(&stream, Block_fields, &msg.blocks[1]))
+        TEST(stream.bytes_written == size1)
+        TEST(stream.bytes_written == msg.blocks[1].encode_cache->size)
+    }
+
+    {
+        /* a = 5, s = "rom", id = 7 */
+        const uint8_t expected[] = {0x0A, 0x07, 0x08, 0x05, 0x12, 0x03, 'r', 'o', 'm', 0x10, 0x07};
+        uint8_t buffer[64];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test const message with writable cache")
+        TEST(pb_encode(&stream, Block_fields, &rom_block))
+        TEST(rom_cache.valid)
+        TEST(rom_cache.size == sizeof(expected))
+        TEST(memcmp(rom_cache_bytes, expected, sizeof(expected)) == 0)
+        TEST(pb_encode(&stream, Block_fields, &rom_block))
+        TEST(stream.bytes_written == 2 * sizeof(expected))
+        TEST(memcmp(buffer + sizeof(expected), expected, sizeof(expected)) == 0)
+    }
+
+    {
+        uint8_t buffer[512];
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+        Snapshot decoded = Snapshot_init_zero;
+
+        COMMENT("Test that decoding invalidates the cache")
+        TEST(pb_encode(&ostream, PlainSnapshot_fields, &plain))
+        decoded.first.encode_cache = &caches[3];
+        caches[3].valid = true;
+        caches[3].size = 0;
+        istream = pb_istream_from_buffer(buffer, ostream.bytes_written);
+        TEST(pb_decode(&istream, Snapshot_fields, &decoded))
+        TEST(!caches[3].valid)
+        TEST(decoded.blocks[0].encode_cache == NULL)
+        TEST(decoded.first.id == 100)
+        TEST(same_encoding(&decoded, &plain))
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
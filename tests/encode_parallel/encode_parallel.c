@@ -0,0 +1,130 @@
+/* Checks that pb_encode_parallel() gives the same output as pb_encode(),
+ * using a runner that calls the chunks in reverse order. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "encode_parallel.pb.h"
+#include "unittests.h"
+
+static size_t g_runs;
+
+/* Calls the chunks last to first, like threads finishing out of order. */
+static void reverse_run(void *context, void (*func)(void *arg, size_t index),
+                        void *arg, size_t count)
+{
+    (void)context;
+    g_runs++;
+    while (count > 0)
+    {
+        count--;
+        func(arg, count);
+    }
+}
+
+static void fill_item(Item *item, uint32_t id)
+{
+    pb_size_t i;
+    item->id = id;
+    item->has_name = (id % 3 != 0);
+    sprintf(item->name, "item %u", (unsigned)id);
+    item->values_count = (pb_size_t)(id % 5);
+    for (i = 0; i < item->values_count; i++)
+        item->values[i] = (int32_t)(id * 1000 - i * 77777);
+}
+
+/* Encode with both functions and check that the output is the same. */
+static bool same_encoding(const Batch *msg, const pb_parallel_t *parallel)
+{
+    uint8_t buffer1[2048], buffer2[2048];
+    pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+    pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+    if (!pb_encode(&stream1, Batch_fields, msg) ||
+        !pb_encode_parallel(&stream2, Batch_fields, msg, parallel))
+        return false;
+
+    return stream1.bytes_written == stream2.bytes_written &&
+           memcmp(buffer1, buffer2, stream1.bytes_written) == 0;
+}
+
+static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t **dest = (uint8_t**)stream->state;
+    memcpy(*dest, buf, count);
+    *dest += count;
+    return true;
+}
+
+int main()
+{
+    int status = 0;
+    Batch msg = Batch_init_zero;
+    pb_parallel_t parallel = {reverse_run, NULL, 2};
+    pb_size_t i;
+
+    msg.seq = 5;
+    msg.items_count = 40;
+    for (i = 0; i < msg.items_count; i++)
+        fill_item(&msg.items[i], i * 37 + 1);
+    msg.extra_count = 1;
+    fill_item(&msg.extra[0], 1000);
+    msg.has_note = true;
+    strcpy(msg.note, "end");
+
+    COMMENT("Test output is same as pb_encode()")
+    g_runs = 0;
+    TEST(same_encoding(&msg, &parallel))
+    TEST(g_runs == 2)
+
+    COMMENT("Test arrays smaller than the number of chunks")
+    msg.items_count = 3;
+    TEST(same_encoding(&msg, &parallel))
+    msg.items_count = 0;
+    TEST(same_encoding(&msg, &parallel))
+
+    COMMENT("Test min_count threshold")
+    msg.items_count = 40;
+    msg.extra_count = 3;
+    fill_item(&msg.extra[1], 1001);
+    fill_item(&msg.extra[2], 1002);
+    g_runs = 0;
+    TEST(same_encoding(&msg, &parallel))
+    TEST(g_runs == 4)
+    parallel.min_count = 10;
+    g_runs = 0;
+    TEST(same_encoding(&msg, &parallel))
+    TEST(g_runs == 2)
+
+    {
+        uint8_t buffer1[2048], buffer2[2048];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = PB_OSTREAM_SIZING;
+        uint8_t *pos = buffer2;
+
+        COMMENT("Test fallback for callback streams")
+        stream2.callback = &write_callback;
+        stream2.state = &pos;
+        stream2.max_size = sizeof(buffer2);
+        g_runs = 0;
+        TEST(pb_encode(&stream1, Batch_fields, &msg))
+        TEST(pb_encode_parallel(&stream2, Batch_fields, &msg, &parallel))
+        TEST(g_runs == 0)
+        TEST(stream1.bytes_written == stream2.bytes_written)
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0)
+    }
+
+    {
+        uint8_t buffer[64];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test too small buffer")
+        TEST(!pb_encode_parallel(&stream, Batch_fields, &msg, &parallel))
+        TEST(strcmp(PB_GET_ERROR(&stream), "stream full") == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
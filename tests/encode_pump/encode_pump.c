@@ -0,0 +1,189 @@
+/* Checks that the message produced in pieces by pb_encoder_pump() is
+ * the same as the output of pb_encode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "encode_pump.pb.h"
+#include "unittests.h"
+
+static int title_calls;
+static int name_calls;
+
+static bool write_title(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    const char *title = (const char*)*arg;
+    title_calls++;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const pb_byte_t*)title, strlen(title));
+}
+
+static bool write_name(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    (void)arg;
+    name_calls++;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const pb_byte_t*)"path", 4);
+}
+
+/* Pump the message with the given piece size and compare the result to
+ * the expected encoding. */
+static bool pump_matches(const Drawing *msg, size_t piece,
+                         const pb_byte_t *expected, size_t size)
+{
+    pb_encoder_ctx_t ctx;
+    pb_byte_t buffer[512];
+    size_t total = 0;
+    size_t count;
+
+    if (!pb_encoder_init(&ctx, Drawing_fields, msg) || ctx.total_size != size)
+        return false;
+
+    while (!pb_encoder_done(&ctx))
+    {
+        if (!pb_encoder_pump(&ctx, buffer + total, piece, &count))
+            return false;
+        if (count == 0 || count > piece)
+            return false;
+        total += count;
+    }
+
+    return total == size && memcmp(buffer, expected, size) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    Drawing msg = Drawing_init_zero;
+    pb_byte_t expected[512];
+    size_t size;
+    pb_size_t i, j;
+
+    msg.id = 42;
+    msg.paths_count = 3;
+    for (i = 0; i < msg.paths_count; i++)
+    {
+        Path *path = &msg.paths[i];
+        path->points_count = (pb_size_t)(3 + i * 2);
+        for (j = 0; j < path->points_count; j++)
+        {
+            path->points[j].x = (int32_t)(j * 100 - i);
+            path->points[j].y = -(int32_t)(j * 10000);
+            path->points[j].has_label = (j % 2 == 0);
+            strcpy(path->points[j].label, "p00");
+            path->points[j].label[1] = (char)('0' + i);
+            path->points[j].label[2] = (char)('0' + j);
+        }
+        path->has_origin = true;
+        path->origin.x = (int32_t)i;
+        path->name.funcs.encode = &write_name;
+    }
+    msg.title.funcs.encode = &write_title;
+    msg.title.arg = (void*)"a drawing with a long title";
+    msg.colors_count = 3;
+    msg.colors[0] = 0xFF0000;
+    msg.colors[1] = 0x00FF00;
+    msg.colors[2] = 0x0000FF;
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Drawing_fields, &msg))
+        size = stream.bytes_written;
+    }
+
+    COMMENT("Test pumping with different piece sizes")
+    TEST(pump_matches(&msg, 1, expected, size))
+    TEST(pump_matches(&msg, 2, expected, size))
+    TEST(pump_matches(&msg, 7, expected, size))
+    TEST(pump_matches(&msg, 64, expected, size))
+    TEST(pump_matches(&msg, size - 1, expected, size))
+    TEST(pump_matches(&msg, size, expected, size))
+    TEST(pump_matches(&msg, sizeof(expected), expected, size))
+
+    {
+        int whole_calls;
+        
+        COMMENT("Test that callback fields are called only once")
+        title_calls = 0;
+        TEST(pump_matches(&msg, 1, expected, size))
+        TEST(title_calls == 2)
+        title_calls = 0;
+        TEST(pump_matches(&msg, 7, expected, size))
+        TEST(title_calls == 2)
+        
+        COMMENT("Test that callbacks in submessages do not depend on piece size")
+        name_calls = 0;
+        TEST(pump_matches(&msg, size, expected, size))
+        whole_calls = name_calls;
+        name_calls = 0;
+        TEST(pump_matches(&msg, 1, expected, size))
+        TEST(name_calls == whole_calls)
+        name_calls = 0;
+        TEST(pump_matches(&msg, 7, expected, size))
+        TEST(name_calls == whole_calls)
+    }
+
+    {
+        const char *long_title = "a title that does not fit in the pending bytes of the pump";
+        pb_byte_t expected2[512];
+        size_t size2;
+        pb_ostream_t stream = pb_ostream_from_buffer(expected2, sizeof(expected2));
+        pb_encoder_ctx_t ctx;
+        pb_byte_t buffer[512];
+        size_t count, total = 0;
+
+        COMMENT("Test that long callback fields must fit in the output")
+        msg.title.arg = (void*)long_title;
+        TEST(pb_encode(&stream, Drawing_fields, &msg))
+        size2 = stream.bytes_written;
+        title_calls = 0;
+        TEST(pump_matches(&msg, size2, expected2, size2))
+        TEST(title_calls == 2)
+        TEST(pb_encoder_init(&ctx, Drawing_fields, &msg))
+        while (pb_encoder_pump(&ctx, buffer + total, 7, &count) && !pb_encoder_done(&ctx))
+            total += count;
+        TEST(!pb_encoder_done(&ctx))
+        TEST(strcmp(PB_GET_ERROR(&ctx), "callback field too large") == 0)
+        msg.title.arg = (void*)"a drawing with a long title";
+    }
+
+    {
+        pb_encoder_ctx_t ctx;
+        pb_byte_t buffer[512];
+        size_t count;
+
+        COMMENT("Test empty output buffer and finished message")
+        TEST(pb_encoder_init(&ctx, Drawing_fields, &msg))
+        TEST(pb_encoder_pump(&ctx, buffer, 0, &count) && count == 0)
+        TEST(pb_encoder_pump(&ctx, buffer, sizeof(buffer), &count) && count == size)
+        TEST(pb_encoder_done(&ctx))
+        TEST(pb_encoder_pump(&ctx, buffer, sizeof(buffer), &count) && count == 0)
+    }
+
+    {
+        pb_encoder_ctx_t ctx;
+        pb_byte_t buffer[512];
+        size_t count;
+
+        COMMENT("Test message changing between calls")
+        TEST(pb_encoder_init(&ctx, Drawing_fields, &msg))
+        TEST(pb_encoder_pump(&ctx, buffer, 10, &count) && count == 10)
+        msg.colors_count = 2;
+        TEST(!pb_encoder_pump(&ctx, buffer, sizeof(buffer), &count))
+        TEST(strcmp(PB_GET_ERROR(&ctx), "message changed") == 0)
+        msg.colors_count = 3;
+        
+        COMMENT("Test submessage changing between calls")
+        TEST(pb_encoder_init(&ctx, Drawing_fields, &msg))
+        TEST(pb_encoder_pump(&ctx, buffer, 10, &count) && count == 10)
+        msg.paths[0].points[2].has_label = false;
+        TEST(!pb_encoder_pump(&ctx, buffer, sizeof(buffer), &count))
+        TEST(strcmp(PB_GET_ERROR(&ctx), "message changed") == 0)
+        msg.paths[0].points[2].has_label = true;
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,115 @@
+/* Checks that pb_encode_table() produces the same output as pb_encode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "encode_table.pb.h"
+#include "unittests.h"
+
+/* Custom stream that writes to a memory buffer through a callback. */
+static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t *dest = (uint8_t*)stream->state;
+    memcpy(dest, buf, count);
+    stream->state = dest + count;
+    return true;
+}
+
+static bool encode_cb(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    const char *str = (const char*)*arg;
+    return pb_encode_tag_for_field(stream, field) &&
+           pb_encode_string(stream, (const pb_byte_t*)str, strlen(str));
+}
+
+int main()
+{
+    int status = 0;
+    Table msg = Table_init_zero;
+    uint8_t expected[256];
+    size_t expected_size;
+    
+    msg.req_int32 = -5;
+    msg.has_opt_sint64 = true;
+    msg.opt_sint64 = -1234567890123LL;
+    msg.has_opt_fixed32 = true;
+    msg.opt_fixed32 = 0xDEADBEEF;
+    msg.has_opt_double = true;
+    msg.opt_double = -2.25;
+    strcpy(msg.name, "table");
+    msg.has_data = true;
+    msg.data.size = 3;
+    memcpy(msg.data.bytes, "\x00\x01\x02", 3);
+    msg.has_sub = true;
+    msg.sub.a = 7;
+    msg.values_count = 3;
+    msg.values[0] = 1;
+    msg.values[1] = -1;
+    msg.values[2] = 300;
+    msg.fixed_count = 2;
+    msg.fixed[0] = 1;
+    msg.fixed[1] = 2;
+    msg.names_count = 2;
+    strcpy(msg.names[0], "abc");
+    msg.subs_count = 2;
+    msg.subs[1].a = 8;
+    msg.subs[1].has_s = true;
+    strcpy(msg.subs[1].s, "sub");
+    msg.which_choice = Table_c_sub_tag;
+    msg.choice.c_sub.a = 9;
+    msg.cb.funcs.encode = &encode_cb;
+    msg.cb.arg = (void*)"callback";
+    msg.p3_uint32 = 21;
+    msg.last = 99;
+    
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Table_fields, &msg))
+        expected_size = stream.bytes_written;
+    }
+    
+    {
+        uint8_t buffer[256];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        
+        COMMENT("Test pb_encode_table into a buffer")
+        TEST(pb_encode_table(&stream, &Table_parse_table, &msg))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        
+        COMMENT("Test pb_encode_table into a callback stream")
+        stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        stream.callback = &write_callback;
+        TEST(pb_encode_table(&stream, &Table_parse_table, &msg))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        
+        COMMENT("Test pb_encode_table into a sizing stream")
+        {
+            pb_ostream_t sizestream = PB_OSTREAM_SIZING;
+            TEST(pb_encode_table(&sizestream, &Table_parse_table, &msg))
+            TEST(sizestream.bytes_written == expected_size)
+        }
+        
+        COMMENT("Test pb_encode_table into a too small buffer")
+        stream = pb_ostream_from_buffer(buffer, expected_size - 1);
+        TEST(!pb_encode_table(&stream, &Table_parse_table, &msg))
+    }
+    
+    {
+        Extendable ext = Extendable_init_zero;
+        uint8_t buffer[16];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        
+        COMMENT("Test message without parse table entries")
+        ext.has_x = true;
+        ext.x = 42;
+        TEST(pb_encode_table(&stream, &Extendable_parse_table, &ext))
+        TEST(stream.bytes_written == 2 && buffer[0] == 0x08 && buffer[1] == 42)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
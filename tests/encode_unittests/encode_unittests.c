@@ -36,6 +36,18 @@ bool crazyfieldcallback(pb_ostream_t *stream, const pb_field_t *field, void * co
     return pb_encode_varint(stream, *state);
 }
 
+bool bigfieldcallback(pb_ostream_t *stream, const pb_field_t *field, void * const *arg)
+{
+    /* Writes 203 bytes and counts the calls. */
+    pb_byte_t data[200];
+    int *calls = (int*)*arg;
+    (*calls)++;
+    memset(data, 'x', sizeof(data));
+    if (!pb_encode_tag_for_field(stream, field))
+        return false;
+    return pb_encode_string(stream, data, sizeof(data));
+}
+
 /* Check that expression x writes data y.
  * Y is a string, which may contain null bytes. Null terminator is ignored.
  */
@@ -84,6 +96,35 @@ int main()
         TEST(WRITES(pb_encode_varint(&s, UINT32_MAX), "\xFF\xFF\xFF\xFF\x0F"));
         TEST(WRITES(pb_encode_varint(&s, UINT64_MAX), "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"));
     }
+
+    {
+        COMMENT("Test pb_varint_size")
+        TEST(pb_varint_size(0) == 1)
+        TEST(pb_varint_size(0x7F) == 1)
+        TEST(pb_varint_size(0x80) == 2)
+        TEST(pb_varint_size(0x3FFF) == 2)
+        TEST(pb_varint_size(0x4000) == 3)
+        TEST(pb_varint_size(UINT32_MAX) == 5)
+        TEST(pb_varint_size((uint64_t)1 << 56) == 9)
+        TEST(pb_varint_size(UINT64_MAX) == 10)
+    }
+
+    {
+        uint8_t buffer[30];
+        pb_ostream_t s;
+        uint32_t value = 0x12345678;
+
+        COMMENT("Test writing at the end of a buffer")
+        s = pb_ostream_from_buffer(buffer, 2);
+        TEST(pb_encode_varint(&s, 0x80) && s.bytes_written == 2)
+        TEST(!pb_encode_varint(&s, 0))
+        s = pb_ostream_from_buffer(buffer, 1);
+        TEST(!pb_encode_varint(&s, 0x80))
+        s = pb_ostream_from_buffer(buffer, 4);
+        TEST(pb_encode_fixed32(&s, &value) && memcmp(buffer, "\x78\x56\x34\x12", 4) == 0)
+        s = pb_ostream_from_buffer(buffer, 3);
+        TEST(!pb_encode_fixed32(&s, &value))
+    }
     
     {
         uint8_t buffer[30];
@@ -207,6 +248,21 @@ int main()
         TEST(!pb_encode(&s, IntegerArray_fields, &msg))
     }
     
+    {
+        uint8_t buffer[20];
+        pb_ostream_t s;
+        IntegerArray msg = {3, {1, -1, 300}};
+        
+        COMMENT("Test pb_encode with packed array of varying lengths")
+        TEST(WRITES(pb_encode(&s, IntegerArray_fields, &msg),
+                    "\x0A\x0D\x01\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01\xAC\x02"))
+        
+        /* Array does not fit */
+        s = pb_ostream_from_buffer(buffer, 14);
+        TEST(!pb_encode(&s, IntegerArray_fields, &msg))
+        TEST(s.bytes_written <= 14)
+    }
+    
     {
         uint8_t buffer[10];
         pb_ostream_t s;
@@ -317,7 +373,55 @@ int main()
         state = 1;
         TEST(!pb_encode(&s, CallbackContainerContainer_fields, &msg2))
     }
-    
+
+    {
+        uint8_t buffer[200];
+        pb_ostream_t s;
+        IntegerContainer msg = {{5, {1,2,3,4,5}}};
+
+        COMMENT("Test single-pass submessage encoding into a large buffer.")
+        s = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_encode(&s, IntegerContainer_fields, &msg) && s.bytes_written == 9)
+        TEST(memcmp(buffer, "\x0A\x07\x0A\x05\x01\x02\x03\x04\x05", 9) == 0)
+
+        /* Exactly fitting buffer */
+        s = pb_ostream_from_buffer(buffer, 9);
+        TEST(pb_encode(&s, IntegerContainer_fields, &msg) && s.bytes_written == 9)
+
+        /* One byte short */
+        s = pb_ostream_from_buffer(buffer, 8);
+        TEST(!pb_encode(&s, IntegerContainer_fields, &msg))
+    }
+
+    {
+        uint8_t buffer[256];
+        pb_ostream_t s;
+        CallbackContainer msg;
+        CallbackContainerContainer msg2;
+        int calls = 0;
+
+        msg.submsg.data.funcs.encode = &bigfieldcallback;
+        msg.submsg.data.arg = &calls;
+        msg2.submsg.submsg.data.funcs.encode = &bigfieldcallback;
+        msg2.submsg.submsg.data.arg = &calls;
+
+        COMMENT("Test single-pass encoding of submessages with a 2-byte length.")
+        s = pb_ostream_from_buffer(buffer, 206);
+        TEST(pb_encode(&s, CallbackContainer_fields, &msg) && s.bytes_written == 206)
+        TEST(memcmp(buffer, "\x0A\xCB\x01\x08\xC8\x01xx", 8) == 0 && buffer[205] == 'x')
+        TEST(calls == 1)
+
+        s = pb_ostream_from_buffer(buffer, 209);
+        TEST(pb_encode(&s, CallbackContainerContainer_fields, &msg2) && s.bytes_written == 209)
+        TEST(memcmp(buffer, "\x0A\xCE\x01\x0A\xCB\x01\x08\xC8\x01xx", 11) == 0)
+        TEST(calls == 2)
+
+        /* No room for the longer length, fails without calling again */
+        s = pb_ostream_from_buffer(buffer, 205);
+        TEST(!pb_encode(&s, CallbackContainer_fields, &msg))
+        TEST(calls == 3)
+    }
+
     {
         uint8_t buffer[StringMessage_size];
         pb_ostream_t s;
@@ -0,0 +1,99 @@
+/* Checks the error code, offset and field path reported in pb_errctx_t. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_decode.h>
+#include "error_context.pb.h"
+#include "unittests.h"
+
+static bool decode(const pb_byte_t *buf, size_t size, pb_errctx_t *ctx)
+{
+    Outer msg;
+    pb_istream_t stream = pb_istream_from_buffer(buf, size);
+    pb_istream_set_errctx(&stream, ctx);
+    return pb_decode(&stream, Outer_fields, &msg);
+}
+
+int main()
+{
+    int status = 0;
+    
+    {
+        /* x = 1, mid.inner = {a = 1, s = "0123456789"}, x = 2 */
+        const pb_byte_t buf[] = {0x08, 0x01, 0x1A, 0x10, 0x3A, 0x0E,
+                                 0x08, 0x01, 0x12, 0x0A, '0', '1', '2', '3',
+                                 '4', '5', '6', '7', '8', '9', 0x08, 0x02};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test string overflow in nested message");
+        TEST(!decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_OVERFLOW)
+        TEST(ctx.offset == 10)
+        TEST(ctx.depth == 3)
+        TEST(ctx.path[0] == 2 && ctx.path[1] == 7 && ctx.path[2] == 3)
+    }
+    
+    {
+        /* x sent as fixed64, which does not parse as a varint */
+        const pb_byte_t buf[] = {0x09, 0xFF, 0xFF, 0xFF, 0xFF,
+                                 0xFF, 0xFF, 0xFF, 0xFF};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test wrong wire type");
+        TEST(!decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_WRONG_WIRE_TYPE)
+        TEST(ctx.expected_wire_type == PB_WT_VARINT)
+        TEST(ctx.actual_wire_type == PB_WT_64BIT)
+        TEST(ctx.offset == 9)
+        TEST(ctx.depth == 1 && ctx.path[0] == 1)
+    }
+    
+    {
+        /* x sent as fixed32 happens to decode, same as without context */
+        const pb_byte_t buf[] = {0x0D, 0x01, 0x00, 0x00, 0x00};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test wrong wire type that decodes");
+        TEST(decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_NONE)
+    }
+    
+    {
+        /* x = 1, then a truncated varint for x */
+        const pb_byte_t buf[] = {0x08, 0x01, 0x08, 0x81};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test truncated input");
+        TEST(!decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_EOF)
+        TEST(ctx.offset == 4)
+        TEST(ctx.depth == 1 && ctx.path[0] == 1)
+    }
+    
+    {
+        /* mid.inner = {}, which lacks the required field a */
+        const pb_byte_t buf[] = {0x1A, 0x02, 0x3A, 0x00, 0x08, 0x05};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test missing required field in nested message");
+        TEST(!decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_MISSING_REQUIRED)
+        TEST(ctx.offset == 4)
+        TEST(ctx.depth == 2 && ctx.path[0] == 7 && ctx.path[1] == 3)
+    }
+    
+    {
+        const pb_byte_t buf[] = {0x08, 0x01, 0x1A, 0x04, 0x3A, 0x02, 0x08, 0x01};
+        pb_errctx_t ctx;
+        
+        COMMENT("Test that successful decoding leaves context empty");
+        TEST(decode(buf, sizeof(buf), &ctx))
+        TEST(ctx.code == PB_ERR_NONE)
+        TEST(ctx.depth == 0)
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
@@ -0,0 +1,55 @@
+/* Checks that the generated functions encode field numbers above 2^28
+ * the same as pb_encode(). Compiled with PB_FIELD_32BIT. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "large_tags.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    LargeTags msg = LargeTags_init_zero;
+    LargeTags decoded = LargeTags_init_zero;
+    uint8_t expected[64], buffer[64];
+    pb_ostream_t stream;
+    pb_istream_t istream;
+    size_t size;
+    
+    msg.small = 1;
+    msg.has_large = true;
+    msg.large = 8;
+    msg.has_largest = true;
+    strcpy(msg.largest, "max");
+    msg.values_count = 2;
+    msg.values[0] = -1;
+    msg.values[1] = 1;
+    
+    stream = pb_ostream_from_buffer(expected, sizeof(expected));
+    TEST(pb_encode(&stream, LargeTags_fields, &msg))
+    size = stream.bytes_written;
+    
+    COMMENT("Test encoding large field numbers")
+    /* Tag of field 268435456 with varint wire type */
+    TEST(memcmp(expected + 2, "\x80\x80\x80\x80\x08\x08", 6) == 0)
+    stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    TEST(LargeTags_encode(&stream, &msg))
+    TEST(stream.bytes_written == size)
+    TEST(memcmp(buffer, expected, size) == 0)
+    TEST(LargeTags_get_encoded_size(&size, &msg))
+    TEST(size == stream.bytes_written)
+    
+    COMMENT("Test decoding large field numbers")
+    istream = pb_istream_from_buffer(buffer, size);
+    TEST(LargeTags_decode(&istream, &decoded))
+    TEST(decoded.has_large && decoded.large == 8)
+    TEST(decoded.has_largest && strcmp(decoded.largest, "max") == 0)
+    TEST(decoded.values_count == 2 && decoded.values[0] == -1)
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
@@ -0,0 +1,161 @@
+/* Checks that messages with the has_bitmap option encode and decode the
+ * same way as messages with separate has_ flags. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "has_bitmap.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    Flags flags = Flags_init_zero;
+    Bitmap bitmap = Bitmap_init_zero;
+    uint8_t expected[512];
+    size_t expected_size;
+
+    flags.req = 5;
+    bitmap.req = 5;
+    flags.has_str = true;
+    strcpy(flags.str, "abc");
+    PB_SET_BIT(bitmap.has_bits, Bitmap_str_hasbit);
+    strcpy(bitmap.str, "abc");
+    flags.values_count = 2;
+    flags.values[1] = -3;
+    bitmap.values_count = 2;
+    bitmap.values[1] = -3;
+    flags.p3 = 6;
+    bitmap.p3 = 6;
+    flags.has_opt31 = true;
+    flags.opt31 = 31;
+    PB_SET_BIT(bitmap.has_bits, Bitmap_opt31_hasbit);
+    bitmap.opt31 = 31;
+    flags.has_opt36 = true;
+    flags.opt36 = 36;
+    PB_SET_BIT(bitmap.has_bits, Bitmap_opt36_hasbit);
+    bitmap.opt36 = 36;
+    flags.which_choice = Flags_c_sub_tag;
+    flags.choice.c_sub.a = 1;
+    bitmap.which_choice = Bitmap_c_sub_tag;
+    bitmap.choice.c_sub.a = 1;
+    flags.has_last = true;
+    flags.last = 1.5;
+    PB_SET_BIT(bitmap.has_bits, Bitmap_last_hasbit);
+    bitmap.last = 1.5;
+
+    /* Values of unset fields must not be encoded */
+    bitmap.opt8 = 8;
+    bitmap.opt47 = 47;
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Flags_fields, &flags))
+        expected_size = stream.bytes_written;
+    }
+
+    {
+        uint8_t buffer[512];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test encoding of sparse fields")
+        TEST(pb_encode(&stream, Bitmap_fields, &bitmap))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+    }
+
+    {
+        uint8_t buffer[512];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test generated encoding function")
+        TEST(Bitmap_encode(&stream, &bitmap))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+    }
+
+    {
+        Bitmap decoded;
+        pb_istream_t stream = pb_istream_from_buffer(expected, expected_size);
+
+        memset(&decoded, 0xFF, sizeof(decoded));
+
+        COMMENT("Test decoding sets the has bits and clears the others")
+        TEST(pb_decode(&stream, Bitmap_fields, &decoded))
+        TEST(decoded.req == 5)
+        TEST(PB_HAS_BIT(decoded.has_bits, Bitmap_str_hasbit))
+        TEST(strcmp(decoded.str, "abc") == 0)
+        TEST(PB_HAS_BIT(decoded.has_bits, Bitmap_opt31_hasbit) && decoded.opt31 == 31)
+        TEST(PB_HAS_BIT(decoded.has_bits, Bitmap_opt36_hasbit) && decoded.opt36 == 36)
+        TEST(PB_HAS_BIT(decoded.has_bits, Bitmap_last_hasbit) && decoded.last == 1.5)
+        TEST(!PB_HAS_BIT(decoded.has_bits, Bitmap_sub_hasbit))
+        TEST(!PB_HAS_BIT(decoded.has_bits, Bitmap_opt8_hasbit) && decoded.opt8 == 0)
+        TEST(!PB_HAS_BIT(decoded.has_bits, Bitmap_dflt_hasbit) && decoded.dflt == 42)
+        TEST(decoded.has_bits[0] == ((uint32_t)1 << Bitmap_str_hasbit | (uint32_t)1 << Bitmap_opt31_hasbit))
+        TEST((decoded.has_bits[1] & (((uint32_t)2 << (Bitmap_last_hasbit - 32)) - 1)) ==
+             ((uint32_t)1 << (Bitmap_opt36_hasbit - 32) | (uint32_t)1 << (Bitmap_last_hasbit - 32)))
+        TEST(decoded.which_choice == Bitmap_c_sub_tag && decoded.choice.c_sub.a == 1)
+        TEST(!PB_HAS_BIT(decoded.choice.c_sub.has_bits, Sub_b_hasbit))
+    }
+
+    {
+        Bitmap decoded = Bitmap_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(expected, expected_size);
+
+        COMMENT("Test generated decoding function")
+        TEST(Bitmap_decode(&stream, &decoded))
+        TEST(decoded.has_bits[0] == bitmap.has_bits[0])
+        TEST(decoded.has_bits[1] == bitmap.has_bits[1])
+        TEST(decoded.opt36 == 36)
+    }
+
+    {
+        uint8_t buffer[512];
+        Bitmap all = Bitmap_init_default;
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+        COMMENT("Test encoding with all has bits set")
+        all.has_bits[0] = 0xFFFFFFFF;
+        all.has_bits[1] = ((uint32_t)2 << (Bitmap_last_hasbit - 32)) - 1;
+        TEST(pb_encode(&stream, Bitmap_fields, &all))
+
+        {
+            Flags decoded;
+            pb_istream_t istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+            TEST(pb_decode(&istream, Flags_fields, &decoded))
+            TEST(decoded.has_sub && decoded.has_fixed && decoded.has_opt8)
+            TEST(decoded.has_opt47 && decoded.has_last && decoded.dflt == 42)
+        }
+    }
+
+    {
+        uint8_t buffer1[512], buffer2[512];
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+        /* The repeated and proto3 fields between the set bits are
+         * not in the has_bits array. */
+        COMMENT("Test skipping over fields without has bits")
+        flags.has_str = false;
+        PB_CLEAR_BIT(bitmap.has_bits, Bitmap_str_hasbit);
+        flags.has_sub = true;
+        PB_SET_BIT(bitmap.has_bits, Bitmap_sub_hasbit);
+        flags.has_dflt = true;
+        flags.dflt = 7;
+        PB_SET_BIT(bitmap.has_bits, Bitmap_dflt_hasbit);
+        bitmap.dflt = 7;
+        flags.has_opt47 = true;
+        flags.opt47 = 47;
+        PB_SET_BIT(bitmap.has_bits, Bitmap_opt47_hasbit);
+        TEST(pb_encode(&stream1, Flags_fields, &flags))
+        TEST(pb_encode(&stream2, Bitmap_fields, &bitmap))
+        TEST(stream1.bytes_written == stream2.bytes_written)
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
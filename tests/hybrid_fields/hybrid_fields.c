@@ -0,0 +1,226 @@
+/* Checks that hybrid fields store small values inline, move larger values
+ * to the heap when PB_ENABLE_MALLOC is defined, and encode the same as
+ * static fields. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "hybrid_fields.pb.h"
+#include "unittests.h"
+
+/* Fill in a message with count values, and fewer of the other entries. */
+static void fill_plain(Plain *plain, pb_size_t count)
+{
+    pb_size_t i;
+
+    memset(plain->name, 'n', count * 3);
+    plain->name[count * 3] = '\0';
+    plain->has_data = true;
+    plain->data.size = (pb_size_t)(count + 1);
+    for (i = 0; i < plain->data.size; i++)
+        plain->data.bytes[i] = (pb_byte_t)(i + 1);
+    plain->values_count = count;
+    for (i = 0; i < count; i++)
+        plain->values[i] = (int32_t)(i * 100 - 200);
+    plain->points_count = (pb_size_t)(count / 2);
+    for (i = 0; i < plain->points_count; i++)
+    {
+        plain->points[i].x = (int32_t)i;
+        plain->points[i].has_label = true;
+        strcpy(plain->points[i].label, "point");
+        plain->points[i].label[4] = (char)('a' + i);
+    }
+    plain->tags_count = (pb_size_t)(count / 2);
+    for (i = 0; i < plain->tags_count; i++)
+    {
+        strcpy(plain->tags[i], "tag");
+        plain->tags[i][2] = (char)('a' + i);
+    }
+    plain->has_after = true;
+    plain->after = 1234;
+    plain->note.size = (pb_size_t)(count / 2);
+    memset(plain->note.bytes, 0xAA, plain->note.size);
+}
+
+static size_t encode_plain(const Plain *plain, uint8_t *buffer, size_t size)
+{
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, size);
+    if (!pb_encode(&stream, Plain_fields, plain))
+        return 0;
+    return stream.bytes_written;
+}
+
+/* Encode the message and check that the output matches expected. */
+static bool encodes_as(const Hybrid *msg, const uint8_t *expected, size_t size)
+{
+    uint8_t buffer[256];
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+    if (!pb_encode(&stream, Hybrid_fields, msg))
+    {
+        fprintf(stderr, "Encode failed: %s\n", PB_GET_ERROR(&stream));
+        return false;
+    }
+
+    return stream.bytes_written == size && memcmp(buffer, expected, size) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    uint8_t buffer[256];
+    size_t size;
+
+    {
+        Hybrid msg = Hybrid_init_default;
+        Plain plain = Plain_init_zero;
+        pb_istream_t stream;
+
+        COMMENT("Test default values")
+        TEST(!msg.has_data && msg.data.size == 2 && memcmp(msg.data.bytes, "ab", 2) == 0)
+        TEST(msg.data.spill == NULL && msg.values.spill == NULL)
+
+        COMMENT("Test inline storage")
+        fill_plain(&plain, 2);
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        TEST(size > 0)
+        msg.values_count = 5;
+        stream = pb_istream_from_buffer(buffer, size);
+        TEST(pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(msg.name.size == 6 && msg.name.spill == NULL)
+        TEST(memcmp(PB_HYBRID_BYTES(msg.name), "nnnnnn", 6) == 0)
+        TEST(msg.has_data && msg.data.size == 3 && msg.data.spill == NULL)
+        TEST(msg.values_count == 2 && msg.values.spill == NULL)
+        TEST(msg.values.items[1] == -100)
+        TEST(msg.points_count == 1 && msg.points.spill == NULL)
+        TEST(strcmp(msg.points.items[0].label, "poina") == 0)
+        TEST(msg.tags_count == 1 && msg.tags.spill == NULL)
+        TEST(strcmp(PB_HYBRID_ITEMS(msg.tags, msg.tags_count)[0], "taa") == 0)
+        TEST(msg.has_after && msg.after == 1234)
+        TEST(msg.note.size == 1 && msg.note.spill == NULL)
+        TEST(encodes_as(&msg, buffer, size))
+    }
+
+    {
+        Hybrid msg = Hybrid_init_zero;
+        Plain plain = Plain_init_zero;
+        int32_t values[6];
+        char name[18];
+        pb_size_t i;
+
+        COMMENT("Test encoding from spill storage set by the application")
+        fill_plain(&plain, 6);
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        TEST(size > 0)
+        memset(name, 'n', sizeof(name));
+        msg.name.size = sizeof(name);
+        msg.name.spill = name;
+        msg.has_data = true;
+        msg.data.size = 7;
+        msg.data.spill = plain.data.bytes;
+        msg.values_count = 6;
+        msg.values.spill = values;
+        for (i = 0; i < 6; i++)
+            values[i] = plain.values[i];
+        msg.points_count = 3;
+        msg.points.spill = plain.points;
+        msg.tags_count = 3;
+        msg.tags.spill = plain.tags;
+        msg.has_after = true;
+        msg.after = 1234;
+        msg.note.size = 3;
+        msg.note.spill = plain.note.bytes;
+        TEST(encodes_as(&msg, buffer, size))
+
+        {
+            pb_ostream_t stream = PB_OSTREAM_SIZING;
+            msg.values.spill = NULL;
+            TEST(!pb_encode(&stream, Hybrid_fields, &msg))
+            TEST(strcmp(PB_GET_ERROR(&stream), "array max size exceeded") == 0)
+        }
+    }
+
+#ifdef PB_ENABLE_MALLOC
+    {
+        Hybrid msg = Hybrid_init_zero;
+        Plain plain = Plain_init_zero;
+        pb_istream_t stream;
+
+        COMMENT("Test spilling to the heap")
+        fill_plain(&plain, 7);
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        TEST(size > 0)
+        stream = pb_istream_from_buffer(buffer, size);
+        TEST(pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(msg.name.size == 21 && msg.name.spill != NULL)
+        TEST(memcmp(PB_HYBRID_BYTES(msg.name), plain.name, 21) == 0)
+        TEST(msg.data.size == 8 && memcmp(msg.data.spill, plain.data.bytes, 8) == 0)
+        TEST(msg.values_count == 7 && msg.values.spill != NULL)
+        TEST(PB_HYBRID_ITEMS(msg.values, msg.values_count)[0] == -200)
+        TEST(PB_HYBRID_ITEMS(msg.values, msg.values_count)[6] == 400)
+        TEST(msg.points_count == 3 && msg.points.spill[2].x == 2)
+        TEST(strcmp(msg.points.spill[2].label, "poinc") == 0)
+        TEST(msg.tags_count == 3 && strcmp(msg.tags.spill[0], "taa") == 0)
+        TEST(strcmp(msg.tags.spill[2], "tac") == 0)
+        TEST(msg.after == 1234)
+        TEST(msg.note.size == 3 && msg.note.spill != NULL)
+        TEST(encodes_as(&msg, buffer, size))
+
+        COMMENT("Test releasing the spill allocations")
+        pb_release(Hybrid_fields, &msg);
+        TEST(msg.name.spill == NULL && msg.name.size == 0)
+        TEST(msg.values.spill == NULL && msg.values_count == 0)
+        TEST(msg.points.spill == NULL && msg.tags.spill == NULL)
+        TEST(msg.after == 1234)
+    }
+
+    {
+        /* Field 3 as unpacked entries 1 to 9, then field 6 = 1 */
+        const uint8_t input[] = {0x0A, 0x00,
+                                 0x18, 0x01, 0x18, 0x02, 0x18, 0x03, 0x18, 0x04, 0x18, 0x05,
+                                 0x18, 0x06, 0x18, 0x07, 0x18, 0x08, 0x18, 0x09,
+                                 0x30, 0x01};
+        Hybrid msg = Hybrid_init_zero;
+        pb_istream_t stream = pb_istream_from_buffer(input, sizeof(input));
+
+        COMMENT("Test growing the spill allocation")
+        TEST(pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(msg.values_count == 9 && msg.values.spill[0] == 1 && msg.values.spill[8] == 9)
+        TEST(msg.after == 1)
+        stream = pb_istream_from_buffer(input, 6);
+        TEST(pb_decode_noinit(&stream, Hybrid_fields, &msg))
+        TEST(msg.values_count == 11 && msg.values.spill[10] == 2)
+        pb_release(Hybrid_fields, &msg);
+        TEST(msg.values.spill == NULL)
+    }
+#else
+    {
+        Hybrid msg = Hybrid_init_zero;
+        Plain plain = Plain_init_zero;
+        pb_istream_t stream;
+
+        COMMENT("Test overflow without malloc support")
+        fill_plain(&plain, 5);
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        stream = pb_istream_from_buffer(buffer, size);
+        TEST(!pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(strcmp(PB_GET_ERROR(&stream), "bytes overflow") == 0)
+        plain.name[8] = '\0';
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        stream = pb_istream_from_buffer(buffer, size);
+        TEST(!pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(strcmp(PB_GET_ERROR(&stream), "bytes overflow") == 0)
+        plain.has_data = false;
+        size = encode_plain(&plain, buffer, sizeof(buffer));
+        stream = pb_istream_from_buffer(buffer, size);
+        TEST(!pb_decode(&stream, Hybrid_fields, &msg))
+        TEST(strcmp(PB_GET_ERROR(&stream), "array overflow") == 0)
+    }
+#endif
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
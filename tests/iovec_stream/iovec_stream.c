@@ -0,0 +1,172 @@
+/* Checks that a message split into segments at every possible position
+ * decodes the same as the contiguous message. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "iovec_stream.pb.h"
+#include "unittests.h"
+
+/* Decode from the segments and check that the message encodes to the
+ * original data. */
+static bool decodes_same(const pb_iovec_t *iov, size_t count,
+                         const pb_byte_t *expected, size_t size)
+{
+    pb_iovec_reader_t reader;
+    pb_istream_t istream = pb_istream_from_iovec(&reader, iov, count);
+    pb_byte_t buffer[256];
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    Packet msg;
+
+    if (istream.bytes_left != size || !pb_decode(&istream, Packet_fields, &msg))
+        return false;
+
+    return pb_encode(&ostream, Packet_fields, &msg) &&
+           ostream.bytes_written == size &&
+           memcmp(buffer, expected, size) == 0;
+}
+
+int main()
+{
+    int status = 0;
+    Packet msg = Packet_init_zero;
+    pb_byte_t data[256];
+    size_t size;
+    pb_size_t i;
+
+    msg.seq = 300;
+    msg.has_offset = true;
+    msg.offset = -1234567890123LL;
+    msg.has_stamp = true;
+    msg.stamp = 0x0102030405060708ULL;
+    msg.entries_count = 3;
+    for (i = 0; i < 3; i++)
+    {
+        msg.entries[i].key = (uint64_t)1 << (20 * i);
+        msg.entries[i].has_value = true;
+        strcpy(msg.entries[i].value, "a value string");
+    }
+    msg.has_data = true;
+    msg.data.size = 40;
+    for (i = 0; i < 40; i++)
+        msg.data.bytes[i] = (pb_byte_t)(255 - i);
+    msg.values_count = 5;
+    for (i = 0; i < 5; i++)
+        msg.values[i] = -(int32_t)i * 100000;
+    msg.has_unknown = true;
+    msg.unknown.key = 1;
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(data, sizeof(data));
+        TEST(pb_encode(&stream, Packet_fields, &msg))
+        size = stream.bytes_written;
+    }
+
+    {
+        pb_iovec_t iov[1];
+        iov[0].base = data;
+        iov[0].size = size;
+
+        COMMENT("Test single segment")
+        TEST(decodes_same(iov, 1, data, size))
+    }
+
+    {
+        pb_iovec_t iov[4];
+        size_t split;
+        bool ok = true;
+
+        COMMENT("Test two segments, split at every position")
+        for (split = 0; split <= size; split++)
+        {
+            iov[0].base = data;
+            iov[0].size = split;
+            iov[1].base = data + split;
+            iov[1].size = size - split;
+            ok = ok && decodes_same(iov, 2, data, size);
+        }
+        TEST(ok)
+
+        COMMENT("Test with empty segments")
+        iov[0].base = data;
+        iov[0].size = 0;
+        iov[1].base = data;
+        iov[1].size = 5;
+        iov[2].base = data + 5;
+        iov[2].size = 0;
+        iov[3].base = data + 5;
+        iov[3].size = size - 5;
+        TEST(decodes_same(iov, 4, data, size))
+    }
+
+    {
+        pb_iovec_t iov[256];
+        size_t n;
+
+        COMMENT("Test one byte segments")
+        for (n = 0; n < size; n++)
+        {
+            iov[n].base = data + n;
+            iov[n].size = 1;
+        }
+        TEST(decodes_same(iov, size, data, size))
+    }
+
+    {
+        /* The message starts near the end of a ring buffer and wraps
+         * around to the beginning. */
+        pb_byte_t ring[200];
+        size_t start = sizeof(ring) - 50;
+        pb_iovec_t iov[2];
+
+        COMMENT("Test ring buffer wrap-around")
+        memset(ring, 0xAA, sizeof(ring));
+        memcpy(ring + start, data, 50);
+        memcpy(ring, data + 50, size - 50);
+        iov[0].base = ring + start;
+        iov[0].size = 50;
+        iov[1].base = ring;
+        iov[1].size = size - 50;
+        TEST(decodes_same(iov, 2, data, size))
+    }
+
+    {
+        pb_iovec_t iov[3];
+        pb_iovec_reader_t reader;
+        pb_istream_t stream;
+        Header header;
+
+        COMMENT("Test skipping fields across segments")
+        iov[0].base = data;
+        iov[0].size = 7;
+        iov[1].base = data + 7;
+        iov[1].size = 60;
+        iov[2].base = data + 67;
+        iov[2].size = size - 67;
+        stream = pb_istream_from_iovec(&reader, iov, 3);
+        TEST(pb_decode(&stream, Header_fields, &header))
+        TEST(header.seq == 300)
+        TEST(stream.bytes_left == 0)
+    }
+
+    {
+        pb_iovec_t iov[2];
+        pb_iovec_reader_t reader;
+        pb_istream_t stream;
+        Packet decoded;
+
+        COMMENT("Test truncated message")
+        iov[0].base = data;
+        iov[0].size = 10;
+        iov[1].base = data + 10;
+        iov[1].size = size - 20;
+        stream = pb_istream_from_iovec(&reader, iov, 2);
+        TEST(!pb_decode(&stream, Packet_fields, &decoded))
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,129 @@
+/* Checks that messages with reordered struct members are smaller and
+ * remain compatible on the wire with the declaration ordered ones. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "minimize_padding.pb.h"
+#include "unittests.h"
+
+int main()
+{
+    int status = 0;
+    Plain plain = Plain_init_zero;
+    Reordered reordered = Reordered_init_default;
+    uint8_t buffer[256];
+    size_t size;
+
+    COMMENT("Test struct layout")
+    TEST(sizeof(Reordered) < sizeof(Plain))
+    TEST(offsetof(Reordered, hot_id) == 0)
+    TEST(offsetof(Reordered, hot_count) < offsetof(Reordered, big))
+    TEST(offsetof(Reordered, has_hot_count) < offsetof(Reordered, big))
+    TEST(offsetof(Reordered, req) > offsetof(Reordered, choice))
+    TEST(reordered.value == 2.5 && !reordered.has_value)
+    TEST(reordered.stamps_count == 0 && reordered.which_choice == 0)
+    TEST(sizeof(HotBitmap) == 24)
+    TEST(offsetof(HotBitmap, d) == 0 && offsetof(HotBitmap, r2) == 16)
+
+    plain.has_flag = true;
+    plain.flag = true;
+    plain.has_big = true;
+    plain.big = -1234567890123LL;
+    plain.has_hot_id = true;
+    plain.hot_id = 77;
+    plain.has_small = true;
+    plain.small = -5;
+    plain.stamps_count = 2;
+    plain.stamps[0] = 1;
+    plain.stamps[1] = 2;
+    plain.has_name = true;
+    strcpy(plain.name, "abcd");
+    plain.has_data = true;
+    plain.data.size = 2;
+    plain.data.bytes[1] = 9;
+    plain.has_sub = true;
+    plain.sub.has_a = true;
+    plain.sub.a = 3;
+    plain.which_choice = Plain_c_double_tag;
+    plain.choice.c_double = 0.5;
+    plain.req = 1000;
+    plain.has_hot_count = true;
+    plain.hot_count = 12;
+
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        TEST(pb_encode(&stream, Plain_fields, &plain))
+        size = stream.bytes_written;
+    }
+
+    {
+        pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+
+        COMMENT("Test decoding into the reordered struct")
+        TEST(pb_decode(&stream, Reordered_fields, &reordered))
+        TEST(reordered.has_flag && reordered.flag)
+        TEST(reordered.has_big && reordered.big == -1234567890123LL)
+        TEST(reordered.has_hot_id && reordered.hot_id == 77)
+        TEST(reordered.has_small && reordered.small == -5)
+        TEST(!reordered.has_value && reordered.value == 2.5)
+        TEST(reordered.stamps_count == 2 && reordered.stamps[1] == 2)
+        TEST(reordered.has_name && strcmp(reordered.name, "abcd") == 0)
+        TEST(reordered.has_data && reordered.data.size == 2 && reordered.data.bytes[1] == 9)
+        TEST(reordered.has_sub && reordered.sub.a == 3)
+        TEST(reordered.which_choice == Reordered_c_double_tag && reordered.choice.c_double == 0.5)
+        TEST(reordered.req == 1000)
+        TEST(reordered.has_hot_count && reordered.hot_count == 12)
+    }
+
+    {
+        uint8_t buffer2[256];
+        uint8_t buffer3[256];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_ostream_t stream3 = pb_ostream_from_buffer(buffer3, sizeof(buffer3));
+        Plain decoded;
+
+        COMMENT("Test encoding of the reordered struct in tag order")
+        TEST(pb_encode(&stream, Reordered_fields, &reordered))
+        TEST(stream.bytes_written == size)
+        TEST(memcmp(buffer, buffer2, size) == 0)
+        TEST(Reordered_encode(&stream3, &reordered))
+        TEST(stream3.bytes_written == size)
+        TEST(memcmp(buffer2, buffer3, size) == 0)
+
+        {
+            pb_istream_t istream = pb_istream_from_buffer(buffer2, stream.bytes_written);
+            TEST(pb_decode(&istream, Plain_fields, &decoded))
+            TEST(decoded.has_big && decoded.big == plain.big)
+            TEST(decoded.has_hot_count && decoded.hot_count == 12)
+            TEST(decoded.which_choice == Plain_c_double_tag && decoded.choice.c_double == 0.5)
+            TEST(decoded.req == 1000 && strcmp(decoded.name, "abcd") == 0)
+        }
+    }
+
+    {
+        HotBitmap hot = HotBitmap_init_zero;
+        HotBitmap decoded = HotBitmap_init_zero;
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        pb_istream_t istream;
+
+        COMMENT("Test fields located before the previous one with has_bitmap")
+        hot.d = 1.5;
+        hot.a = 42;
+        PB_SET_BIT(hot.has_bits, HotBitmap_d_hasbit);
+        PB_SET_BIT(hot.has_bits, HotBitmap_a_hasbit);
+        TEST(pb_encode(&stream, HotBitmap_fields, &hot))
+        TEST(stream.bytes_written == 11 && buffer[0] == 0x09 && buffer[9] == 0x18)
+
+        istream = pb_istream_from_buffer(buffer, stream.bytes_written);
+        TEST(pb_decode(&istream, HotBitmap_fields, &decoded))
+        TEST(decoded.d == 1.5 && decoded.a == 42 && decoded.r2 == 0)
+        TEST(decoded.has_bits[0] == hot.has_bits[0])
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,152 @@
+/* Checks that messages written to a file with pb_ostream_to_mmap() are
+ * the same as with a buffer stream, and that they can be decoded with
+ * pb_istream_from_mmap(). The path of a temporary file is given as the
+ * argument. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_mmap.h>
+#include "mmap_stream.pb.h"
+#include "unittests.h"
+
+static void fill_snapshot(Snapshot *msg, pb_size_t count)
+{
+    pb_size_t i;
+
+    msg->has_timestamp = true;
+    msg->timestamp = (uint64_t)1234567890 * 1000;
+    msg->records_count = count;
+    for (i = 0; i < count; i++)
+    {
+        msg->records[i].id = (uint32_t)(i * 1000);
+        msg->records[i].has_payload = true;
+        msg->records[i].payload.size = (pb_size_t)(i % 48);
+        memset(msg->records[i].payload.bytes, (int)i, msg->records[i].payload.size);
+    }
+}
+
+/* Returns the size of the file, or -1 if it cannot be opened. */
+static long file_size(const char *path)
+{
+    long size;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+/* Write the message to the file, and check that the file contains the
+ * same data as a buffer stream. */
+static bool write_file(const char *path, const Snapshot *msg, size_t initial_size)
+{
+    static pb_byte_t buffer[4096], contents[4096];
+    pb_ostream_t bstream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    pb_ostream_t stream;
+    pb_mmap_file_t file;
+    FILE *f;
+    size_t size;
+
+    if (!pb_encode(&bstream, Snapshot_fields, msg))
+        return false;
+
+    if (!pb_ostream_to_mmap(&stream, &file, path, initial_size))
+        return false;
+
+    if (!pb_encode(&stream, Snapshot_fields, msg))
+    {
+        fprintf(stderr, "Encode failed: %s\n", PB_GET_ERROR(&stream));
+        pb_ostream_close_mmap(&file);
+        return false;
+    }
+
+    if (!pb_ostream_close_mmap(&file) || file.data != NULL)
+        return false;
+
+    if (file_size(path) != (long)bstream.bytes_written)
+        return false;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+    size = fread(contents, 1, sizeof(contents), f);
+    fclose(f);
+    return size == bstream.bytes_written && memcmp(contents, buffer, size) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int status = 0;
+    const char *path;
+    Snapshot msg = Snapshot_init_zero;
+    Snapshot decoded = Snapshot_init_zero;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: mmap_stream <temporary file>\n");
+        return 1;
+    }
+    path = argv[1];
+
+    COMMENT("Test writing with a large enough initial size")
+    fill_snapshot(&msg, 4);
+    TEST(write_file(path, &msg, 4096))
+
+    COMMENT("Test growing the file while writing")
+    fill_snapshot(&msg, 64);
+    TEST(write_file(path, &msg, 16))
+    TEST(write_file(path, &msg, 0))
+
+    {
+        pb_istream_t stream;
+        pb_mmap_file_t file;
+
+        COMMENT("Test decoding from the mapped file")
+        TEST(pb_istream_from_mmap(&stream, &file, path))
+        TEST(stream.bytes_left == (size_t)file_size(path))
+        TEST(pb_decode(&stream, Snapshot_fields, &decoded))
+        TEST(stream.bytes_left == 0)
+        pb_istream_close_mmap(&file);
+        TEST(file.data == NULL && file.fd == -1)
+        TEST(decoded.timestamp == msg.timestamp)
+        TEST(decoded.records_count == 64)
+        TEST(decoded.records[63].id == 63000)
+        TEST(decoded.records[47].payload.size == 47)
+        TEST(decoded.records[47].payload.bytes[46] == 47)
+    }
+
+    {
+        pb_ostream_t ostream;
+        pb_istream_t istream;
+        pb_mmap_file_t file;
+
+        COMMENT("Test empty file")
+        TEST(pb_ostream_to_mmap(&ostream, &file, path, 100))
+        TEST(pb_ostream_close_mmap(&file))
+        TEST(file_size(path) == 0)
+        TEST(pb_istream_from_mmap(&istream, &file, path))
+        TEST(istream.bytes_left == 0)
+        TEST(pb_decode(&istream, Snapshot_fields, &decoded))
+        TEST(!decoded.has_timestamp && decoded.records_count == 0)
+        pb_istream_close_mmap(&file);
+    }
+
+    {
+        pb_istream_t stream;
+        pb_mmap_file_t file;
+
+        COMMENT("Test missing file")
+        remove(path);
+        TEST(!pb_istream_from_mmap(&stream, &file, path))
+        TEST(file.fd == -1)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}
@@ -0,0 +1,106 @@
+/* Checks that pb_encode_cached() stores the submessage sizes in traversal
+ * order and produces the same output as pb_encode(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include "size_cache.pb.h"
+#include "unittests.h"
+
+/* Custom stream that writes to a memory buffer through a callback. */
+static bool write_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint8_t *dest = (uint8_t*)stream->state;
+    memcpy(dest, buf, count);
+    stream->state = dest + count;
+    return true;
+}
+
+static void fill_tree(Tree *msg, Leaf *ptr)
+{
+    memset(msg, 0, sizeof(Tree));
+    msg->has_x = true;
+    msg->x = 5;
+    msg->branch.leaves_count = 2;
+    msg->branch.leaves[0].a = 1;
+    msg->branch.leaves[1].a = 300;
+    strcpy(msg->branch.leaves[1].s, "hello");
+    msg->branch.leaves[1].has_s = true;
+    msg->branch.has_single = true;
+    msg->branch.single.a = -1;
+    msg->branches_count = 1;
+    msg->branches[0].leaves_count = 1;
+    msg->branches[0].leaves[0].a = 2;
+    
+    memset(ptr, 0, sizeof(Leaf));
+    ptr->a = 3;
+    msg->ptr = ptr;
+}
+
+int main()
+{
+    int status = 0;
+    Tree msg;
+    Leaf ptr;
+    uint8_t expected[256];
+    size_t expected_size;
+    
+    fill_tree(&msg, &ptr);
+    
+    {
+        pb_ostream_t stream = pb_ostream_from_buffer(expected, sizeof(expected));
+        TEST(pb_encode(&stream, Tree_fields, &msg))
+        expected_size = stream.bytes_written;
+    }
+    
+    {
+        uint8_t buffer[256];
+        size_t sizes[8];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        stream.callback = &write_callback;
+        
+        COMMENT("Test pb_encode_cached with a callback stream")
+        memset(sizes, 0, sizeof(sizes));
+        TEST(pb_encode_cached(&stream, Tree_fields, &msg, sizes, 8))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        TEST(stream.sizecache == NULL)
+        
+        /* branch, its two leaves and single, branches[0] and its leaf, ptr */
+        TEST(sizes[1] == 2 && sizes[2] == 10 && sizes[3] == 11)
+        TEST(sizes[0] == 2 + sizes[1] + 2 + sizes[2] + 2 + sizes[3])
+        TEST(sizes[5] == 2 && sizes[4] == 2 + sizes[5])
+        TEST(sizes[6] == 2 && sizes[7] == 0)
+    }
+    
+    {
+        uint8_t buffer[256];
+        size_t sizes[3];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        stream.callback = &write_callback;
+        
+        COMMENT("Test pb_encode_cached with too small cache")
+        TEST(pb_encode_cached(&stream, Tree_fields, &msg, sizes, 3))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+    }
+    
+    {
+        uint8_t buffer[256];
+        size_t sizes[8];
+        pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+        
+        COMMENT("Test pb_encode_cached with a buffer stream")
+        TEST(pb_encode_cached(&stream, Tree_fields, &msg, sizes, 8))
+        TEST(stream.bytes_written == expected_size)
+        TEST(memcmp(buffer, expected, expected_size) == 0)
+        
+        stream = pb_ostream_from_buffer(buffer, expected_size - 1);
+        TEST(!pb_encode_cached(&stream, Tree_fields, &msg, sizes, 8))
+    }
+    
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+    
+    return status;
+}
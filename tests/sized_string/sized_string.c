@@ -0,0 +1,105 @@
+/* Checks that strings with the sized_string option encode the same as
+ * null-terminated strings, and that they can use the whole max_size. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "sized_string.pb.h"
+#include "unittests.h"
+
+#define SET_STRING(dest, str) \
+    (memcpy((dest).bytes, str, sizeof(str) - 1), (dest).size = sizeof(str) - 1)
+
+int main()
+{
+    int status = 0;
+    Names names = Names_init_default;
+    PlainNames plain = PlainNames_init_default;
+    uint8_t buffer1[128], buffer2[128];
+    size_t size;
+
+    COMMENT("Test default values")
+    TEST(names.last.size == 5 && memcmp(names.last.bytes, "Smith", 5) == 0)
+    TEST(names.first.size == 0)
+    TEST(names.city.size == 7 && memcmp(names.city.bytes, "Z\xc3\xbcrich", 7) == 0)
+    TEST(strcmp(plain.city, "Z\xc3\xbcrich") == 0)
+
+    SET_STRING(names.first, "Exactly16Letters");
+    strcpy(plain.first, "Exactly16Letters");
+    names.has_last = plain.has_last = true;
+    names.aliases_count = plain.aliases_count = 2;
+    SET_STRING(names.aliases[0], "ab");
+    strcpy(plain.aliases[0], "ab");
+    SET_STRING(names.aliases[1], "");
+    strcpy(plain.aliases[1], "");
+    names.which_contact = Names_email_tag;
+    plain.which_contact = PlainNames_email_tag;
+    SET_STRING(names.contact.email, "someone@example.com");
+    strcpy(plain.contact.email, "someone@example.com");
+
+    {
+        pb_ostream_t stream1 = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_ostream_t stream2 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+
+        COMMENT("Test encoding")
+        TEST(pb_encode(&stream1, Names_fields, &names))
+        TEST(pb_encode(&stream2, PlainNames_fields, &plain))
+        TEST(stream1.bytes_written == stream2.bytes_written)
+        TEST(memcmp(buffer1, buffer2, stream1.bytes_written) == 0)
+        size = stream1.bytes_written;
+
+        /* The proto3 field is written only when non-empty */
+        SET_STRING(names.note, "n");
+        stream1 = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        TEST(pb_encode(&stream1, Names_fields, &names))
+        TEST(stream1.bytes_written == size + 3)
+        names.note.size = 0;
+    }
+
+    {
+        Names decoded;
+        pb_istream_t stream = pb_istream_from_buffer(buffer1, size);
+
+        COMMENT("Test decoding")
+        TEST(pb_decode(&stream, Names_fields, &decoded))
+        TEST(decoded.first.size == 16 && memcmp(decoded.first.bytes, "Exactly16Letters", 16) == 0)
+        TEST(decoded.has_last && decoded.last.size == 5)
+        TEST(decoded.aliases_count == 2 && decoded.aliases[0].size == 2 && decoded.aliases[1].size == 0)
+        TEST(decoded.note.size == 0)
+        TEST(decoded.which_contact == Names_email_tag && decoded.contact.email.size == 19)
+    }
+
+    {
+        PlainNames longer = PlainNames_init_zero;
+        Names decoded;
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer2, sizeof(buffer2));
+        pb_istream_t istream;
+
+        COMMENT("Test string longer than max_size")
+        strcpy(longer.first, "Seventeen letters");
+        TEST(pb_encode(&ostream, PlainNames_fields, &longer))
+        istream = pb_istream_from_buffer(buffer2, ostream.bytes_written);
+        TEST(!pb_decode(&istream, Names_fields, &decoded))
+        TEST(strcmp(PB_GET_ERROR(&istream), "bytes overflow") == 0)
+    }
+
+    {
+        Tag tag = Tag_init_zero, decoded;
+        pb_ostream_t ostream = pb_ostream_from_buffer(buffer1, sizeof(buffer1));
+        pb_istream_t istream;
+
+        COMMENT("Test generated functions")
+        SET_STRING(tag.name, "8letters");
+        TEST(Tag_encode(&ostream, &tag))
+        TEST(ostream.bytes_written == 10)
+        istream = pb_istream_from_buffer(buffer1, ostream.bytes_written);
+        TEST(Tag_decode(&istream, &decoded))
+        TEST(decoded.name.size == 8 && memcmp(decoded.name.bytes, "8letters", 8) == 0)
+    }
+
+    if (status != 0)
+        fprintf(stdout, "\n\nSome tests FAILED!\n");
+
+    return status;
+}